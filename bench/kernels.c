@@ -0,0 +1,432 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+/*
+ * Microbenchmarks of the libexfat kernels the tools spend their time in.
+ * Every case prints one line, "<name> <MB/s> MB/s <ns> ns/op", which is
+ * what bench/run.sh records and compares against a baseline.
+ */
+
+#define BENCH_BITMAP_BITS	(32U << 20)
+#define BENCH_NR_SETS		65536
+
+struct bench_case {
+	const char *name;
+	size_t bytes;		/* processed by one op, for the MB/s */
+	void (*op)(struct bench_case *bc);
+	size_t size;		/* the case's own parameter */
+};
+
+static double min_time = 0.2;
+static const char *filter;
+static volatile unsigned long long sink;
+static unsigned long long rnd_state = 0x2545F4914F6CDD1DULL;
+
+static char *buf;		/* buf_len random bytes */
+static size_t buf_len;
+/* @work takes the set and clear cases, @shadow stays as set up for diff */
+static struct exfat_bitmap work, shadow;
+static char *disk_bitmap;
+static unsigned short *upcase;
+static char *dir_buf;		/* entry sets, in dir_len bytes */
+static size_t dir_len;
+static struct exfat_dentry_set *sets;
+static unsigned int nr_sets;
+static struct exfat_name_set name_set;
+
+static unsigned long long rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void op_checksum32(struct bench_case *bc)
+{
+	sink += exfat_checksum32(buf, bc->size, 0);
+}
+
+/*
+ * The byte at a time loop exfat_checksum32() replaced, kept to measure
+ * it against. @boot skips VolumeFlags and PercentInUse.
+ */
+static unsigned int ref_checksum(const unsigned char *p, size_t len,
+		bool boot, unsigned int checksum)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (boot && (i == 106 || i == 107 || i == 112))
+			continue;
+		checksum = ((checksum & 1) ? 0x80000000 : 0) +
+			(checksum >> 1) + p[i];
+	}
+	return checksum;
+}
+
+static void op_checksum32_ref(struct bench_case *bc)
+{
+	sink += ref_checksum((unsigned char *)buf, bc->size, false, 0);
+}
+
+/* the 11 checksummed sectors of a boot region, @size is the sector size */
+static void op_boot_checksum(struct bench_case *bc)
+{
+	sink += exfat_calc_boot_checksum(buf, bc->size);
+}
+
+static void op_boot_checksum_ref(struct bench_case *bc)
+{
+	const unsigned char *p = (unsigned char *)buf;
+	unsigned int checksum;
+
+	checksum = ref_checksum(p, bc->size, true, 0);
+	sink += ref_checksum(p + bc->size, (CHECKSUM_NUM - 1) * bc->size,
+		false, checksum);
+}
+
+static void op_hash64(struct bench_case *bc)
+{
+	sink += exfat_hash64(buf, bc->size, 0);
+}
+
+static void op_upcase_checksum(struct bench_case *bc)
+{
+	sink += exfat_calc_upcase_checksum(exfat_upcase_table, bc->size);
+}
+
+static void op_upcase_expand(struct bench_case *bc)
+{
+	sink += exfat_upcase_expand(exfat_upcase_table, bc->size, upcase);
+}
+
+static void op_set_bit_range(struct bench_case *bc)
+{
+	unsigned int bit = rnd() % (BENCH_BITMAP_BITS - bc->size);
+
+	exfat_set_bit_range(work.bits, bit, bc->size);
+}
+
+static void op_clear_bit_range(struct bench_case *bc)
+{
+	unsigned int bit = rnd() % (BENCH_BITMAP_BITS - bc->size);
+
+	exfat_clear_bit_range(work.bits, bit, bc->size);
+}
+
+static void op_set_extent(struct bench_case *bc)
+{
+	unsigned int clu = rnd() % (BENCH_BITMAP_BITS - bc->size);
+
+	sink += exfat_bitmap_set_extent(&work, clu + EXFAT_FIRST_CLUSTER,
+		bc->size);
+}
+
+static void diff_count(void *arg, unsigned int clu, unsigned int nr_clus,
+		int kind)
+{
+	sink += nr_clus;
+}
+
+static void op_bitmap_diff(struct bench_case *bc)
+{
+	struct exfat_bitmap part = shadow;
+	struct exfat_bitmap_diff d;
+
+	part.nr_bits = bc->size;
+	part.len = bc->size / 8;
+	memset(&d, 0, sizeof(d));
+	exfat_bitmap_diff(&part, disk_bitmap, diff_count, NULL, &d);
+	sink += d.nr_used;
+}
+
+static void op_dentry_scan(struct bench_case *bc)
+{
+	struct exfat_dentry_iter iter;
+	struct exfat_dentry_set set;
+
+	exfat_dentry_iter_init(&iter, dir_buf, bc->size,
+		EXFAT_ITER_VERIFY_CHECKSUM);
+	while (exfat_dentry_iter_next(&iter, &set) > 0)
+		sink += set.checksum_ok;
+}
+
+static void op_upcase_name(struct bench_case *bc)
+{
+	unsigned short name[EXFAT_MAX_NAME_LEN];
+	unsigned int i, len;
+
+	for (i = 0; i < nr_sets; i++)
+		sink += exfat_upcase_name(upcase, &sets[i], name, &len);
+}
+
+static void op_name_set(struct bench_case *bc)
+{
+	unsigned short name[EXFAT_MAX_NAME_LEN];
+	unsigned int i, len;
+	int hash;
+
+	exfat_name_set_reset(&name_set);
+	for (i = 0; i < bc->size; i++) {
+		hash = exfat_upcase_name(upcase, &sets[i % nr_sets], name,
+			&len);
+		sink += exfat_name_set_insert(&name_set, hash, name, len);
+	}
+}
+
+/* four sizes of one kernel, @div of a size's units make a byte */
+#define SIZE_CASES(n, fn, div, s1, s2, s3, s4)			\
+	{ n "." #s1, (s1) / (div), fn, (s1) },			\
+	{ n "." #s2, (s2) / (div), fn, (s2) },			\
+	{ n "." #s3, (s3) / (div), fn, (s3) },			\
+	{ n "." #s4, (s4) / (div), fn, (s4) }
+
+static struct bench_case cases[] = {
+	SIZE_CASES("checksum32", op_checksum32, 1, 512, 4096, 65536, 1048576),
+	SIZE_CASES("checksum32_ref", op_checksum32_ref, 1, 512, 4096, 65536,
+		   1048576),
+	{ "boot_checksum.512", CHECKSUM_NUM * 512, op_boot_checksum, 512 },
+	{ "boot_checksum.4096", CHECKSUM_NUM * 4096, op_boot_checksum, 4096 },
+	{ "boot_checksum_ref.512", CHECKSUM_NUM * 512, op_boot_checksum_ref,
+	  512 },
+	{ "boot_checksum_ref.4096", CHECKSUM_NUM * 4096, op_boot_checksum_ref,
+	  4096 },
+	SIZE_CASES("hash64", op_hash64, 1, 512, 4096, 65536, 1048576),
+	{ "upcase_checksum", EXFAT_UPCASE_TABLE_SIZE, op_upcase_checksum,
+	  EXFAT_UPCASE_TABLE_SIZE },
+	{ "upcase_expand", EXFAT_UPCASE_TABLE_SIZE, op_upcase_expand,
+	  EXFAT_UPCASE_TABLE_SIZE },
+	/* bitmap cases are sized in bits, MB/s is of bitmap covered */
+	SIZE_CASES("set_bit_range", op_set_bit_range, 8, 8, 512, 32768,
+		   2097152),
+	SIZE_CASES("clear_bit_range", op_clear_bit_range, 8, 8, 512, 32768,
+		   2097152),
+	SIZE_CASES("bitmap_set_extent", op_set_extent, 8, 8, 512, 32768,
+		   2097152),
+	SIZE_CASES("bitmap_diff", op_bitmap_diff, 8, 65536, 1048576,
+		   8388608, 33554432),
+	SIZE_CASES("dentry_scan", op_dentry_scan, 1, 4096, 65536, 1048576,
+		   16777216),
+	/* MB/s of UTF-16 names, bytes filled in by bench_setup */
+	{ "upcase_name", 0, op_upcase_name, 0 },
+	{ "name_set.64", 0, op_name_set, 64 },
+	{ "name_set.4096", 0, op_name_set, 4096 },
+	{ "name_set.65536", 0, op_name_set, 65536 },
+};
+
+/* Directory of entry sets with random names of 8 to 64 characters */
+static int bench_setup_dir(size_t len)
+{
+	struct exfat_dentry_iter iter;
+	struct exfat_dentry_set set;
+	struct exfat_dentry *d;
+	unsigned int nr = len / DENTRY_SIZE, pos = 0, i;
+
+	dir_buf = calloc(1, len);
+	sets = calloc(BENCH_NR_SETS, sizeof(*sets));
+	if (!dir_buf || !sets)
+		return -1;
+	dir_len = len;
+	d = (struct exfat_dentry *)dir_buf;
+
+	for (;;) {
+		unsigned int name_len = rnd() % 57 + 8;
+		unsigned int nr_names = (name_len + EXFAT_NAME_ENTRY_CHARS - 1) /
+			EXFAT_NAME_ENTRY_CHARS;
+
+		if (pos + 2 + nr_names > nr)
+			break;
+		d[pos].type = EXFAT_FILE;
+		d[pos].file_num_ext = 1 + nr_names;
+		d[pos].file_attr = ATTR_ARCHIVE_LE;
+		d[pos + 1].type = EXFAT_STREAM;
+		d[pos + 1].stream_name_len = name_len;
+		for (i = 0; i < nr_names; i++)
+			d[pos + 2 + i].type = EXFAT_NAME;
+		for (i = 0; i < name_len; i++)
+			d[pos + 2 + i / EXFAT_NAME_ENTRY_CHARS].name_unicode[i %
+				EXFAT_NAME_ENTRY_CHARS] = cpu_to_le16('a' +
+				rnd() % 26);
+		d[pos].file_checksum = cpu_to_le16(
+			exfat_calc_dentry_set_checksum(&d[pos], 2 + nr_names));
+		pos += 2 + nr_names;
+	}
+
+	exfat_dentry_iter_init(&iter, dir_buf, dir_len, 0);
+	while (nr_sets < BENCH_NR_SETS &&
+	       exfat_dentry_iter_next(&iter, &set) > 0)
+		sets[nr_sets++] = set;
+	return 0;
+}
+
+static int bench_setup(void)
+{
+	size_t i;
+
+	buf_len = 1 << 20;
+	buf = malloc(buf_len);
+	disk_bitmap = malloc(BENCH_BITMAP_BITS / 8);
+	upcase = malloc(EXFAT_UPCASE_CHARS * sizeof(*upcase));
+	if (!buf || !disk_bitmap || !upcase ||
+	    exfat_bitmap_alloc(&work, BENCH_BITMAP_BITS) ||
+	    exfat_bitmap_alloc(&shadow, BENCH_BITMAP_BITS))
+		return -1;
+
+	for (i = 0; i < buf_len; i++)
+		buf[i] = rnd();
+	/* the reference is only worth comparing with if it agrees */
+	if (ref_checksum((unsigned char *)buf, buf_len, false, 0) !=
+	    exfat_checksum32(buf, buf_len, 0) ||
+	    ref_checksum((unsigned char *)buf + 512, (CHECKSUM_NUM - 1) * 512,
+		    false, ref_checksum((unsigned char *)buf, 512, true, 0)) !=
+	    exfat_calc_boot_checksum(buf, 512)) {
+		exfat_msg(EXFAT_ERROR, "checksum32 disagrees with the "
+			"reference loop\n");
+		return -1;
+	}
+	/* mostly agreeing, a diff in every few words of the bitmap */
+	for (i = 0; i < shadow.len; i++)
+		shadow.bits[i] = disk_bitmap[i] = i & 1 ? 0xFF : 0;
+	for (i = 0; i < shadow.len / 64; i++)
+		disk_bitmap[rnd() % shadow.len] ^= 1 << (rnd() % 8);
+
+	if (exfat_upcase_expand(exfat_upcase_table, EXFAT_UPCASE_TABLE_SIZE, upcase) ||
+	    bench_setup_dir(16 << 20))
+		return -1;
+	exfat_name_set_init(&name_set);
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		struct bench_case *bc = &cases[i];
+		size_t names = 0, j;
+
+		if (bc->op == op_upcase_name) {
+			bc->bytes = 0;
+			for (j = 0; j < nr_sets; j++)
+				bc->bytes += sets[j].stream->stream_name_len * 2;
+		} else if (bc->op == op_name_set) {
+			for (j = 0; j < bc->size; j++)
+				names += sets[j % nr_sets].stream->stream_name_len;
+			bc->bytes = names * 2;
+		}
+	}
+	return 0;
+}
+
+static void bench_cleanup(void)
+{
+	exfat_name_set_free(&name_set);
+	exfat_bitmap_free(&shadow);
+	exfat_bitmap_free(&work);
+	free(sets);
+	free(dir_buf);
+	free(upcase);
+	free(disk_bitmap);
+	free(buf);
+}
+
+/* Double the op count until a round takes min_time, report that round */
+static void bench_run(struct bench_case *bc)
+{
+	unsigned long long nr_ops = 1, i;
+	double start, elapsed;
+
+	bc->op(bc);
+	for (;;) {
+		start = now();
+		for (i = 0; i < nr_ops; i++)
+			bc->op(bc);
+		elapsed = now() - start;
+		if (elapsed >= min_time)
+			break;
+		nr_ops *= 2;
+	}
+
+	printf("%-28s %12.1f MB/s %14.1f ns/op\n", bc->name,
+		bc->bytes * nr_ops / elapsed / 1e6, elapsed * 1e9 / nr_ops);
+	fflush(stdout);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: exfat-bench [options]\n");
+	fprintf(stderr, "\t-t | --time=SECONDS\n");
+	fprintf(stderr, "\t-f | --filter=SUBSTRING\n");
+	fprintf(stderr, "\t-l | --list\n");
+	fprintf(stderr, "\t-h | --help\n");
+
+	exit(EXIT_FAILURE);
+}
+
+static struct option opts[] = {
+	{"time",		required_argument,	NULL,	't' },
+	{"filter",		required_argument,	NULL,	'f' },
+	{"list",		no_argument,		NULL,	'l' },
+	{"help",		no_argument,		NULL,	'h' },
+	{"?",			no_argument,		NULL,	'?' },
+	{NULL,			0,			NULL,	 0  }
+};
+
+int main(int argc, char *argv[])
+{
+	bool list = false;
+	unsigned int i;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "t:f:lh", opts, NULL)) != EOF)
+		switch (c) {
+		case 't':
+			min_time = atof(optarg);
+			if (min_time <= 0)
+				usage();
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'l':
+			list = true;
+			break;
+		case '?':
+		case 'h':
+		default:
+			usage();
+		}
+
+	if (list) {
+		for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+			printf("%s\n", cases[i].name);
+		return EXIT_SUCCESS;
+	}
+
+	if (bench_setup()) {
+		exfat_msg(EXFAT_ERROR, "Cannot set up benchmarks: out of memory\n");
+		bench_cleanup();
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		if (!filter || strstr(cases[i].name, filter))
+			bench_run(&cases[i]);
+
+	bench_cleanup();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-or-later
+#
+# Run the kernel microbenchmarks, then format and check sparse images of
+# growing size, and compare the results with a baseline saved before.
+#
+# Every result is a line "<name> <value> <unit>". Values in MB/s or GB/s
+# are better higher, everything else (ms, syscalls, KB) better lower.
+
+BENCH=./exfat-bench
+MKFS=../mkfs/mkfs.exfat
+FSCK=../fsck/fsck.exfat
+DIR=${TMPDIR:-/tmp}
+SIZES="1G 16G 256G 4T 16T"
+OUT=bench-results.txt
+FILTER=
+BASELINE=
+TOLERANCE=10
+KERNELS=1
+E2E=1
+
+usage()
+{
+	cat >&2 <<EOF
+Usage: run.sh [options]
+	-k BENCH	kernel benchmark program ($BENCH)
+	-m MKFS		mkfs.exfat to run ($MKFS)
+	-f FSCK		fsck.exfat to run ($FSCK)
+	-d DIR		where the sparse images go ($DIR)
+	-F FILTER	only the kernel benchmarks with FILTER in their name
+	-s SIZES	image sizes, quoted ("$SIZES")
+	-o FILE		write the results to FILE ($OUT)
+	-b FILE		compare with the results in FILE
+	-t PERCENT	worse than the baseline by this much fails ($TOLERANCE)
+	-K		skip the kernel benchmarks
+	-E		skip the end-to-end runs
+EOF
+	exit 1
+}
+
+while getopts "k:m:f:d:F:s:o:b:t:KEh" opt; do
+	case $opt in
+	k) BENCH=$OPTARG ;;
+	m) MKFS=$OPTARG ;;
+	f) FSCK=$OPTARG ;;
+	d) DIR=$OPTARG ;;
+	F) FILTER=$OPTARG ;;
+	s) SIZES=$OPTARG ;;
+	o) OUT=$OPTARG ;;
+	b) BASELINE=$OPTARG ;;
+	t) TOLERANCE=$OPTARG ;;
+	K) KERNELS= ;;
+	E) E2E= ;;
+	*) usage ;;
+	esac
+done
+
+IMG=$DIR/exfat-bench.$$.img
+STATS=$DIR/exfat-bench.$$.stats
+trap 'rm -f "$IMG" "$STATS"' EXIT INT TERM
+
+# Totals of the first, tool-wide set of counters of a --stats=json report
+e2e_record()
+{
+	awk -v tool="$1" -v size="$2" -v bytes="$3" '
+	/"label"/ { labels++ }
+	/"name"/ && labels == 1 {
+		for (i = 1; i < NF; i++) {
+			key = $i
+			gsub(/[",:{ ]/, "", key)
+			val = $(i + 1)
+			gsub(/[^0-9]/, "", val)
+			if (key == "wall_ns") wall += val
+			else if (key == "reads" || key == "writes") reqs += val
+			else if (key == "read_syscalls" ||
+				 key == "write_syscalls") calls += val
+		}
+	}
+	/^  "peak_rss_kb"/ { rss = $2 }
+	END {
+		name = "e2e." tool "." size
+		printf "%s.wall %.3f ms\n", name, wall / 1e6
+		printf "%s.throughput %.1f GB/s\n", name,
+			wall ? bytes / wall : 0
+		printf "%s.io_requests %d reqs\n", name, reqs
+		printf "%s.syscalls %d calls\n", name, calls
+		printf "%s.peak_rss %d KB\n", name, rss
+	}' "$STATS" | tee -a "$OUT"
+}
+
+e2e_run()
+{
+	size=$1
+
+	rm -f "$IMG"
+	if ! "$MKFS" --image="$size" --stats=json "$IMG" >/dev/null \
+	    2>"$STATS"; then
+		echo "e2e $size: mkfs failed, skipped (does $DIR take" \
+			"files this large?)" >&2
+		return
+	fi
+	bytes=$(wc -c <"$IMG")
+	e2e_record mkfs "$size" "$bytes"
+
+	if ! "$FSCK" --stats=json "$IMG" >/dev/null 2>"$STATS"; then
+		echo "e2e $size: fsck failed on a fresh image" >&2
+		FAILED=1
+		return
+	fi
+	e2e_record fsck "$size" "$bytes"
+}
+
+FAILED=
+: >"$OUT" || exit 1
+
+if [ -n "$KERNELS" ]; then
+	"$BENCH" ${FILTER:+-f "$FILTER"} >"$STATS" || FAILED=1
+	awk '{ print $1, $2, $3 }' "$STATS" | tee -a "$OUT"
+fi
+if [ -n "$E2E" ]; then
+	for size in $SIZES; do
+		e2e_run "$size"
+	done
+fi
+
+if [ -n "$BASELINE" ]; then
+	echo "Compared with $BASELINE, tolerance $TOLERANCE%:"
+	awk -v tol="$TOLERANCE" '
+	NR == FNR { base[$1] = $2; next }
+	$1 in base {
+		old = base[$1]
+		higher = $3 ~ /\/s$/
+		if (old == 0) {
+			change = 0
+		} else {
+			change = ($2 - old) * 100 / old
+			if (!higher && change)
+				change = -change
+		}
+		tag = change < -tol ? "REGRESSED" : change > tol ? "improved" : ""
+		printf "%-40s %14s -> %-14s %+7.1f%% %s\n", $1, old, $2,
+			change, tag
+		if (tag == "REGRESSED")
+			regressed++
+	}
+	END { exit regressed ? 1 : 0 }' "$BASELINE" "$OUT" || FAILED=1
+fi
+
+echo "Results in $OUT"
+[ -z "$FAILED" ]
@@ -0,0 +1,602 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+#include "dump.h"
+
+#define DUMP_MAX_DIR_SIZE	((unsigned long long)MAX_EXFAT_DENTRIES * \
+				 DENTRY_SIZE)
+/* UTF-8 takes at most 3 bytes for each UTF-16 unit of a name */
+#define DUMP_NAME_BUF_LEN	(EXFAT_MAX_NAME_LEN * 3 + 1)
+#define DUMP_INIT_SUBDIRS	16
+
+/*
+ * The tree is walked depth first in a single pass. Files are accounted
+ * for as their entry sets go by and only the subdirectories of the
+ * directories on the current path are kept, so memory does not grow with
+ * the number of files or clusters of the volume.
+ */
+
+struct dump_subdir {
+	unsigned int clu;
+	unsigned long long size;
+	bool contiguous;
+	size_t name_off;
+};
+
+struct dump_subdirs {
+	struct dump_subdir *dirs;
+	size_t nr_dirs, cap;
+	char *names;
+	size_t names_len, names_cap;
+};
+
+static inline unsigned int dump_hist_bucket(unsigned long long val)
+{
+	return val ? 64 - __builtin_clzll(val) : 0;
+}
+
+static inline void dump_hist_add(struct dump_hist *h, unsigned long long val)
+{
+	h->count[dump_hist_bucket(val)]++;
+}
+
+static inline unsigned int dump_name_unit(const struct exfat_dentry_set *set,
+		unsigned int i)
+{
+	return le16_to_cpu(set->name[i / EXFAT_NAME_ENTRY_CHARS].
+		name_unicode[i % EXFAT_NAME_ENTRY_CHARS]);
+}
+
+/* The name of @set in UTF-8, unpaired surrogates become U+FFFD */
+static size_t dump_name_utf8(const struct exfat_dentry_set *set, char *out)
+{
+	unsigned int len = set->stream->stream_name_len, i;
+	size_t n = 0;
+
+	for (i = 0; i < len; i++) {
+		unsigned int c = dump_name_unit(set, i);
+
+		if (c >= 0xD800 && c < 0xDC00 && i + 1 < len &&
+		    dump_name_unit(set, i + 1) >= 0xDC00 &&
+		    dump_name_unit(set, i + 1) < 0xE000) {
+			c = 0x10000 + ((c - 0xD800) << 10) +
+				(dump_name_unit(set, ++i) - 0xDC00);
+		} else if (c >= 0xD800 && c < 0xE000) {
+			c = 0xFFFD;
+		}
+
+		if (c < 0x80) {
+			out[n++] = c;
+		} else if (c < 0x800) {
+			out[n++] = 0xC0 | c >> 6;
+			out[n++] = 0x80 | (c & 0x3F);
+		} else if (c < 0x10000) {
+			out[n++] = 0xE0 | c >> 12;
+			out[n++] = 0x80 | (c >> 6 & 0x3F);
+			out[n++] = 0x80 | (c & 0x3F);
+		} else {
+			out[n++] = 0xF0 | c >> 18;
+			out[n++] = 0x80 | (c >> 12 & 0x3F);
+			out[n++] = 0x80 | (c >> 6 & 0x3F);
+			out[n++] = 0x80 | (c & 0x3F);
+		}
+	}
+	out[n] = '\0';
+	return n;
+}
+
+/* Print @s escaped for a JSON string, without the quotes */
+static void dump_json_escape(const char *s)
+{
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+}
+
+/* Append "/@name" to the path, returns the old length to restore it */
+static int dump_path_push(struct dump_walker *dw, const char *name,
+		size_t *old_len)
+{
+	size_t len = strlen(name);
+
+	if (dw->path_len + len + 2 > dw->path_cap) {
+		size_t cap = (dw->path_len + len + 2) * 2;
+		char *p = realloc(dw->path, cap);
+
+		if (!p)
+			return -1;
+		dw->path = p;
+		dw->path_cap = cap;
+	}
+
+	*old_len = dw->path_len;
+	dw->path[dw->path_len++] = '/';
+	memcpy(dw->path + dw->path_len, name, len + 1);
+	dw->path_len += len;
+	return 0;
+}
+
+static void dump_path_pop(struct dump_walker *dw, size_t old_len)
+{
+	dw->path_len = old_len;
+	dw->path[old_len] = '\0';
+}
+
+static void dump_list_file(struct dump_walker *dw, const char *name,
+		unsigned long long size, unsigned int nr_clus,
+		unsigned int fragments, bool contiguous)
+{
+	if (!dw->json) {
+		printf("%10u %10u %20llu %s/%s\n", fragments, nr_clus, size,
+			dw->path, name);
+		return;
+	}
+
+	printf("%s\n    {\"path\": \"", dw->nr_listed ? "," : "");
+	dump_json_escape(dw->path);
+	putchar('/');
+	dump_json_escape(name);
+	printf("\", \"size\": %llu, \"clusters\": %u, \"fragments\": %u, "
+		"\"contiguous\": %s}", size, nr_clus, fragments,
+		contiguous ? "true" : "false");
+	dw->nr_listed++;
+}
+
+/*
+ * Number of physically contiguous runs of the @nr_clus clusters starting
+ * at @clu, or -1 if the chain is broken.
+ */
+static int dump_count_fragments(struct exfat_volume *vol, unsigned int clu,
+		unsigned int nr_clus, bool contiguous)
+{
+	unsigned int fragments = 0, prev = 0, i;
+
+	if (!nr_clus)
+		return 0;
+
+	if (contiguous) {
+		if (!exfat_cluster_valid(vol, clu) ||
+		    clu - EXFAT_FIRST_CLUSTER + (unsigned long long)nr_clus >
+		    vol->clu_count)
+			return -1;
+		return 1;
+	}
+
+	for (i = 0; i < nr_clus; i++) {
+		if (!exfat_cluster_valid(vol, clu))
+			return -1;
+		if (!i || clu != prev + 1)
+			fragments++;
+		prev = clu;
+		clu = exfat_fat_next(vol, clu);
+		if (clu == EXFAT_EOF_CLUSTER && i + 1 < nr_clus)
+			return -1;
+	}
+	return fragments;
+}
+
+static void dump_file(struct dump_walker *dw, const struct exfat_dentry_set *set,
+		const char *name)
+{
+	struct exfat_volume *vol = dw->vol;
+	struct dump_stats *st = &dw->stats;
+	unsigned long long size = le64_to_cpu(set->stream->stream_size);
+	unsigned int clu = le32_to_cpu(set->stream->stream_start_clu);
+	bool contiguous = set->stream->stream_flags & EXFAT_SF_CONTIGUOUS;
+	unsigned long long nr_clus;
+	int fragments;
+
+	nr_clus = (size + vol->cluster_size - 1) >> vol->cluster_size_bits;
+	if (nr_clus > vol->clu_count) {
+		st->nr_bad++;
+		return;
+	}
+
+	fragments = dump_count_fragments(vol, clu, nr_clus, contiguous);
+	if (fragments < 0) {
+		st->nr_bad++;
+		return;
+	}
+
+	st->nr_files++;
+	st->file_bytes += size;
+	st->slack_bytes += (nr_clus << vol->cluster_size_bits) - size;
+	st->nr_fragments += fragments;
+	if ((unsigned long long)fragments > st->max_fragments)
+		st->max_fragments = fragments;
+	if (fragments > 1)
+		st->nr_fragmented++;
+	dump_hist_add(&st->frag_hist, fragments);
+	dump_hist_add(&st->size_hist, size);
+
+	if (nr_clus) {
+		if (contiguous) {
+			st->nr_contiguous++;
+			st->contiguous_clusters += nr_clus;
+		} else {
+			st->nr_chained++;
+			st->chained_clusters += nr_clus;
+			if (fragments == 1)
+				st->nr_chained_in_order++;
+		}
+	}
+
+	if (dw->list_files)
+		dump_list_file(dw, name, size, nr_clus, fragments, contiguous);
+}
+
+/*
+ * Read the directory at @clu into the directory buffer. @size is 0 for
+ * the root directory, whose length only the FAT knows. Returns the number
+ * of clusters, 0 if the chain is broken.
+ */
+static unsigned int dump_read_dir(struct dump_walker *dw, unsigned int clu,
+		unsigned long long size, bool contiguous)
+{
+	struct exfat_volume *vol = dw->vol;
+	struct exfat_readahead ra;
+	unsigned int nr_clus, i;
+	int fragments;
+	size_t len;
+
+	if (!size) {
+		unsigned int c = clu;
+
+		/* the root directory, follow its chain to find the size */
+		for (nr_clus = 0; exfat_cluster_valid(vol, c) &&
+		     nr_clus < vol->clu_count; c = exfat_fat_next(vol, c)) {
+			nr_clus++;
+			if (exfat_fat_next(vol, c) == EXFAT_EOF_CLUSTER)
+				break;
+		}
+		size = (unsigned long long)nr_clus << vol->cluster_size_bits;
+	}
+	if (!size || size > DUMP_MAX_DIR_SIZE)
+		return 0;
+
+	nr_clus = (size + vol->cluster_size - 1) >> vol->cluster_size_bits;
+	fragments = dump_count_fragments(vol, clu, nr_clus, contiguous);
+	if (fragments <= 0)
+		return 0;
+
+	len = (size_t)nr_clus << vol->cluster_size_bits;
+	if (len > dw->dir_buf_len) {
+		char *buf = realloc(dw->dir_buf, len);
+
+		if (!buf)
+			return 0;
+		dw->dir_buf = buf;
+		dw->dir_buf_len = len;
+	}
+
+	if (contiguous) {
+		const void *src = exfat_volume_read(vol, dw->dir_buf, len,
+			exfat_cluster_offset(vol, clu));
+
+		if (!src)
+			return 0;
+		if (src != dw->dir_buf)
+			memcpy(dw->dir_buf, src, len);
+	} else {
+		exfat_ra_start(&ra, vol, clu, nr_clus, false);
+		for (i = 0; i < nr_clus; i++) {
+			char *dst = dw->dir_buf +
+				((size_t)i << vol->cluster_size_bits);
+			const void *src = exfat_volume_read_cluster(vol, dst,
+				clu);
+
+			if (!src)
+				return 0;
+			if (src != dst)
+				memcpy(dst, src, vol->cluster_size);
+			exfat_ra_consume(&ra, 1);
+			clu = exfat_fat_next(vol, clu);
+		}
+	}
+
+	dw->stats.dir_clusters += nr_clus;
+	dw->stats.dir_fragments += fragments;
+	return nr_clus;
+}
+
+static int dump_add_subdir(struct dump_subdirs *subs,
+		const struct exfat_dentry_set *set, const char *name,
+		size_t name_len)
+{
+	struct dump_subdir *d;
+
+	if (subs->nr_dirs == subs->cap) {
+		size_t cap = subs->cap ? subs->cap * 2 : DUMP_INIT_SUBDIRS;
+
+		d = realloc(subs->dirs, cap * sizeof(*d));
+		if (!d)
+			return -1;
+		subs->dirs = d;
+		subs->cap = cap;
+	}
+	if (subs->names_len + name_len + 1 > subs->names_cap) {
+		size_t cap = (subs->names_len + name_len + 1) * 2;
+		char *p = realloc(subs->names, cap);
+
+		if (!p)
+			return -1;
+		subs->names = p;
+		subs->names_cap = cap;
+	}
+
+	d = &subs->dirs[subs->nr_dirs++];
+	d->clu = le32_to_cpu(set->stream->stream_start_clu);
+	d->size = le64_to_cpu(set->stream->stream_size);
+	d->contiguous = set->stream->stream_flags & EXFAT_SF_CONTIGUOUS;
+	d->name_off = subs->names_len;
+	memcpy(subs->names + subs->names_len, name, name_len + 1);
+	subs->names_len += name_len + 1;
+	return 0;
+}
+
+/*
+ * Mark the directory starting at @clu as walked. Returns true if it was
+ * already, the tree then reaches it twice or loops back to it.
+ */
+static bool dump_dir_seen(struct dump_walker *dw, unsigned int clu)
+{
+	unsigned int bit;
+	bool seen;
+
+	/* dump_read_dir() finds the chain broken */
+	if (!exfat_cluster_valid(dw->vol, clu))
+		return false;
+
+	bit = clu - EXFAT_FIRST_CLUSTER;
+	seen = dw->dirs_seen[bit >> 3] & (1 << (bit & 7));
+	dw->dirs_seen[bit >> 3] |= 1 << (bit & 7);
+	return seen;
+}
+
+static int dump_dir(struct dump_walker *dw, unsigned int clu,
+		unsigned long long size, bool contiguous, unsigned int depth)
+{
+	struct dump_stats *st = &dw->stats;
+	struct dump_subdirs subs;
+	struct exfat_dentry_iter iter;
+	struct exfat_dentry_set set;
+	char name[DUMP_NAME_BUF_LEN];
+	unsigned long long nr_sets = 0;
+	unsigned int nr_clus;
+	size_t i, name_len;
+	int ret = 0;
+
+	if (depth > st->max_depth)
+		st->max_depth = depth;
+	if (depth > DUMP_MAX_DEPTH) {
+		st->nr_bad++;
+		return 0;
+	}
+
+	nr_clus = dump_read_dir(dw, clu, size, contiguous);
+	if (!nr_clus) {
+		st->nr_bad++;
+		return 0;
+	}
+
+	memset(&subs, 0, sizeof(subs));
+	exfat_dentry_iter_init(&iter, dw->dir_buf,
+		(size_t)nr_clus << dw->vol->cluster_size_bits, 0);
+	while ((ret = exfat_dentry_iter_next(&iter, &set))) {
+		if (ret < 0) {
+			st->nr_bad++;
+			continue;
+		}
+
+		nr_sets++;
+		name_len = dump_name_utf8(&set, name);
+		if (!(le16_to_cpu(set.file->file_attr) & ATTR_SUBDIR)) {
+			dump_file(dw, &set, name);
+			continue;
+		}
+
+		st->nr_dirs++;
+		if (le64_to_cpu(set.stream->stream_size)) {
+			ret = dump_add_subdir(&subs, &set, name, name_len);
+			if (ret)
+				goto out;
+		} else {
+			dump_hist_add(&st->dir_hist, 0);
+		}
+	}
+	dump_hist_add(&st->dir_hist, nr_sets);
+
+	/* the directory buffer is reused from here on */
+	for (i = 0; i < subs.nr_dirs; i++) {
+		struct dump_subdir *d = &subs.dirs[i];
+		size_t old_len;
+
+		ret = dump_path_push(dw, subs.names + d->name_off, &old_len);
+		if (ret)
+			goto out;
+		/* stdout may be JSON, the diagnostic goes apart */
+		if (dump_dir_seen(dw, d->clu)) {
+			fprintf(stderr, "%s: directory cycle, not descending\n",
+				dw->path);
+			st->nr_bad++;
+			dump_path_pop(dw, old_len);
+			continue;
+		}
+		ret = dump_dir(dw, d->clu, d->size, d->contiguous, depth + 1);
+		dump_path_pop(dw, old_len);
+		if (ret)
+			goto out;
+	}
+out:
+	free(subs.dirs);
+	free(subs.names);
+	return ret;
+}
+
+/* Walk the whole tree of @dw->vol and gather @dw->stats */
+int dump_analyze(struct dump_walker *dw)
+{
+	int ret;
+
+	memset(&dw->stats, 0, sizeof(dw->stats));
+	dw->path_cap = DUMP_NAME_BUF_LEN;
+	dw->path = calloc(1, dw->path_cap);
+	dw->dirs_seen = calloc((dw->vol->clu_count + 7) / 8, 1);
+	if (!dw->path || !dw->dirs_seen) {
+		free(dw->path);
+		free(dw->dirs_seen);
+		return -1;
+	}
+	dw->path_len = 0;
+
+	dump_dir_seen(dw, dw->vol->root_clu);
+	ret = dump_dir(dw, dw->vol->root_clu, 0, false, 0);
+	if (ret)
+		exfat_msg(EXFAT_ERROR, "Cannot walk the tree: out of memory\n");
+
+	free(dw->dir_buf);
+	dw->dir_buf = NULL;
+	dw->dir_buf_len = 0;
+	free(dw->path);
+	dw->path = NULL;
+	free(dw->dirs_seen);
+	dw->dirs_seen = NULL;
+	return ret;
+}
+
+static unsigned int dump_perc(unsigned long long part,
+		unsigned long long whole)
+{
+	return whole ? part * 100 / whole : 0;
+}
+
+static void dump_print_hist(struct dump_walker *dw, const char *name,
+		const struct dump_hist *h, bool last)
+{
+	bool first = true;
+	unsigned int i;
+
+	if (dw->json)
+		printf("    \"%s\": [", name);
+	else
+		printf("%s :\n", name);
+
+	for (i = 0; i < DUMP_HIST_BUCKETS; i++) {
+		unsigned long long lo = i ? 1ULL << (i - 1) : 0;
+		unsigned long long hi = i < 64 ? (1ULL << i) - 1 : ~0ULL;
+
+		if (!h->count[i])
+			continue;
+		if (dw->json)
+			printf("%s{\"min\": %llu, \"max\": %llu, "
+				"\"count\": %llu}", first ? "" : ", ", lo, hi,
+				h->count[i]);
+		else
+			printf("  %20llu - %-20llu : %llu\n", lo, hi,
+				h->count[i]);
+		first = false;
+	}
+
+	if (dw->json)
+		printf("]%s\n", last ? "" : ",");
+}
+
+/*
+ * Print what dump_analyze() gathered along with the use of the cluster
+ * heap, as text or as the "summary" member of the JSON document.
+ */
+void dump_print_stats(struct dump_walker *dw)
+{
+	struct exfat_volume *vol = dw->vol;
+	struct dump_stats *st = &dw->stats;
+	const struct exfat_free_extent *largest;
+	unsigned long long nr_used, nr_alloc;
+	struct exfat_free_index fi;
+
+	if (exfat_free_index_build(&fi, vol->bitmap, vol->clu_count))
+		memset(&fi, 0, sizeof(fi));
+	largest = exfat_free_index_largest(&fi, 0);
+	nr_used = vol->clu_count - fi.nr_free;
+	nr_alloc = st->contiguous_clusters + st->chained_clusters;
+
+	if (!dw->json) {
+		printf("Clusters in use      : %llu (%u%%)\n", nr_used,
+			dump_perc(nr_used, vol->clu_count));
+		printf("Free clusters        : %llu\n", fi.nr_free);
+		printf("Free extents         : %u\n", fi.nr_exts);
+		if (largest)
+			printf("Largest free extent  : %u clusters at %u\n",
+				largest->nr_clus, largest->clu);
+		printf("Files                : %llu\n", st->nr_files);
+		printf("Directories          : %llu\n", st->nr_dirs);
+		printf("Maximum depth        : %u\n", st->max_depth);
+		printf("File bytes           : %llu\n", st->file_bytes);
+		printf("Slack bytes          : %llu (%u%%)\n", st->slack_bytes,
+			dump_perc(st->slack_bytes, nr_alloc <<
+				vol->cluster_size_bits));
+		printf("Contiguous files     : %llu, %llu clusters (%u%%)\n",
+			st->nr_contiguous, st->contiguous_clusters,
+			dump_perc(st->contiguous_clusters, nr_alloc));
+		printf("FAT chain files      : %llu, %llu clusters, "
+			"%llu in order\n", st->nr_chained,
+			st->chained_clusters, st->nr_chained_in_order);
+		printf("Fragmented files     : %llu\n", st->nr_fragmented);
+		printf("File fragments       : %llu, max %llu\n",
+			st->nr_fragments, st->max_fragments);
+		printf("Directory clusters   : %llu, %llu fragments\n",
+			st->dir_clusters, st->dir_fragments);
+		printf("Bad entries          : %llu\n", st->nr_bad);
+		dump_print_hist(dw, "Files by fragments", &st->frag_hist,
+			false);
+		dump_print_hist(dw, "Files by bytes", &st->size_hist, false);
+		dump_print_hist(dw, "Directories by entries", &st->dir_hist,
+			true);
+		exfat_free_index_free(&fi);
+		return;
+	}
+
+	printf("  \"summary\": {\n");
+	printf("    \"heap\": {\"clusters\": %u, \"used\": %llu, "
+		"\"free\": %llu, \"free_extents\": %u, "
+		"\"largest_free_extent\": %u},\n", vol->clu_count, nr_used,
+		fi.nr_free, fi.nr_exts, largest ? largest->nr_clus : 0);
+	printf("    \"files\": %llu,\n", st->nr_files);
+	printf("    \"directories\": %llu,\n", st->nr_dirs);
+	printf("    \"max_depth\": %u,\n", st->max_depth);
+	printf("    \"file_bytes\": %llu,\n", st->file_bytes);
+	printf("    \"slack_bytes\": %llu,\n", st->slack_bytes);
+	printf("    \"contiguous\": {\"files\": %llu, \"clusters\": %llu},\n",
+		st->nr_contiguous, st->contiguous_clusters);
+	printf("    \"fat_chain\": {\"files\": %llu, \"clusters\": %llu, "
+		"\"in_order\": %llu},\n", st->nr_chained,
+		st->chained_clusters, st->nr_chained_in_order);
+	printf("    \"contiguous_ratio\": %.4f,\n", nr_alloc ?
+		(double)st->contiguous_clusters / nr_alloc : 0.0);
+	printf("    \"fragmented_files\": %llu,\n", st->nr_fragmented);
+	printf("    \"fragments\": %llu,\n", st->nr_fragments);
+	printf("    \"max_fragments\": %llu,\n", st->max_fragments);
+	printf("    \"directory_clusters\": %llu,\n", st->dir_clusters);
+	printf("    \"directory_fragments\": %llu,\n", st->dir_fragments);
+	printf("    \"bad_entries\": %llu,\n", st->nr_bad);
+	dump_print_hist(dw, "fragments_histogram", &st->frag_hist, false);
+	dump_print_hist(dw, "size_histogram", &st->size_hist, false);
+	dump_print_hist(dw, "directory_entries_histogram", &st->dir_hist,
+		true);
+	printf("  }\n");
+	exfat_free_index_free(&fi);
+}
@@ -4,10 +4,170 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
 
 #include "exfat_ondisk.h"
+#include "exfat_tools.h"
+#include "dump.h"
 
-int main()
+static void usage(void)
 {
-	return 0;
+	fprintf(stderr, "Usage: dump.exfat [options] <device>\n");
+	fprintf(stderr, "\t-j | --json\n");
+	fprintf(stderr, "\t-f | --files\n");
+	fprintf(stderr, "\t     --stats[=text|json]\n");
+	fprintf(stderr, "\t-V | --version\n");
+	fprintf(stderr, "\t-v | --verbose\n");
+	fprintf(stderr, "\t-h | --help\n");
+
+	exit(EXIT_FAILURE);
+}
+
+static void show_version(void)
+{
+	printf("exfat-tools version : %s\n", EXFAT_TOOLS_VERSION);
+	exit(EXIT_FAILURE);
+}
+
+static struct option opts[] = {
+	{"json",		no_argument,		NULL,	'j' },
+	{"files",		no_argument,		NULL,	'f' },
+	{"stats",		optional_argument,	NULL,	'T' },
+	{"version",		no_argument,		NULL,	'V' },
+	{"verbose",		no_argument,		NULL,	'v' },
+	{"help",		no_argument,		NULL,	'h' },
+	{"?",			no_argument,		NULL,	'?' },
+	{NULL,			0,			NULL,	 0  }
+};
+
+static void exfat_dump_boot_sector(struct exfat_volume *vol)
+{
+	struct bsx64 *pbsx = &vol->pbr.bsx;
+
+	printf("Boot region          : %s\n",
+		vol->backup_boot ? "backup" : "main");
+	printf("Volume length        : %llu sectors\n",
+		(unsigned long long)le64_to_cpu(pbsx->vol_length));
+	printf("FAT offset           : %u sectors\n",
+		le32_to_cpu(pbsx->fat_offset));
+	printf("FAT length           : %u sectors\n",
+		le32_to_cpu(pbsx->fat_length));
+	printf("Cluster heap offset  : %u sectors\n",
+		le32_to_cpu(pbsx->clu_offset));
+	printf("Cluster count        : %u\n", vol->clu_count);
+	printf("Root cluster         : %u\n", vol->root_clu);
+	printf("Volume serial        : 0x%08x\n", vol->vol_serial);
+	printf("Filesystem version   : %u.%u\n", pbsx->fs_version[1],
+		pbsx->fs_version[0]);
+	printf("Volume flags         : 0x%04x\n", vol->vol_flags);
+	printf("Sector size          : %u\n", vol->sector_size);
+	printf("Cluster size         : %u\n", vol->cluster_size);
+	printf("Number of FATs       : %u\n", pbsx->num_fats);
+	printf("Percent in use       : %u\n", pbsx->perc_in_use);
+	printf("Bitmap cluster       : %u\n", vol->bitmap_clu);
+	printf("Upcase table cluster : %u\n", vol->ut_clu);
+}
+
+static void exfat_dump_boot_sector_json(struct exfat_volume *vol)
+{
+	struct bsx64 *pbsx = &vol->pbr.bsx;
+
+	printf("  \"volume\": {\n");
+	printf("    \"boot_region\": \"%s\",\n",
+		vol->backup_boot ? "backup" : "main");
+	printf("    \"volume_length\": %llu,\n",
+		(unsigned long long)le64_to_cpu(pbsx->vol_length));
+	printf("    \"fat_offset\": %u,\n", le32_to_cpu(pbsx->fat_offset));
+	printf("    \"fat_length\": %u,\n", le32_to_cpu(pbsx->fat_length));
+	printf("    \"cluster_heap_offset\": %u,\n",
+		le32_to_cpu(pbsx->clu_offset));
+	printf("    \"cluster_count\": %u,\n", vol->clu_count);
+	printf("    \"root_cluster\": %u,\n", vol->root_clu);
+	printf("    \"volume_serial\": %u,\n", vol->vol_serial);
+	printf("    \"filesystem_version\": \"%u.%u\",\n",
+		pbsx->fs_version[1], pbsx->fs_version[0]);
+	printf("    \"volume_flags\": %u,\n", vol->vol_flags);
+	printf("    \"sector_size\": %u,\n", vol->sector_size);
+	printf("    \"cluster_size\": %u,\n", vol->cluster_size);
+	printf("    \"percent_in_use\": %u\n", pbsx->perc_in_use);
+	printf("  },\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct exfat_volume vol;
+	struct dump_walker dw;
+	struct exfat_stats stats, *sts = &stats;
+	int stats_format = EXFAT_STATS_OFF;
+	int c, ret = EXIT_FAILURE;
+
+	memset(&dw, 0, sizeof(dw));
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "jfVvh", opts, NULL)) != EOF)
+		switch (c) {
+		case 'j':
+			dw.json = true;
+			break;
+		case 'f':
+			dw.list_files = true;
+			break;
+		case 'T':
+			stats_format = exfat_stats_parse_format(optarg);
+			if (stats_format < 0)
+				usage();
+			break;
+		case 'V':
+			show_version();
+			break;
+		case 'v':
+			print_level = EXFAT_DEBUG;
+			break;
+		case '?':
+		case 'h':
+		default:
+			usage();
+		}
+
+	if (argc - optind != 1)
+		usage();
+
+	exfat_stats_init(&stats, "dump", stats_format != EXFAT_STATS_OFF,
+		false);
+	exfat_stats_begin(&stats, "open");
+	if (exfat_volume_open(&vol, argv[optind], 0))
+		goto out;
+	exfat_stats_end(&stats);
+
+	dw.vol = &vol;
+	if (dw.json) {
+		printf("{\n");
+		exfat_dump_boot_sector_json(&vol);
+		if (dw.list_files)
+			printf("  \"files\": [");
+	} else {
+		exfat_dump_boot_sector(&vol);
+		if (dw.list_files)
+			printf("%10s %10s %20s %s\n", "Fragments", "Clusters",
+				"Size", "Path");
+	}
+
+	/* the tree is walked once, files are listed as they are found */
+	exfat_stats_begin(&stats, "analyze");
+	if (!dump_analyze(&dw)) {
+		exfat_stats_end(&stats);
+		if (dw.json && dw.list_files)
+			printf("\n  ],\n");
+		dump_print_stats(&dw);
+		if (dw.json)
+			printf("}\n");
+		ret = EXIT_SUCCESS;
+	}
+
+	exfat_volume_close(&vol);
+out:
+	if (stats_format)
+		exfat_stats_report(&sts, 1, stats_format, stderr);
+	return ret;
 }
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *  Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#ifndef _DUMP_H
+#define _DUMP_H
+
+/* bucket 0 holds 0, bucket n holds [2^(n-1), 2^n) */
+#define DUMP_HIST_BUCKETS	65
+/* deeper than this is taken for a directory loop */
+#define DUMP_MAX_DEPTH		1024
+
+struct dump_hist {
+	unsigned long long count[DUMP_HIST_BUCKETS];
+};
+
+struct dump_stats {
+	unsigned long long nr_files;
+	unsigned long long nr_dirs;
+	unsigned long long nr_bad;		/* bad entry sets or chains */
+	unsigned int max_depth;
+
+	/* files by allocation */
+	unsigned long long nr_contiguous;	/* NoFatChain */
+	unsigned long long nr_chained;		/* FAT chain */
+	unsigned long long nr_chained_in_order;	/* FAT chain, contiguous */
+	unsigned long long nr_fragmented;	/* more than one fragment */
+	unsigned long long nr_fragments;
+	unsigned long long max_fragments;
+	unsigned long long contiguous_clusters;
+	unsigned long long chained_clusters;
+
+	/* space */
+	unsigned long long file_bytes;
+	unsigned long long slack_bytes;		/* allocated past the end */
+	unsigned long long dir_clusters;
+	unsigned long long dir_fragments;
+
+	struct dump_hist frag_hist;		/* files by fragments */
+	struct dump_hist size_hist;		/* files by bytes */
+	struct dump_hist dir_hist;		/* directories by entry sets */
+};
+
+struct dump_walker {
+	struct exfat_volume *vol;
+	bool json;
+	bool list_files;
+	unsigned long long nr_listed;
+
+	/* the directory being parsed, reused for every directory */
+	char *dir_buf;
+	size_t dir_buf_len;
+	/* UTF-8 path of the directory being parsed */
+	char *path;
+	size_t path_len, path_cap;
+	/* a bit per cluster, set for the first cluster of each directory */
+	unsigned char *dirs_seen;
+
+	struct dump_stats stats;
+};
+
+int dump_analyze(struct dump_walker *dw);
+void dump_print_stats(struct dump_walker *dw);
+
+#endif /* !_DUMP_H */
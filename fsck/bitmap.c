@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+#include "fsck.h"
+
+static void fsck_report_diff(void *arg, unsigned int clu, unsigned int nr_clus,
+		int kind)
+{
+	struct fsck_bitmap_result *r = arg;
+
+	/*
+	 * the tree is trusted over the bitmap, but leaked clusters may
+	 * belong to an object the walk skipped and are only freed if it
+	 * reached every object
+	 */
+	if (r->queue.j && (kind == EXFAT_DIFF_UNMARKED || !r->keep_leaked) &&
+	    !exfat_journal_set_bits(&r->queue, clu, nr_clus,
+			kind == EXFAT_DIFF_UNMARKED))
+		r->nr_repaired += nr_clus;
+
+	if (r->nr_reports++ >= FSCK_MAX_REPORTS)
+		return;
+
+	if (kind == EXFAT_DIFF_LEAKED)
+		exfat_msg(EXFAT_ERROR,
+			"clusters %u-%u: marked in use but not owned\n",
+			clu, clu + nr_clus - 1);
+	else
+		exfat_msg(EXFAT_ERROR,
+			"clusters %u-%u: in use but marked free\n",
+			clu, clu + nr_clus - 1);
+}
+
+static void fsck_report_double(struct fsck_bitmap_result *r,
+		unsigned int clu, unsigned int nr_clus, unsigned int owner)
+{
+	if (r->nr_reports++ < FSCK_MAX_REPORTS)
+		exfat_msg(EXFAT_ERROR, "clusters %u-%u of %u: claimed twice\n",
+			clu, clu + nr_clus - 1, owner);
+}
+
+/* Directory extents are kept for the checkpoint, the others are not */
+static int fsck_keep_extent(struct exfat_walk_result *tree,
+		struct exfat_walk_extent *e)
+{
+	if (tree->nr_extents == tree->extents_cap) {
+		size_t cap = tree->extents_cap ? tree->extents_cap * 2 : 64;
+		struct exfat_walk_extent *p = realloc(tree->extents,
+			cap * sizeof(*p));
+
+		if (!p)
+			return -1;
+		tree->extents = p;
+		tree->extents_cap = cap;
+	}
+	tree->extents[tree->nr_extents++] = *e;
+	return 0;
+}
+
+/*
+ * Check the bitmap from the spilled extents, merged back in cluster
+ * order, without a shadow bitmap. Clusters under the extents seen so far
+ * are covered, an extent starting below the end of the coverage claims
+ * clusters twice, and the gaps between coverage must be free on disk.
+ */
+static int fsck_check_bitmap_merged(struct exfat_fsck *fsck)
+{
+	struct exfat_volume *vol = &fsck->vol;
+	struct fsck_bitmap_result *r = &fsck->bitmap;
+	struct exfat_extsort_iter it;
+	struct exfat_walk_extent e;
+	/* coverage not compared yet, and where it ends */
+	unsigned long long cov_start = EXFAT_FIRST_CLUSTER;
+	unsigned long long cov_end = EXFAT_FIRST_CLUSTER;
+	unsigned long long heap_end = (unsigned long long)vol->clu_count +
+		EXFAT_FIRST_CLUSTER;
+	int ret;
+
+	if (exfat_extsort_merge_begin(&fsck->spill, &it))
+		return -1;
+
+	while ((ret = exfat_extsort_merge_next(&it, &e)) > 0) {
+		unsigned long long start = e.start_clu;
+		unsigned long long end = start + e.nr_clus;
+
+		if (e.dir && fsck->keep_dir_extents &&
+		    fsck_keep_extent(&fsck->tree, &e)) {
+			exfat_msg(EXFAT_ERROR, "Cannot keep directory extents\n");
+			ret = -1;
+			break;
+		}
+
+		if (start < cov_end) {
+			unsigned int dup = (end < cov_end ? end : cov_end) -
+				start;
+
+			fsck_report_double(r, start, dup, e.owner);
+			r->nr_double += dup;
+		}
+		if (end <= cov_end)
+			continue;
+
+		if (start > cov_end) {
+			/* adjacent coverage is compared as one extent */
+			exfat_bitmap_diff_range(vol->bitmap, vol->clu_count,
+				cov_start, cov_end - cov_start, true,
+				fsck_report_diff, r, &r->diff);
+			exfat_bitmap_diff_range(vol->bitmap, vol->clu_count,
+				cov_end, start - cov_end, false,
+				fsck_report_diff, r, &r->diff);
+			cov_start = start;
+		}
+		cov_end = end;
+	}
+	exfat_extsort_merge_end(&it);
+	if (ret < 0)
+		return -1;
+
+	exfat_bitmap_diff_range(vol->bitmap, vol->clu_count, cov_start,
+		cov_end - cov_start, true, fsck_report_diff, r, &r->diff);
+	if (cov_end < heap_end)
+		exfat_bitmap_diff_range(vol->bitmap, vol->clu_count, cov_end,
+			heap_end - cov_end, false, fsck_report_diff, r,
+			&r->diff);
+	r->diff.perc_in_use = vol->clu_count ?
+		r->diff.nr_used * 100 / vol->clu_count : 0;
+	return 0;
+}
+
+/*
+ * Build the shadow bitmap from every extent the tree walk reached and
+ * compare it with the on-disk allocation bitmap. With a memory limit the
+ * extents were spilled and are merged back instead.
+ */
+int fsck_check_bitmap(struct exfat_fsck *fsck)
+{
+	struct exfat_volume *vol = &fsck->vol;
+	struct exfat_walk_result *tree = &fsck->tree;
+	struct fsck_bitmap_result *r = &fsck->bitmap;
+	unsigned int perc_in_use = vol->pbr.bsx.perc_in_use;
+	size_t i;
+
+	memset(r, 0, sizeof(*r));
+	if (fsck->journal)
+		exfat_journal_queue_init(&r->queue, fsck->journal);
+	r->keep_leaked = fsck_tree_errors(tree) > 0;
+	if (fsck->mem_limit) {
+		if (fsck_check_bitmap_merged(fsck)) {
+			exfat_journal_queue_flush(&r->queue);
+			return -1;
+		}
+		goto done;
+	}
+
+	if (exfat_bitmap_alloc(&fsck->shadow, vol->clu_count))
+		return -1;
+
+	for (i = 0; i < tree->nr_extents; i++) {
+		struct exfat_walk_extent *e = &tree->extents[i];
+		unsigned int dup;
+
+		dup = exfat_bitmap_set_extent(&fsck->shadow, e->start_clu,
+			e->nr_clus);
+		if (dup) {
+			fsck_report_double(r, e->start_clu, e->nr_clus,
+				e->owner);
+			r->nr_double += dup;
+		}
+	}
+
+	exfat_bitmap_diff(&fsck->shadow, vol->bitmap, fsck_report_diff, r,
+		&r->diff);
+done:
+	if (exfat_journal_queue_flush(&r->queue))
+		return -1;
+	if (r->queue.j && r->keep_leaked && r->diff.nr_leaked)
+		exfat_msg(EXFAT_ERROR, "%llu leaked clusters not freed, "
+			"the directory tree has errors\n", r->diff.nr_leaked);
+
+	/* 0xFF means the percentage is not available */
+	if (perc_in_use != 0xFF && perc_in_use != r->diff.perc_in_use)
+		exfat_msg(EXFAT_DEBUG, "percent in use %u, should be %u\n",
+			perc_in_use, r->diff.perc_in_use);
+
+	exfat_msg(EXFAT_DEBUG, "Bitmap: %llu used, %llu leaked, %llu unmarked, "
+		"%llu claimed twice\n", r->diff.nr_used, r->diff.nr_leaked,
+		r->diff.nr_unmarked, r->nr_double);
+	return 0;
+}
@@ -0,0 +1,419 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+#include "fsck.h"
+
+#define CKPT_MAGIC		"EXFATCKP"
+#define CKPT_VERSION		1
+
+/*
+ * A checkpoint is written after a clean full check. It holds a hash of
+ * every FSCK_CKPT_CHUNK_SIZE bytes of the FAT and the bitmap and of every
+ * directory cluster. When none of them changed, the metadata reachable
+ * from the root is what was found clean, and the checks can be skipped.
+ * The file is a header, the FAT and bitmap chunk hashes and then the
+ * directory clusters, all little endian.
+ */
+struct ckpt_disk_hdr {
+	char magic[8];
+	__le32 version;
+	__le32 vol_serial;
+	__le32 clu_count;
+	__le32 cluster_size;
+	__le32 ut_checksum;
+	__le32 chunk_size;
+	__le32 nr_fat_chunks;
+	__le32 nr_bitmap_chunks;
+	__le32 nr_dir_clus;
+	__le32 reserved;
+	__le64 upcase_hash;	/* names are checked against it */
+	__le64 nr_files;
+	__le64 nr_dirs;
+	__le64 nr_used;
+	__le64 hash;		/* of everything after the header */
+} __attribute__((packed));
+
+struct ckpt_disk_dir {
+	__le32 clu;
+	__le32 reserved;
+	__le64 hash;
+} __attribute__((packed));
+
+static unsigned int ckpt_nr_chunks(unsigned long long len)
+{
+	return (len + FSCK_CKPT_CHUNK_SIZE - 1) / FSCK_CKPT_CHUNK_SIZE;
+}
+
+static inline size_t ckpt_fat_len(struct exfat_volume *vol)
+{
+	return ((size_t)vol->clu_count + EXFAT_FIRST_CLUSTER) *
+		sizeof(__le32);
+}
+
+static inline size_t ckpt_bitmap_len(struct exfat_volume *vol)
+{
+	return ((size_t)vol->clu_count + 7) / 8;
+}
+
+static void ckpt_hash_chunks(const char *buf, size_t len, __u64 *hashes)
+{
+	unsigned int i;
+
+	for (i = 0; i < ckpt_nr_chunks(len); i++) {
+		size_t off = (size_t)i * FSCK_CKPT_CHUNK_SIZE;
+		size_t n = len - off < FSCK_CKPT_CHUNK_SIZE ? len - off :
+			FSCK_CKPT_CHUNK_SIZE;
+
+		hashes[i] = exfat_hash64(buf + off, n, 0);
+	}
+}
+
+static int ckpt_hash_cluster(struct exfat_volume *vol, char *buf,
+		unsigned int clu, __u64 *hash)
+{
+	const void *p = exfat_volume_read_cluster(vol, buf, clu);
+
+	if (!p)
+		return -1;
+	*hash = exfat_hash64(p, vol->cluster_size, clu);
+	return 0;
+}
+
+static __u64 ckpt_upcase_hash(struct exfat_volume *vol)
+{
+	if (!vol->upcase)
+		return 0;
+	return exfat_hash64(vol->upcase,
+		EXFAT_UPCASE_CHARS * sizeof(*vol->upcase), 0);
+}
+
+static int ckpt_dir_cmp(const void *a, const void *b)
+{
+	const struct fsck_ckpt_dir *x = a, *y = b;
+
+	return x->clu < y->clu ? -1 : x->clu > y->clu;
+}
+
+void fsck_checkpoint_free(struct fsck_checkpoint *ckpt)
+{
+	free(ckpt->fat_hashes);
+	free(ckpt->bitmap_hashes);
+	free(ckpt->dirs);
+	memset(ckpt, 0, sizeof(*ckpt));
+}
+
+/* Hash the metadata of the volume checked clean by the last full run */
+int fsck_checkpoint_build(struct exfat_fsck *fsck,
+		struct fsck_checkpoint *ckpt)
+{
+	struct exfat_volume *vol = &fsck->vol;
+	struct exfat_walk_result *tree = &fsck->tree;
+	unsigned int nr_dir_clus = 0, i, j;
+	char *buf;
+	size_t k;
+
+	memset(ckpt, 0, sizeof(*ckpt));
+	ckpt->vol_serial = vol->vol_serial;
+	ckpt->clu_count = vol->clu_count;
+	ckpt->cluster_size = vol->cluster_size;
+	ckpt->ut_checksum = vol->ut_checksum;
+	ckpt->upcase_hash = ckpt_upcase_hash(vol);
+	ckpt->nr_files = tree->nr_files;
+	ckpt->nr_dirs = tree->nr_dirs;
+	ckpt->nr_used = fsck->bitmap.diff.nr_used;
+	ckpt->nr_fat_chunks = ckpt_nr_chunks(ckpt_fat_len(vol));
+	ckpt->nr_bitmap_chunks = ckpt_nr_chunks(ckpt_bitmap_len(vol));
+
+	for (k = 0; k < tree->nr_extents; k++)
+		if (tree->extents[k].dir)
+			nr_dir_clus += tree->extents[k].nr_clus;
+
+	ckpt->fat_hashes = malloc((ckpt->nr_fat_chunks + 1) * sizeof(__u64));
+	ckpt->bitmap_hashes = malloc((ckpt->nr_bitmap_chunks + 1) *
+		sizeof(__u64));
+	ckpt->dirs = malloc((nr_dir_clus + 1) * sizeof(*ckpt->dirs));
+	buf = malloc(vol->cluster_size);
+	if (!ckpt->fat_hashes || !ckpt->bitmap_hashes || !ckpt->dirs || !buf)
+		goto err;
+
+	ckpt_hash_chunks((const char *)vol->fat, ckpt_fat_len(vol),
+		ckpt->fat_hashes);
+	ckpt_hash_chunks(vol->bitmap, ckpt_bitmap_len(vol),
+		ckpt->bitmap_hashes);
+
+	for (k = 0, j = 0; k < tree->nr_extents; k++) {
+		struct exfat_walk_extent *e = &tree->extents[k];
+
+		if (!e->dir)
+			continue;
+		for (i = 0; i < e->nr_clus; i++, j++) {
+			ckpt->dirs[j].clu = e->start_clu + i;
+			if (ckpt_hash_cluster(vol, buf, e->start_clu + i,
+					&ckpt->dirs[j].hash))
+				goto err;
+		}
+	}
+	ckpt->nr_dir_clus = nr_dir_clus;
+	qsort(ckpt->dirs, ckpt->nr_dir_clus, sizeof(*ckpt->dirs),
+		ckpt_dir_cmp);
+
+	free(buf);
+	return 0;
+err:
+	exfat_msg(EXFAT_ERROR, "Cannot build checkpoint\n");
+	free(buf);
+	fsck_checkpoint_free(ckpt);
+	return -1;
+}
+
+/*
+ * Write @ckpt to @path. It goes to a temporary file first, so a crash
+ * never leaves a torn checkpoint behind.
+ */
+int fsck_checkpoint_save(struct fsck_checkpoint *ckpt, const char *path)
+{
+	struct ckpt_disk_hdr hdr;
+	struct ckpt_disk_dir *dirs;
+	__le64 *chunks;
+	size_t nr_chunks = ckpt->nr_fat_chunks + ckpt->nr_bitmap_chunks;
+	size_t i, path_len = strlen(path);
+	char *tmp;
+	FILE *fp;
+	int ret = -1;
+
+	tmp = malloc(path_len + sizeof(".tmp"));
+	chunks = malloc((nr_chunks + 1) * sizeof(*chunks));
+	dirs = malloc((ckpt->nr_dir_clus + 1) * sizeof(*dirs));
+	if (!tmp || !chunks || !dirs)
+		goto out;
+	memcpy(tmp, path, path_len);
+	memcpy(tmp + path_len, ".tmp", sizeof(".tmp"));
+
+	for (i = 0; i < ckpt->nr_fat_chunks; i++)
+		chunks[i] = cpu_to_le64(ckpt->fat_hashes[i]);
+	for (i = 0; i < ckpt->nr_bitmap_chunks; i++)
+		chunks[ckpt->nr_fat_chunks + i] =
+			cpu_to_le64(ckpt->bitmap_hashes[i]);
+	for (i = 0; i < ckpt->nr_dir_clus; i++) {
+		dirs[i].clu = cpu_to_le32(ckpt->dirs[i].clu);
+		dirs[i].reserved = 0;
+		dirs[i].hash = cpu_to_le64(ckpt->dirs[i].hash);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic));
+	hdr.version = cpu_to_le32(CKPT_VERSION);
+	hdr.vol_serial = cpu_to_le32(ckpt->vol_serial);
+	hdr.clu_count = cpu_to_le32(ckpt->clu_count);
+	hdr.cluster_size = cpu_to_le32(ckpt->cluster_size);
+	hdr.ut_checksum = cpu_to_le32(ckpt->ut_checksum);
+	hdr.chunk_size = cpu_to_le32(FSCK_CKPT_CHUNK_SIZE);
+	hdr.nr_fat_chunks = cpu_to_le32(ckpt->nr_fat_chunks);
+	hdr.nr_bitmap_chunks = cpu_to_le32(ckpt->nr_bitmap_chunks);
+	hdr.nr_dir_clus = cpu_to_le32(ckpt->nr_dir_clus);
+	hdr.upcase_hash = cpu_to_le64(ckpt->upcase_hash);
+	hdr.nr_files = cpu_to_le64(ckpt->nr_files);
+	hdr.nr_dirs = cpu_to_le64(ckpt->nr_dirs);
+	hdr.nr_used = cpu_to_le64(ckpt->nr_used);
+	hdr.hash = cpu_to_le64(exfat_hash64(dirs,
+		ckpt->nr_dir_clus * sizeof(*dirs),
+		exfat_hash64(chunks, nr_chunks * sizeof(*chunks), 0)));
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		exfat_msg(EXFAT_ERROR, "open failed : %s, %s\n", tmp,
+			strerror(errno));
+		goto out;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(chunks, sizeof(*chunks), nr_chunks, fp) != nr_chunks ||
+	    fwrite(dirs, sizeof(*dirs), ckpt->nr_dir_clus, fp) !=
+	    ckpt->nr_dir_clus || fflush(fp) || fsync(fileno(fp))) {
+		exfat_msg(EXFAT_ERROR, "write failed : %s, %s\n", tmp,
+			strerror(errno));
+		fclose(fp);
+		unlink(tmp);
+		goto out;
+	}
+	fclose(fp);
+
+	if (rename(tmp, path)) {
+		exfat_msg(EXFAT_ERROR, "rename failed : %s, %s\n", path,
+			strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	exfat_msg(EXFAT_DEBUG, "Checkpoint : %u FAT chunks, %u bitmap chunks, "
+		"%u directory clusters\n", ckpt->nr_fat_chunks,
+		ckpt->nr_bitmap_chunks, ckpt->nr_dir_clus);
+	ret = 0;
+out:
+	free(tmp);
+	free(chunks);
+	free(dirs);
+	return ret;
+}
+
+/* Read a checkpoint written by fsck_checkpoint_save() */
+int fsck_checkpoint_load(struct fsck_checkpoint *ckpt, const char *path)
+{
+	struct ckpt_disk_hdr hdr;
+	struct ckpt_disk_dir *dirs = NULL;
+	__le64 *chunks = NULL;
+	size_t nr_chunks, i;
+	FILE *fp;
+	int ret = -1;
+
+	memset(ckpt, 0, sizeof(*ckpt));
+	fp = fopen(path, "r");
+	if (!fp) {
+		exfat_msg(EXFAT_DEBUG, "no checkpoint : %s, %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, CKPT_MAGIC, sizeof(hdr.magic)) ||
+	    le32_to_cpu(hdr.version) != CKPT_VERSION ||
+	    le32_to_cpu(hdr.chunk_size) != FSCK_CKPT_CHUNK_SIZE)
+		goto bad;
+
+	ckpt->vol_serial = le32_to_cpu(hdr.vol_serial);
+	ckpt->clu_count = le32_to_cpu(hdr.clu_count);
+	ckpt->cluster_size = le32_to_cpu(hdr.cluster_size);
+	ckpt->ut_checksum = le32_to_cpu(hdr.ut_checksum);
+	ckpt->nr_fat_chunks = le32_to_cpu(hdr.nr_fat_chunks);
+	ckpt->nr_bitmap_chunks = le32_to_cpu(hdr.nr_bitmap_chunks);
+	ckpt->nr_dir_clus = le32_to_cpu(hdr.nr_dir_clus);
+	ckpt->upcase_hash = le64_to_cpu(hdr.upcase_hash);
+	ckpt->nr_files = le64_to_cpu(hdr.nr_files);
+	ckpt->nr_dirs = le64_to_cpu(hdr.nr_dirs);
+	ckpt->nr_used = le64_to_cpu(hdr.nr_used);
+
+	/* the counts follow from the geometry, do not trust them blindly */
+	if (ckpt->nr_fat_chunks != ckpt_nr_chunks(((unsigned long long)
+	    ckpt->clu_count + EXFAT_FIRST_CLUSTER) * sizeof(__le32)) ||
+	    ckpt->nr_bitmap_chunks != ckpt_nr_chunks(
+	    ((unsigned long long)ckpt->clu_count + 7) / 8) ||
+	    ckpt->nr_dir_clus > ckpt->clu_count)
+		goto bad;
+
+	nr_chunks = ckpt->nr_fat_chunks + ckpt->nr_bitmap_chunks;
+	chunks = malloc((nr_chunks + 1) * sizeof(*chunks));
+	dirs = malloc((ckpt->nr_dir_clus + 1) * sizeof(*dirs));
+	ckpt->fat_hashes = malloc((ckpt->nr_fat_chunks + 1) * sizeof(__u64));
+	ckpt->bitmap_hashes = malloc((ckpt->nr_bitmap_chunks + 1) *
+		sizeof(__u64));
+	ckpt->dirs = malloc((ckpt->nr_dir_clus + 1) * sizeof(*ckpt->dirs));
+	if (!chunks || !dirs || !ckpt->fat_hashes || !ckpt->bitmap_hashes ||
+	    !ckpt->dirs)
+		goto out;
+
+	if (fread(chunks, sizeof(*chunks), nr_chunks, fp) != nr_chunks ||
+	    fread(dirs, sizeof(*dirs), ckpt->nr_dir_clus, fp) !=
+	    ckpt->nr_dir_clus || fgetc(fp) != EOF)
+		goto bad;
+	if (le64_to_cpu(hdr.hash) != exfat_hash64(dirs,
+	    ckpt->nr_dir_clus * sizeof(*dirs),
+	    exfat_hash64(chunks, nr_chunks * sizeof(*chunks), 0)))
+		goto bad;
+
+	for (i = 0; i < ckpt->nr_fat_chunks; i++)
+		ckpt->fat_hashes[i] = le64_to_cpu(chunks[i]);
+	for (i = 0; i < ckpt->nr_bitmap_chunks; i++)
+		ckpt->bitmap_hashes[i] =
+			le64_to_cpu(chunks[ckpt->nr_fat_chunks + i]);
+	for (i = 0; i < ckpt->nr_dir_clus; i++) {
+		ckpt->dirs[i].clu = le32_to_cpu(dirs[i].clu);
+		ckpt->dirs[i].hash = le64_to_cpu(dirs[i].hash);
+	}
+	ret = 0;
+	goto out;
+bad:
+	exfat_msg(EXFAT_ERROR, "%s is not a valid checkpoint\n", path);
+out:
+	fclose(fp);
+	free(chunks);
+	free(dirs);
+	if (ret)
+		fsck_checkpoint_free(ckpt);
+	return ret;
+}
+
+static unsigned int ckpt_changed_chunks(const char *buf, size_t len,
+		const __u64 *hashes)
+{
+	unsigned int nr = ckpt_nr_chunks(len), changed = 0, i;
+	__u64 *now = malloc((nr + 1) * sizeof(*now));
+
+	/* without memory everything counts as changed */
+	if (!now)
+		return nr + 1;
+
+	ckpt_hash_chunks(buf, len, now);
+	for (i = 0; i < nr; i++)
+		if (now[i] != hashes[i])
+			changed++;
+	free(now);
+	return changed;
+}
+
+/*
+ * Compare the volume with @ckpt. Returns 1 if nothing the checks look at
+ * changed since it was written, 0 if a full check is needed.
+ */
+int fsck_checkpoint_verify(struct exfat_fsck *fsck,
+		struct fsck_checkpoint *ckpt)
+{
+	struct exfat_volume *vol = &fsck->vol;
+	unsigned int fat_changed, bitmap_changed, i;
+	char *buf;
+	__u64 hash;
+
+	if (ckpt->vol_serial != vol->vol_serial ||
+	    ckpt->clu_count != vol->clu_count ||
+	    ckpt->cluster_size != vol->cluster_size ||
+	    ckpt->ut_checksum != vol->ut_checksum ||
+	    ckpt->upcase_hash != ckpt_upcase_hash(vol)) {
+		exfat_msg(EXFAT_DEBUG, "checkpoint is of another volume\n");
+		return 0;
+	}
+
+	fat_changed = ckpt_changed_chunks((const char *)vol->fat,
+		ckpt_fat_len(vol), ckpt->fat_hashes);
+	bitmap_changed = ckpt_changed_chunks(vol->bitmap,
+		ckpt_bitmap_len(vol), ckpt->bitmap_hashes);
+	if (fat_changed || bitmap_changed) {
+		exfat_msg(EXFAT_DEBUG, "checkpoint : %u FAT chunks, "
+			"%u bitmap chunks changed\n", fat_changed,
+			bitmap_changed);
+		return 0;
+	}
+
+	/* an unchanged FAT keeps every directory in the same clusters */
+	buf = malloc(vol->cluster_size);
+	if (!buf)
+		return 0;
+	for (i = 0; i < ckpt->nr_dir_clus; i++) {
+		if (!exfat_cluster_valid(vol, ckpt->dirs[i].clu) ||
+		    ckpt_hash_cluster(vol, buf, ckpt->dirs[i].clu, &hash) ||
+		    hash != ckpt->dirs[i].hash) {
+			exfat_msg(EXFAT_DEBUG, "checkpoint : directory cluster "
+				"%u changed\n", ckpt->dirs[i].clu);
+			free(buf);
+			return 0;
+		}
+	}
+	free(buf);
+	return 1;
+}
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+#include "fsck.h"
+
+static int fat_link_cmp(const void *a, const void *b)
+{
+	const struct exfat_bad_link *la = a, *lb = b;
+
+	if (la->clu != lb->clu)
+		return la->clu < lb->clu ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Report the broken links the tree walk found while following FAT chains.
+ * Only entries of objects in the tree are checked, those of free clusters
+ * and of NoFatChain objects are undefined. A link to a valid cluster is
+ * one closing a loop. A cluster two chains lead to is claimed twice, the
+ * bitmap check finds it. With --repair, a broken link ends its chain
+ * there, the tree check sees it too.
+ */
+int fsck_check_fat(struct exfat_fsck *fsck)
+{
+	struct exfat_walk_result *tree = &fsck->tree;
+	struct fsck_fat_result *res = &fsck->fat;
+	unsigned int nr_reports = 0;
+	size_t i;
+
+	memset(res, 0, sizeof(*res));
+	if (fsck->journal)
+		exfat_journal_queue_init(&res->queue, fsck->journal);
+
+	/* chains sharing a broken link all report it */
+	qsort(tree->bad_links, tree->nr_bad_links, sizeof(*tree->bad_links),
+		fat_link_cmp);
+	for (i = 0; i < tree->nr_bad_links; i++) {
+		struct exfat_bad_link *l = &tree->bad_links[i];
+
+		if (i && l->clu == tree->bad_links[i - 1].clu)
+			continue;
+
+		if (l->next == l->clu) {
+			if (nr_reports++ < FSCK_MAX_REPORTS)
+				exfat_msg(EXFAT_ERROR,
+					"cluster %u: FAT chain loops to itself\n",
+					l->clu);
+			res->nr_self_loop++;
+		} else if (exfat_cluster_valid(&fsck->vol, l->next)) {
+			if (nr_reports++ < FSCK_MAX_REPORTS)
+				exfat_msg(EXFAT_ERROR,
+					"cluster %u: FAT chain loops back to cluster %u\n",
+					l->clu, l->next);
+			res->nr_loops++;
+		} else if (l->next == EXFAT_BAD_CLUSTER) {
+			if (nr_reports++ < FSCK_MAX_REPORTS)
+				exfat_msg(EXFAT_ERROR,
+					"cluster %u: FAT chain runs into a bad cluster\n",
+					l->clu);
+			res->nr_bad_cluster++;
+		} else {
+			if (nr_reports++ < FSCK_MAX_REPORTS)
+				exfat_msg(EXFAT_ERROR,
+					"cluster %u: FAT entry 0x%08x out of range\n",
+					l->clu, l->next);
+			res->nr_out_of_range++;
+		}
+
+		if (res->queue.j && !exfat_journal_set_fat(&res->queue, l->clu,
+				EXFAT_EOF_CLUSTER))
+			res->nr_repaired++;
+	}
+
+	if (exfat_journal_queue_flush(&res->queue))
+		return -1;
+
+	exfat_msg(EXFAT_DEBUG, "FAT: %llu out of range, %llu self loops, "
+		"%llu loops, %llu bad clusters\n", res->nr_out_of_range,
+		res->nr_self_loop, res->nr_loops, res->nr_bad_cluster);
+	return 0;
+}
@@ -4,10 +4,334 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
 
 #include "exfat_ondisk.h"
+#include "exfat_tools.h"
+#include "fsck.h"
 
-int main()
+static void usage(void)
 {
+	fprintf(stderr, "Usage: fsck.exfat [options] <device>\n");
+	fprintf(stderr, "\t-j | --threads\n");
+	fprintf(stderr, "\t-r | --repair\n");
+	fprintf(stderr, "\t     --checkpoint=FILE\n");
+	fprintf(stderr, "\t-m | --max-memory=SIZE\n");
+	fprintf(stderr, "\t     --spill-dir=DIR\n");
+	fprintf(stderr, "\t     --stats[=text|json]\n");
+	fprintf(stderr, "\t-V | --version\n");
+	fprintf(stderr, "\t-v | --verbose\n");
+	fprintf(stderr, "\t-h | --help\n");
+
+	exit(FSCK_EXIT_OPERATION_ERROR);
+}
+
+static void show_version(void)
+{
+	printf("exfat-tools version : %s\n", EXFAT_TOOLS_VERSION);
+	exit(EXIT_FAILURE);
+}
+
+static int fsck_check_tree(struct exfat_fsck *fsck)
+{
+	struct exfat_walk_result *res = &fsck->tree;
+	unsigned long long nr_extents;
+	size_t i;
+	int ret;
+
+	if (fsck->mem_limit) {
+		exfat_extsort_init(&fsck->spill, fsck->spill_dir,
+			fsck->mem_limit);
+		ret = exfat_walk_tree_spill(&fsck->vol, fsck->nr_threads,
+			&fsck->spill, res);
+		nr_extents = fsck->spill.nr_extents;
+	} else {
+		ret = exfat_walk_tree(&fsck->vol, fsck->nr_threads, res);
+		nr_extents = res->nr_extents;
+	}
+	if (ret) {
+		exfat_msg(EXFAT_ERROR, "directory tree walk failed\n");
+		return -1;
+	}
+
+	if (res->nr_bad_sets)
+		exfat_msg(EXFAT_ERROR, "%llu malformed entry sets\n",
+			res->nr_bad_sets);
+	if (res->nr_bad_checksums)
+		exfat_msg(EXFAT_ERROR, "%llu entry set checksum mismatches\n",
+			res->nr_bad_checksums);
+	if (res->nr_bad_chains)
+		exfat_msg(EXFAT_ERROR, "%llu broken cluster chains\n",
+			res->nr_bad_chains);
+
+	if (res->nr_bad_hashes)
+		exfat_msg(EXFAT_ERROR, "%llu name hash mismatches\n",
+			res->nr_bad_hashes);
+	for (i = 0; i < res->nr_collisions && i < FSCK_MAX_REPORTS; i++)
+		exfat_msg(EXFAT_ERROR, "directory %u: duplicate name, "
+			"hash %04x\n", res->collisions[i].dir_clu,
+			res->collisions[i].name_hash);
+
+	exfat_msg(EXFAT_DEBUG, "Tree: %llu files, %llu dirs, %llu extents, "
+		"%zu duplicate names\n", res->nr_files, res->nr_dirs,
+		nr_extents, res->nr_collisions);
+	exfat_msg(EXFAT_DEBUG, "Readahead: %llu hints, %llu bytes\n",
+		fsck->vol.nr_ra_issued, fsck->vol.ra_bytes);
+	return 0;
+}
+
+/*
+ * Returns 1 if the volume is unchanged since the clean run that wrote the
+ * checkpoint at @path. A dirty volume is always checked again.
+ */
+static int fsck_try_checkpoint(struct exfat_fsck *fsck, const char *path,
+		const char *dev_name)
+{
+	struct fsck_checkpoint ckpt;
+	int ret;
+
+	if (fsck->vol.vol_flags & VOL_DIRTY) {
+		exfat_msg(EXFAT_DEBUG, "volume is dirty, full check\n");
+		return 0;
+	}
+	if (fsck_checkpoint_load(&ckpt, path))
+		return 0;
+
+	ret = fsck_checkpoint_verify(fsck, &ckpt);
+	if (ret == 1)
+		printf("%s: clean, unchanged since checkpoint, %llu files, "
+			"%llu directories, %llu/%u clusters\n", dev_name,
+			ckpt.nr_files, ckpt.nr_dirs, ckpt.nr_used,
+			ckpt.clu_count);
+	fsck_checkpoint_free(&ckpt);
+	return ret;
+}
+
+static void fsck_write_checkpoint(struct exfat_fsck *fsck, const char *path)
+{
+	struct fsck_checkpoint ckpt;
+
+	if (fsck_checkpoint_build(fsck, &ckpt))
+		return;
+	fsck_checkpoint_save(&ckpt, path);
+	fsck_checkpoint_free(&ckpt);
+}
+
+/*
+ * Repairs go through a writable descriptor of their own, the volume is
+ * read through its read-only one as before.
+ */
+static int fsck_open_repair(struct exfat_fsck *fsck, struct exfat_io *io,
+		struct exfat_journal *journal, const char *dev_name)
+{
+	int fd = open(dev_name, O_RDWR);
+
+	if (fd < 0) {
+		exfat_msg(EXFAT_ERROR, "open failed : %s, %s\n", dev_name,
+			strerror(errno));
+		return -1;
+	}
+	exfat_io_init(io, fd, EXFAT_IO_URING, 0);
+	exfat_journal_init(journal, &fsck->vol, io);
+	fsck->journal = journal;
 	return 0;
 }
+
+static void fsck_close_repair(struct exfat_fsck *fsck)
+{
+	struct exfat_io *io = fsck->journal->io;
+	int fd = io->fd;
+
+	exfat_journal_free(fsck->journal);
+	exfat_io_exit(io);
+	close(fd);
+	fsck->journal = NULL;
+}
+
+/*
+ * Commit the queued repairs. The volume stays dirty if there are errors
+ * left, or becomes clean if there are none. The errors left go to
+ * @nr_left. Returns -1 if the repairs could not be written.
+ */
+static int fsck_commit_repair(struct exfat_fsck *fsck,
+		unsigned long long nr_errors, unsigned long long *nr_left)
+{
+	unsigned long long nr_repaired = fsck->fat.nr_repaired +
+		fsck->bitmap.nr_repaired;
+	unsigned short flags = fsck->vol.vol_flags;
+
+	*nr_left = nr_errors - nr_repaired;
+	if (!nr_repaired)
+		return 0;
+	flags = *nr_left ? flags | VOL_DIRTY : flags & ~VOL_DIRTY;
+	return exfat_journal_commit(fsck->journal, flags);
+}
+
+static struct option opts[] = {
+	{"threads",		required_argument,	NULL,	'j' },
+	{"repair",		no_argument,		NULL,	'r' },
+	{"checkpoint",		required_argument,	NULL,	'C' },
+	{"max-memory",		required_argument,	NULL,	'm' },
+	{"spill-dir",		required_argument,	NULL,	'D' },
+	{"stats",		optional_argument,	NULL,	'T' },
+	{"version",		no_argument,		NULL,	'V' },
+	{"verbose",		no_argument,		NULL,	'v' },
+	{"help",		no_argument,		NULL,	'h' },
+	{"?",			no_argument,		NULL,	'?' },
+	{NULL,			0,			NULL,	 0  }
+};
+
+int main(int argc, char *argv[])
+{
+	struct exfat_fsck fsck;
+	struct exfat_stats stats, *sts = &stats;
+	int stats_format = EXFAT_STATS_OFF;
+	const char *ckpt_path = NULL;
+	struct exfat_journal journal;
+	struct exfat_io repair_io;
+	bool repair = false;
+	long nr_cpus;
+	unsigned long long nr_errors;
+	int c, ret = FSCK_EXIT_OPERATION_ERROR;
+
+	memset(&fsck, 0, sizeof(fsck));
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	fsck.nr_threads = nr_cpus > 0 ? nr_cpus : 1;
+
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "j:m:rVvh", opts, NULL)) != EOF)
+		switch (c) {
+		case 'j':
+			if (exfat_parse_count(optarg, EXFAT_MAX_THREADS,
+					&fsck.nr_threads))
+				usage();
+			break;
+		case 'r':
+			repair = true;
+			break;
+		case 'C':
+			ckpt_path = optarg;
+			break;
+		case 'm':
+			if (exfat_parse_size(optarg, &fsck.mem_limit) ||
+			    fsck.mem_limit < FSCK_MIN_MEM_LIMIT) {
+				exfat_msg(EXFAT_ERROR,
+					"invalid memory limit : %s\n", optarg);
+				usage();
+			}
+			break;
+		case 'D':
+			fsck.spill_dir = optarg;
+			break;
+		case 'T':
+			stats_format = exfat_stats_parse_format(optarg);
+			if (stats_format < 0)
+				usage();
+			break;
+		case 'V':
+			show_version();
+			break;
+		case 'v':
+			print_level = EXFAT_DEBUG;
+			break;
+		case '?':
+		case 'h':
+		default:
+			usage();
+		}
+
+	if (argc - optind != 1)
+		usage();
+	/* the checkpoint hashes directory clusters the merge hands back */
+	fsck.keep_dir_extents = ckpt_path && fsck.mem_limit;
+
+	exfat_stats_init(&stats, "fsck", stats_format != EXFAT_STATS_OFF,
+		false);
+	exfat_stats_begin(&stats, "open");
+	if (exfat_volume_open(&fsck.vol, argv[optind], 0))
+		goto out;
+	if (repair && fsck_open_repair(&fsck, &repair_io, &journal,
+			argv[optind]))
+		goto close;
+
+	if (ckpt_path) {
+		exfat_stats_begin(&stats, "checkpoint");
+		if (fsck_try_checkpoint(&fsck, ckpt_path, argv[optind]) == 1) {
+			ret = FSCK_EXIT_NO_ERRORS;
+			goto close;
+		}
+	}
+
+	exfat_stats_begin(&stats, "tree");
+	if (fsck_check_tree(&fsck))
+		goto free_tree;
+
+	/* the links of the chains the walk followed */
+	exfat_stats_begin(&stats, "FAT");
+	if (fsck_check_fat(&fsck))
+		goto free_tree;
+
+	exfat_stats_begin(&stats, "bitmap");
+	if (fsck_check_bitmap(&fsck))
+		goto free_tree;
+	exfat_stats_end(&stats);
+
+	nr_errors = fsck_fat_errors(&fsck.fat) + fsck_tree_errors(&fsck.tree) +
+		fsck_bitmap_errors(&fsck.bitmap);
+	if (nr_errors) {
+		unsigned long long nr_left = nr_errors;
+		int repair_ret = 0;
+
+		if (fsck.journal) {
+			exfat_stats_begin(&stats, "repair");
+			repair_ret = fsck_commit_repair(&fsck, nr_errors,
+				&nr_left);
+			exfat_stats_end(&stats);
+		}
+		printf("%s: %llu FAT errors, %llu directory errors, "
+			"%llu bitmap errors", argv[optind],
+			fsck_fat_errors(&fsck.fat),
+			fsck_tree_errors(&fsck.tree),
+			fsck_bitmap_errors(&fsck.bitmap));
+		if (!repair_ret && nr_left < nr_errors)
+			printf(", %llu repaired", nr_errors - nr_left);
+		printf("\n");
+		if (repair_ret)
+			ret = FSCK_EXIT_OPERATION_ERROR;
+		else if (nr_left)
+			ret = FSCK_EXIT_ERRORS_LEFT;
+		else
+			ret = FSCK_EXIT_CORRECTED;
+		/* what it vouched for no longer holds */
+		if (ckpt_path)
+			unlink(ckpt_path);
+	} else {
+		printf("%s: clean, %llu files, %llu directories, %llu/%u clusters\n",
+			argv[optind], fsck.tree.nr_files, fsck.tree.nr_dirs,
+			fsck.bitmap.diff.nr_used, fsck.vol.clu_count);
+		ret = FSCK_EXIT_NO_ERRORS;
+		if (ckpt_path) {
+			exfat_stats_begin(&stats, "save checkpoint");
+			fsck_write_checkpoint(&fsck, ckpt_path);
+		}
+	}
+
+	exfat_bitmap_free(&fsck.shadow);
+free_tree:
+	exfat_walk_result_free(&fsck.tree);
+	if (fsck.mem_limit)
+		exfat_extsort_free(&fsck.spill);
+close:
+	if (fsck.journal)
+		fsck_close_repair(&fsck);
+	exfat_volume_close(&fsck.vol);
+out:
+	if (stats_format)
+		exfat_stats_report(&sts, 1, stats_format, stderr);
+	return ret;
+}
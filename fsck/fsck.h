@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *  Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#ifndef _FSCK_H
+#define _FSCK_H
+
+/* exit codes, as documented in fsck(8) */
+#define FSCK_EXIT_NO_ERRORS		0x00
+#define FSCK_EXIT_CORRECTED		0x01
+#define FSCK_EXIT_ERRORS_LEFT		0x04
+#define FSCK_EXIT_OPERATION_ERROR	0x08
+#define FSCK_EXIT_USER_CANCEL		0x20
+
+/* errors of each kind printed per thread before only counting them */
+#define FSCK_MAX_REPORTS		16
+
+struct fsck_bitmap_result {
+	struct exfat_bitmap_diff diff;
+	unsigned long long nr_double;	/* clusters with two owners */
+	unsigned long long nr_repaired;
+	unsigned int nr_reports;
+	bool keep_leaked;		/* the tree walk missed some objects */
+	struct exfat_journal_queue queue;
+};
+
+struct fsck_fat_result {
+	unsigned long long nr_out_of_range;
+	unsigned long long nr_self_loop;
+	unsigned long long nr_loops;	/* back to a cluster earlier on */
+	unsigned long long nr_bad_cluster;	/* to a cluster marked bad */
+	unsigned long long nr_repaired;
+	struct exfat_journal_queue queue;
+};
+
+/* FAT and bitmap bytes covered by one checkpoint hash */
+#define FSCK_CKPT_CHUNK_SIZE		(1024 * 1024)
+
+struct fsck_ckpt_dir {
+	unsigned int clu;
+	__u64 hash;
+};
+
+struct fsck_checkpoint {
+	unsigned int vol_serial;
+	unsigned int clu_count;
+	unsigned int cluster_size;
+	unsigned int ut_checksum;
+	__u64 upcase_hash;
+	unsigned int nr_fat_chunks;
+	unsigned int nr_bitmap_chunks;
+	unsigned int nr_dir_clus;
+	__u64 *fat_hashes;
+	__u64 *bitmap_hashes;
+	struct fsck_ckpt_dir *dirs;	/* sorted by cluster */
+	/* what the clean run found, reported when it is reused */
+	unsigned long long nr_files;
+	unsigned long long nr_dirs;
+	unsigned long long nr_used;
+};
+
+/* the smallest --max-memory, below it only buffers would be left */
+#define FSCK_MIN_MEM_LIMIT		(1024 * 1024ULL)
+
+struct exfat_fsck {
+	struct exfat_volume vol;
+	unsigned int nr_threads;
+	/* bytes for the checking state, 0 to keep everything in memory */
+	unsigned long long mem_limit;
+	const char *spill_dir;
+	/* with a limit, the tree extents are spilled here */
+	struct exfat_extsort spill;
+	bool keep_dir_extents;
+	/* with --repair, the fixes are queued here and committed at the end */
+	struct exfat_journal *journal;
+	struct fsck_fat_result fat;
+	struct exfat_walk_result tree;
+	struct exfat_bitmap shadow;
+	struct fsck_bitmap_result bitmap;
+};
+
+int fsck_check_fat(struct exfat_fsck *fsck);
+int fsck_check_bitmap(struct exfat_fsck *fsck);
+
+int fsck_checkpoint_build(struct exfat_fsck *fsck,
+		struct fsck_checkpoint *ckpt);
+int fsck_checkpoint_save(struct fsck_checkpoint *ckpt, const char *path);
+int fsck_checkpoint_load(struct fsck_checkpoint *ckpt, const char *path);
+int fsck_checkpoint_verify(struct exfat_fsck *fsck,
+		struct fsck_checkpoint *ckpt);
+void fsck_checkpoint_free(struct fsck_checkpoint *ckpt);
+
+static inline unsigned long long fsck_fat_errors(struct fsck_fat_result *r)
+{
+	return r->nr_out_of_range + r->nr_self_loop + r->nr_loops +
+		r->nr_bad_cluster;
+}
+
+static inline unsigned long long fsck_bitmap_errors(
+		struct fsck_bitmap_result *r)
+{
+	return r->diff.nr_leaked + r->diff.nr_unmarked + r->nr_double;
+}
+
+static inline unsigned long long fsck_tree_errors(struct exfat_walk_result *r)
+{
+	return r->nr_bad_sets + r->nr_bad_checksums + r->nr_bad_chains +
+		r->nr_bad_hashes + r->nr_collisions;
+}
+
+#endif /* !_FSCK_H */
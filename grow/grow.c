@@ -0,0 +1,489 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+/* zeroes written at once into the grown part of the bitmap */
+#define GROW_ZERO_SIZE		(1024 * 1024)
+/* a file entry and at most 18 secondary entries */
+#define GROW_MAX_SET_ENTRIES	19
+
+struct grow_info {
+	struct exfat_volume vol;
+	struct exfat_io io;	/* writes, the volume is opened read-only */
+	unsigned long long new_size;
+
+	/* the bitmap, its entry in the root directory and its clusters */
+	unsigned long long bitmap_entry_off;
+	unsigned int bitmap_clus;
+
+	/* the growth reserve right after the bitmap, if there is one */
+	unsigned long long reserve_off;	/* of its file entry */
+	struct exfat_dentry reserve[GROW_MAX_SET_ENTRIES];
+	unsigned int reserve_nr_entries;
+	unsigned int reserve_clu, reserve_clus;
+
+	unsigned int new_clu_count;
+	unsigned long long new_bitmap_len;
+	unsigned int new_bitmap_clus;
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: exfat-grow [options] <device>\n");
+	fprintf(stderr, "\t-s | --size=SIZE[K|M|G|T]\n");
+	fprintf(stderr, "\t     --stats[=text|json]\n");
+	fprintf(stderr, "\t-V | --version\n");
+	fprintf(stderr, "\t-v | --verbose\n");
+	fprintf(stderr, "\t-h | --help\n");
+
+	exit(EXIT_FAILURE);
+}
+
+static void show_version(void)
+{
+	printf("exfat-tools version : %s\n", EXFAT_TOOLS_VERSION);
+	exit(EXIT_FAILURE);
+}
+
+static struct option opts[] = {
+	{"size",		required_argument,	NULL,	's' },
+	{"stats",		optional_argument,	NULL,	'T' },
+	{"version",		no_argument,		NULL,	'V' },
+	{"verbose",		no_argument,		NULL,	'v' },
+	{"help",		no_argument,		NULL,	'h' },
+	{"?",			no_argument,		NULL,	'?' },
+	{NULL,			0,			NULL,	 0  }
+};
+
+static bool grow_is_reserve(struct exfat_volume *vol,
+		const struct exfat_dentry_set *set)
+{
+	const char *name = EXFAT_GROW_RESERVE_NAME;
+	unsigned short upcased[EXFAT_MAX_NAME_LEN];
+	unsigned int len, i;
+
+	if (exfat_upcase_name(vol->upcase, set, upcased, &len) < 0 ||
+	    len != strlen(name))
+		return false;
+	for (i = 0; i < len; i++)
+		if (upcased[i] != (unsigned char)name[i])
+			return false;
+	return true;
+}
+
+/*
+ * Find the bitmap entry and the growth reserve in the root directory.
+ * Entry sets are looked for within each cluster, mkfs puts the reserve
+ * in the first one.
+ */
+static int grow_find_root_entries(struct grow_info *gi)
+{
+	struct exfat_volume *vol = &gi->vol;
+	unsigned int clu = vol->root_clu, nr_clus = 0, i;
+	unsigned int nr_dentries = vol->cluster_size / DENTRY_SIZE;
+	const struct exfat_dentry *ed;
+	void *buf;
+	int ret = -1;
+
+	buf = malloc(vol->cluster_size);
+	if (!buf)
+		return -1;
+
+	while (exfat_cluster_valid(vol, clu) && nr_clus++ < vol->clu_count) {
+		unsigned long long off = exfat_cluster_offset(vol, clu);
+		struct exfat_dentry_iter iter;
+		struct exfat_dentry_set set;
+		bool end = false;
+		int r;
+
+		ed = exfat_volume_read_cluster(vol, buf, clu);
+		if (!ed)
+			goto out;
+
+		for (i = 0; i < nr_dentries && !end; i++) {
+			if (ed[i].type == EXFAT_UNUSED)
+				end = true;
+			else if (ed[i].type == EXFAT_BITMAP &&
+				 !gi->bitmap_entry_off)
+				gi->bitmap_entry_off = off + i * DENTRY_SIZE;
+		}
+
+		exfat_dentry_iter_init(&iter, ed, vol->cluster_size,
+			EXFAT_ITER_VERIFY_CHECKSUM);
+		while (!gi->reserve_off && (r = exfat_dentry_iter_next(&iter,
+				&set))) {
+			if (r < 0 || !grow_is_reserve(vol, &set))
+				continue;
+			if (!set.checksum_ok) {
+				exfat_msg(EXFAT_ERROR, "growth reserve entry "
+					"checksum mismatch, run fsck first\n");
+				goto out;
+			}
+			gi->reserve_off = off + set.index * DENTRY_SIZE;
+			gi->reserve_nr_entries = set.nr_entries;
+			memcpy(gi->reserve, set.file,
+				set.nr_entries * DENTRY_SIZE);
+		}
+
+		if (end)
+			break;
+		clu = exfat_fat_next(vol, clu);
+	}
+
+	if (!gi->bitmap_entry_off) {
+		exfat_msg(EXFAT_ERROR, "no allocation bitmap entry\n");
+		goto out;
+	}
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Work out how far the volume can grow. The FAT mkfs sized for the
+ * largest size bounds the cluster count, and so do the bitmap clusters
+ * together with the reserve clusters that follow them.
+ */
+static int grow_plan(struct grow_info *gi)
+{
+	struct exfat_volume *vol = &gi->vol;
+	struct exfat_dentry *stream = &gi->reserve[1];
+	unsigned long long heap_clus, max_clus, room;
+	unsigned int i;
+
+	gi->bitmap_clus = round_up(vol->bitmap_len, vol->cluster_size) >>
+		vol->cluster_size_bits;
+	for (i = 0; i + 1 < gi->bitmap_clus; i++) {
+		if (exfat_fat_next(vol, vol->bitmap_clu + i) !=
+		    vol->bitmap_clu + i + 1) {
+			exfat_msg(EXFAT_ERROR,
+				"allocation bitmap is not contiguous\n");
+			return -1;
+		}
+	}
+
+	if (gi->reserve_off) {
+		unsigned long long size = le64_to_cpu(stream->stream_size);
+
+		gi->reserve_clu = le32_to_cpu(stream->stream_start_clu);
+		gi->reserve_clus = size >> vol->cluster_size_bits;
+		if (size && (!(stream->stream_flags & EXFAT_SF_CONTIGUOUS) ||
+			     size & (vol->cluster_size - 1) ||
+			     gi->reserve_clu != vol->bitmap_clu +
+			     gi->bitmap_clus)) {
+			exfat_msg(EXFAT_ERROR, "growth reserve does not follow "
+				"the allocation bitmap\n");
+			return -1;
+		}
+	}
+
+	heap_clus = (gi->new_size - vol->heap_byte_off) >>
+		vol->cluster_size_bits;
+	max_clus = vol->fat_byte_len / sizeof(__le32) - EXFAT_FIRST_CLUSTER;
+	room = ((unsigned long long)gi->bitmap_clus + gi->reserve_clus) <<
+		(vol->cluster_size_bits + 3);
+	if (max_clus > room)
+		max_clus = room;
+	if (max_clus > EXFAT_MAX_NUM_CLUSTER)
+		max_clus = EXFAT_MAX_NUM_CLUSTER;
+	if (heap_clus > max_clus) {
+		exfat_msg(EXFAT_ERROR, "%s leaves room for %llu clusters, "
+			"%llu more are not used\n",
+			max_clus == room ? "the bitmap" : "the FAT",
+			max_clus, heap_clus - max_clus);
+		heap_clus = max_clus;
+	}
+
+	gi->new_clu_count = heap_clus;
+	gi->new_bitmap_len = round_up(heap_clus, 8) / 8;
+	gi->new_bitmap_clus = round_up(gi->new_bitmap_len,
+		vol->cluster_size) >> vol->cluster_size_bits;
+	if (gi->new_bitmap_clus < gi->bitmap_clus)
+		gi->new_bitmap_clus = gi->bitmap_clus;
+
+	exfat_msg(EXFAT_DEBUG, "Clusters : %u -> %u, bitmap clusters : %u -> "
+		"%u, reserve clusters : %u\n", vol->clu_count,
+		gi->new_clu_count, gi->bitmap_clus, gi->new_bitmap_clus,
+		gi->reserve_clus);
+	return 0;
+}
+
+static int grow_set_dirty(struct grow_info *gi)
+{
+	__le16 flags = cpu_to_le16(gi->vol.vol_flags | VOL_DIRTY);
+
+	/* VolumeFlags is left out of the boot checksum for this */
+	return exfat_io_write(&gi->io, &flags, sizeof(flags),
+		offsetof(struct pbr, bsx.vol_flags));
+}
+
+/* Clear the bits of the new clusters, they start out free */
+static int grow_zero_bitmap(struct grow_info *gi)
+{
+	struct exfat_volume *vol = &gi->vol;
+	unsigned long long off = vol->clu_count / 8;
+	unsigned long long bitmap_off = exfat_cluster_offset(vol,
+		vol->bitmap_clu);
+	char *zero;
+	int ret = 0;
+
+	if (vol->clu_count % 8) {
+		char last = vol->bitmap[off] &
+			((1 << (vol->clu_count % 8)) - 1);
+
+		if (exfat_io_write(&gi->io, &last, 1, bitmap_off + off))
+			return -1;
+		off++;
+	}
+
+	zero = calloc(1, GROW_ZERO_SIZE);
+	if (!zero)
+		return -1;
+	while (off < gi->new_bitmap_len) {
+		size_t len = gi->new_bitmap_len - off < GROW_ZERO_SIZE ?
+			gi->new_bitmap_len - off : GROW_ZERO_SIZE;
+
+		if (exfat_io_write(&gi->io, zero, len, bitmap_off + off)) {
+			ret = -1;
+			break;
+		}
+		off += len;
+	}
+	free(zero);
+	return ret;
+}
+
+/*
+ * Take the head of the reserve for the bitmap: link its clusters to the
+ * bitmap chain and shrink the reserve file from the front. The rest of
+ * the reserve keeps the chain mkfs gave it.
+ */
+static int grow_take_reserve(struct grow_info *gi)
+{
+	struct exfat_volume *vol = &gi->vol;
+	unsigned int last = vol->bitmap_clu + gi->bitmap_clus - 1;
+	unsigned int extra = gi->new_bitmap_clus - gi->bitmap_clus, i;
+	struct exfat_dentry *stream = &gi->reserve[1];
+	unsigned long long size;
+	__le32 *links;
+	int ret;
+
+	if (!extra)
+		return 0;
+
+	links = malloc((extra + 1) * sizeof(*links));
+	if (!links)
+		return -1;
+	for (i = 0; i < extra; i++)
+		links[i] = cpu_to_le32(last + i + 1);
+	links[extra] = cpu_to_le32(EXFAT_EOF_CLUSTER);
+	ret = exfat_io_write(&gi->io, links, (extra + 1) * sizeof(*links),
+		vol->fat_byte_off + (unsigned long long)last * sizeof(*links));
+	free(links);
+	if (ret)
+		return -1;
+
+	size = (unsigned long long)(gi->reserve_clus - extra) <<
+		vol->cluster_size_bits;
+	stream->stream_start_clu = cpu_to_le32(size ? gi->reserve_clu + extra :
+		0);
+	stream->stream_size = cpu_to_le64(size);
+	stream->stream_valid_size = cpu_to_le64(size);
+	gi->reserve[0].file_checksum = cpu_to_le16(
+		exfat_calc_dentry_set_checksum(gi->reserve,
+			gi->reserve_nr_entries));
+	return exfat_io_write(&gi->io, gi->reserve,
+		gi->reserve_nr_entries * DENTRY_SIZE, gi->reserve_off);
+}
+
+static int grow_set_bitmap_len(struct grow_info *gi)
+{
+	__le64 len = cpu_to_le64(gi->new_bitmap_len);
+
+	return exfat_io_write(&gi->io, &len, sizeof(len),
+		gi->bitmap_entry_off + offsetof(struct exfat_dentry,
+			bitmap_size));
+}
+
+/* Rewrite a boot region with the new volume length and cluster count */
+static int grow_write_boot_region(struct grow_info *gi,
+		unsigned int region_sec, unsigned short vol_flags)
+{
+	struct exfat_volume *vol = &gi->vol;
+	size_t region_len = BACKUP_BOOT_SEC_NUM * vol->sector_size;
+	unsigned long long off = (unsigned long long)region_sec *
+		vol->sector_size;
+	struct bsx64 *pbsx;
+	char *region;
+	int ret = -1;
+
+	region = malloc(region_len);
+	if (!region)
+		return -1;
+	if (exfat_io_read(&gi->io, region, region_len, off))
+		goto out;
+	if (exfat_verify_boot_checksum(region, vol->sector_size)) {
+		exfat_msg(EXFAT_ERROR, "boot region at sector %u checksum "
+			"mismatch\n", region_sec);
+		goto out;
+	}
+
+	pbsx = &((struct pbr *)region)->bsx;
+	pbsx->vol_length = cpu_to_le64(gi->new_size >> vol->sector_size_bits);
+	pbsx->clu_count = cpu_to_le32(gi->new_clu_count);
+	pbsx->vol_flags = cpu_to_le16(vol_flags);
+	/* not counted again, the used clusters stay the same */
+	if (pbsx->perc_in_use <= 100)
+		pbsx->perc_in_use = (unsigned long long)pbsx->perc_in_use *
+			vol->clu_count / gi->new_clu_count;
+	exfat_set_boot_checksum(region, vol->sector_size);
+
+	ret = exfat_io_write(&gi->io, region, region_len, off);
+out:
+	free(region);
+	return ret;
+}
+
+/*
+ * Grow in the order a crash leaves the least to repair. The volume is
+ * marked dirty first. The new bitmap bytes are zeroed while they are
+ * still reserve file data, then the FAT, the reserve and the bitmap
+ * entries take the new clusters and the boot regions, the backup one
+ * first, the new cluster count. The main boot region is written last,
+ * with the dirty flag cleared.
+ */
+static int grow_volume(struct grow_info *gi)
+{
+	struct exfat_volume *vol = &gi->vol;
+
+	if (grow_set_dirty(gi) || exfat_io_sync(&gi->io))
+		goto err;
+	if (grow_zero_bitmap(gi) || exfat_io_sync(&gi->io))
+		goto err;
+	if (grow_take_reserve(gi) || grow_set_bitmap_len(gi) ||
+	    exfat_io_sync(&gi->io))
+		goto err;
+	if (grow_write_boot_region(gi, BACKUP_BOOT_SEC_NUM, vol->vol_flags) ||
+	    exfat_io_sync(&gi->io))
+		goto err;
+	if (grow_write_boot_region(gi, BOOT_SEC_NUM, vol->vol_flags) ||
+	    exfat_io_sync(&gi->io))
+		goto err;
+	return 0;
+err:
+	exfat_msg(EXFAT_ERROR, "growing failed, the volume is left dirty\n");
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct grow_info gi;
+	struct exfat_volume *vol = &gi.vol;
+	struct exfat_stats stats, *sts = &stats;
+	int stats_format = EXFAT_STATS_OFF;
+	unsigned long long size = 0;
+	int c, fd = -1, ret = EXIT_FAILURE;
+
+	memset(&gi, 0, sizeof(gi));
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "s:Vvh", opts, NULL)) != EOF)
+		switch (c) {
+		case 's':
+			if (exfat_parse_size(optarg, &size) || !size) {
+				exfat_msg(EXFAT_ERROR, "invalid size : %s\n",
+					optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'T':
+			stats_format = exfat_stats_parse_format(optarg);
+			if (stats_format < 0)
+				usage();
+			break;
+		case 'V':
+			show_version();
+			break;
+		case 'v':
+			print_level = EXFAT_DEBUG;
+			break;
+		case '?':
+		case 'h':
+		default:
+			usage();
+		}
+
+	if (argc - optind != 1)
+		usage();
+
+	exfat_stats_init(&stats, "grow", stats_format != EXFAT_STATS_OFF,
+		false);
+	exfat_stats_begin(&stats, "open");
+	if (exfat_volume_open(vol, argv[optind], 0))
+		goto out;
+
+	if (vol->backup_boot || vol->vol_flags & VOL_DIRTY) {
+		exfat_msg(EXFAT_ERROR, "%s is not clean, run fsck first\n",
+			argv[optind]);
+		goto close;
+	}
+
+	gi.new_size = size ? size : vol->dev_size;
+	if (gi.new_size > vol->dev_size) {
+		exfat_msg(EXFAT_ERROR, "size(%llu) exceeds the device(%llu)\n",
+			gi.new_size, vol->dev_size);
+		goto close;
+	}
+	if (gi.new_size < vol->heap_byte_off) {
+		exfat_msg(EXFAT_ERROR, "size(%llu) is smaller than the volume\n",
+			gi.new_size);
+		goto close;
+	}
+
+	if (grow_find_root_entries(&gi) || grow_plan(&gi))
+		goto close;
+	if (gi.new_clu_count <= vol->clu_count) {
+		printf("%s: %u clusters, nothing to grow\n", argv[optind],
+			vol->clu_count);
+		ret = EXIT_SUCCESS;
+		goto close;
+	}
+
+	fd = open(argv[optind], O_RDWR);
+	if (fd < 0) {
+		exfat_msg(EXFAT_ERROR, "open failed : %s, %s\n", argv[optind],
+			strerror(errno));
+		goto close;
+	}
+	exfat_io_init(&gi.io, fd, EXFAT_IO_PSYNC, 0);
+
+	exfat_stats_begin(&stats, "grow");
+	if (!grow_volume(&gi)) {
+		printf("%s: grown from %u to %u clusters\n", argv[optind],
+			vol->clu_count, gi.new_clu_count);
+		ret = EXIT_SUCCESS;
+	}
+	exfat_stats_end(&stats);
+
+	exfat_io_exit(&gi.io);
+	close(fd);
+close:
+	exfat_volume_close(vol);
+out:
+	if (stats_format)
+		exfat_stats_report(&sts, 1, stats_format, stderr);
+	return ret;
+}
@@ -91,6 +91,7 @@
 #define EXFAT_FREE_CLUSTER		(0)
 #define EXFAT_FIRST_CLUSTER		(2)
 #define EXFAT_REVERVED_CLUSTERS		(2)
+#define EXFAT_MAX_NUM_CLUSTER		(0xFFFFFFF5U)
 
 
 /* EXFAT BIOS parameter block (64 bytes) */
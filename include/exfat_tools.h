@@ -5,14 +5,22 @@
 
 #ifndef _EXFAT_TOOLS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
 #define EXFAT_MIN_NUM_SEC_VOL		(2048)
 #define EXFAT_MAX_NUM_SEC_VOL		((2 << 64) - 1)
 
 #define __round_mask(x, y) ((__typeof__(x))((y)-1))
 #define round_up(x, y) ((((x)-1) | __round_mask(x, y))+1)
+#define round_down(x, y) ((x) & ~__round_mask(x, y))
 
 /* Upcase tabel macro */
 #define EXFAT_UPCASE_TABLE_SIZE		(5836)
+/* room for the table padded to the largest sector, 4096 bytes */
+#define EXFAT_UPCASE_TABLE_PADDED	round_up(EXFAT_UPCASE_TABLE_SIZE, 4096)
 
 enum {
 	BOOT_SEC_NUM = 0,
@@ -21,21 +29,37 @@ enum {
 	OEM_SEC_NUM,
 	RESERVED_SEC_NUM,
 	CHECKSUM_NUM,
+	BACKUP_BOOT_SEC_NUM,
 };
 
+struct exfat_io;
+
 struct exfat_blk_dev {
 	int dev_fd;
+	struct exfat_io *io;	/* writes to the device go through it */
+	struct exfat_buf_pool *pool;	/* aligned buffers for the writes */
 	unsigned long long size;
 	unsigned int sector_size;
 	unsigned int sector_size_bits;
 	unsigned int num_sectors;
 	unsigned int num_clusters;
+	unsigned int discard_granularity;
+	unsigned int phys_sector_size;
+	unsigned int io_min;
+	unsigned int io_opt;
+	unsigned int align_off;
+	unsigned int erase_size;
 };
 
 struct exfat_user_input {
 	char dev_name[255];
 	unsigned int cluster_size;
 	unsigned int sec_per_clu;
+	bool discard;
+	bool direct;
+	int io_backend;
+	unsigned long long image_size;	/* create a sparse image file */
+	unsigned long long reserve_size; /* largest size to grow to */
 };
 
 void exfat_set_bit(struct exfat_blk_dev *bd, char *bitmap,
@@ -44,11 +68,594 @@ void exfat_set_bit(struct exfat_blk_dev *bd, char *bitmap,
 void exfat_clear_bit(struct exfat_blk_dev *bd, char *bitmap,
 		unsigned int clu);
 
+/*
+ * Set or clear @count consecutive bits starting at bit @clu. Whole bytes
+ * are filled at once, only the partial bytes at each end are masked.
+ */
+void exfat_set_bit_range(char *bitmap, unsigned int clu, unsigned int count);
+void exfat_clear_bit_range(char *bitmap, unsigned int clu,
+		unsigned int count);
+
+/* Parse a byte count with an optional binary K, M, G or T suffix */
+int exfat_parse_size(const char *str, unsigned long long *size);
+
+/* the most threads -j takes, far beyond any useful count */
+#define EXFAT_MAX_THREADS	1024
+
+int exfat_parse_count(const char *str, unsigned int max, unsigned int *val);
+
+/*
+ * Block I/O backends
+ */
+
+enum {
+	EXFAT_IO_PSYNC,		/* pread()/pwrite(), always available */
+	EXFAT_IO_URING,		/* io_uring, falls back to psync */
+};
+
+/* bypass the page cache, buffers have to be sector aligned */
+#define EXFAT_IO_DIRECT		0x0001
+
+#define EXFAT_IO_DEPTH		64
+
+struct exfat_io;
+struct exfat_buf_pool;
+
+struct exfat_io_deferred {
+	void *buf;
+	struct exfat_buf_pool *pool;	/* NULL if it came from malloc() */
+	size_t len;
+};
+
+struct exfat_io_ops {
+	const char *name;
+	int (*init)(struct exfat_io *io);
+	/* NULL if the backend cannot be read from */
+	int (*read)(struct exfat_io *io, void *buf, size_t len,
+			unsigned long long off);
+	int (*write)(struct exfat_io *io, const void *buf, size_t len,
+			unsigned long long off);
+	/* wait for queued requests, NULL if requests complete at once */
+	int (*flush)(struct exfat_io *io);
+	int (*register_buffer)(struct exfat_io *io, void *buf, size_t len);
+	void (*exit)(struct exfat_io *io);
+};
+
+struct exfat_io {
+	int fd;
+	unsigned int flags;
+	unsigned int depth;
+	const struct exfat_io_ops *ops;
+	void *priv;
+	int error;
+	/* buffers released at the next flush */
+	struct exfat_io_deferred *deferred;
+	size_t nr_deferred, deferred_cap;
+	unsigned long long nr_reads, bytes_read;
+	unsigned long long nr_writes, bytes_written;
+	bool no_writeback;	/* the file does not take sync_file_range() */
+};
+
+extern const struct exfat_io_ops exfat_io_uring_ops;
+
+/* requests of every exfat_io on a file, whatever its backend */
+struct exfat_io_counters {
+	unsigned long long nr_reads, bytes_read;
+	unsigned long long nr_writes, bytes_written;
+};
+
+void exfat_io_get_counters(struct exfat_io_counters *c, bool thread);
+
+int exfat_io_init(struct exfat_io *io, int fd, int backend,
+		unsigned int flags);
+void exfat_io_init_ops(struct exfat_io *io, const struct exfat_io_ops *ops,
+		void *priv);
+int exfat_io_read(struct exfat_io *io, void *buf, size_t len,
+		unsigned long long off);
+int exfat_io_write(struct exfat_io *io, const void *buf, size_t len,
+		unsigned long long off);
+int exfat_io_register_buffer(struct exfat_io *io, void *buf, size_t len);
+void exfat_io_defer_free(struct exfat_io *io, void *buf);
+void exfat_io_defer_put(struct exfat_io *io, struct exfat_buf_pool *pool,
+		void *buf, size_t len);
+int exfat_io_flush(struct exfat_io *io);
+int exfat_io_writeback(struct exfat_io *io, unsigned long long off,
+		unsigned long long len, bool wait);
+int exfat_io_sync(struct exfat_io *io);
+void exfat_io_exit(struct exfat_io *io);
+
+/*
+ * Aligned buffer pool
+ */
+
+#define EXFAT_POOL_MIN_SHIFT	12
+#define EXFAT_POOL_MAX_SHIFT	25	/* the largest cluster */
+#define EXFAT_POOL_NR_CLASSES	(EXFAT_POOL_MAX_SHIFT - \
+				 EXFAT_POOL_MIN_SHIFT + 1)
+#define EXFAT_POOL_MAX_ALIGN	(1024 * 1024)
+
+struct exfat_buf_pool {
+	pthread_mutex_t lock;
+	size_t align;
+	struct exfat_io *io;		/* new buffers are registered with it */
+	void *free[EXFAT_POOL_NR_CLASSES];
+	unsigned long long nr_allocated, nr_recycled;
+	unsigned long long bytes_allocated;
+};
+
+void exfat_pool_init(struct exfat_buf_pool *pool, unsigned int sector_size,
+		unsigned int io_opt, struct exfat_io *io);
+void *exfat_pool_get(struct exfat_buf_pool *pool, size_t len);
+void *exfat_pool_zalloc(struct exfat_buf_pool *pool, size_t len);
+void exfat_pool_put(struct exfat_buf_pool *pool, void *buf, size_t len);
+void exfat_pool_destroy(struct exfat_buf_pool *pool);
+
+/*
+ * Read-only volume access
+ */
+
+/* do not map the device, read metadata with pread() */
+#define EXFAT_VOL_NO_MMAP	0x0001
+
+struct exfat_volume {
+	int fd;
+	unsigned long long dev_size;
+	struct pbr pbr;		/* boot sector the volume was opened with */
+	bool backup_boot;	/* main boot region was corrupted */
+	unsigned int sector_size;
+	unsigned int sector_size_bits;
+	unsigned int cluster_size;
+	unsigned int cluster_size_bits;
+	unsigned long long fat_byte_off;
+	unsigned long long fat_byte_len;
+	unsigned long long heap_byte_off;
+	unsigned int clu_count;
+	unsigned int root_clu;
+	unsigned int vol_serial;
+	unsigned short vol_flags;
+
+	/* whole device mapped read-only, NULL with the pread fallback */
+	void *map;
+	struct exfat_io io;
+
+	__le32 *fat;
+	bool fat_alloced;
+
+	unsigned int bitmap_clu;
+	unsigned long long bitmap_len;
+	char *bitmap;
+	bool bitmap_alloced;
+
+	unsigned int ut_clu;
+	unsigned long long ut_len;
+	unsigned int ut_checksum;
+	/*
+	 * expanded upcase table, NULL if the on-disk one is unusable. A
+	 * volume with the built-in table shares exfat_upcase_default().
+	 */
+	const unsigned short *upcase;
+	bool upcase_alloced;
+
+	/* bytes each readahead keeps in flight, 0 disables it */
+	unsigned long long ra_window;
+	unsigned long long nr_ra_issued;
+	unsigned long long ra_bytes;
+};
+
+int exfat_volume_open(struct exfat_volume *vol, const char *name,
+		unsigned int flags);
+void exfat_volume_close(struct exfat_volume *vol);
+const void *exfat_volume_read(struct exfat_volume *vol, void *buf,
+		size_t len, unsigned long long off);
+const void *exfat_volume_read_cluster(struct exfat_volume *vol, void *buf,
+		unsigned int clu);
+
+/*
+ * Readahead of cluster chains
+ */
+
+#define EXFAT_RA_WINDOW		(4 * 1024 * 1024ULL)
+
+struct exfat_readahead {
+	struct exfat_volume *vol;
+	unsigned int next_clu;		/* first cluster not advised yet */
+	unsigned int nr_left;		/* clusters of the object left */
+	bool contiguous;
+	unsigned long long ahead;	/* advised but not consumed yet */
+	unsigned long long window;
+};
+
+void exfat_ra_start(struct exfat_readahead *ra, struct exfat_volume *vol,
+		unsigned int clu, unsigned int nr_clus, bool contiguous);
+void exfat_ra_consume(struct exfat_readahead *ra, unsigned int nr_clus);
+
+static inline bool exfat_cluster_valid(struct exfat_volume *vol,
+		unsigned int clu)
+{
+	return clu >= EXFAT_FIRST_CLUSTER &&
+		clu - EXFAT_FIRST_CLUSTER < vol->clu_count;
+}
+
+static inline unsigned long long exfat_cluster_offset(
+		struct exfat_volume *vol, unsigned int clu)
+{
+	return vol->heap_byte_off +
+		((unsigned long long)(clu - EXFAT_FIRST_CLUSTER) <<
+		 vol->cluster_size_bits);
+}
+
+static inline unsigned int exfat_fat_next(struct exfat_volume *vol,
+		unsigned int clu)
+{
+	return le32_to_cpu(vol->fat[clu]);
+}
+
+/*
+ * Directory entry sets
+ */
+
+/* verify SetChecksum of every entry set while iterating */
+#define EXFAT_ITER_VERIFY_CHECKSUM	0x0001
+
+struct exfat_dentry_set {
+	const struct exfat_dentry *file;
+	const struct exfat_dentry *stream;
+	const struct exfat_dentry *name;	/* first file name entry */
+	unsigned int nr_names;
+	unsigned int nr_entries;	/* file entry and its secondaries */
+	unsigned int index;		/* of the file entry */
+	bool checksum_ok;
+};
+
+struct exfat_dentry_iter {
+	const struct exfat_dentry *dentries;
+	unsigned int nr_dentries;
+	unsigned int pos;
+	unsigned int flags;
+};
+
+void exfat_dentry_iter_init(struct exfat_dentry_iter *iter, const void *buf,
+		size_t len, unsigned int flags);
+int exfat_dentry_iter_next(struct exfat_dentry_iter *iter,
+		struct exfat_dentry_set *set);
+
+/*
+ * Upcase table and file names
+ */
+
+#define EXFAT_UPCASE_CHARS	0x10000
+#define EXFAT_NAME_ENTRY_CHARS	15
+#define EXFAT_MAX_NAME_LEN	255
+
+struct exfat_name_set_entry {
+	unsigned short hash;
+	unsigned short len;
+	unsigned int off;	/* in the name pool */
+};
+
+/* upcased names of one directory, an open-addressing hash set */
+struct exfat_name_set {
+	unsigned int *slots;
+	unsigned int nr_slots;
+	struct exfat_name_set_entry *names;
+	unsigned int nr_names;
+	unsigned short *pool;
+	size_t pool_len, pool_cap;
+};
+
+/* the built-in compressed table, zero padded, and its checksum */
+extern const unsigned char exfat_upcase_table[EXFAT_UPCASE_TABLE_PADDED];
+extern const unsigned int exfat_upcase_table_checksum;
+
+int exfat_upcase_expand(const void *table, size_t len, unsigned short *flat);
+const unsigned short *exfat_upcase_default(void);
+int exfat_volume_load_upcase(struct exfat_volume *vol);
+int exfat_upcase_name(const unsigned short *upcase,
+		const struct exfat_dentry_set *set, unsigned short *name,
+		unsigned int *name_len);
+void exfat_name_set_init(struct exfat_name_set *ns);
+void exfat_name_set_reset(struct exfat_name_set *ns);
+void exfat_name_set_free(struct exfat_name_set *ns);
+int exfat_name_set_insert(struct exfat_name_set *ns, unsigned short hash,
+		const unsigned short *name, unsigned int len);
+
+/*
+ * Parallel directory tree walk
+ */
+
+/* AllocationPossible and NoFatChain stream flags */
+#define EXFAT_SF_ALLOC_POSSIBLE	0x01
+#define EXFAT_SF_CONTIGUOUS	0x02
+
+/*
+ * Hidden system file in the root directory holding the clusters right
+ * after the allocation bitmap, so exfat-grow can extend the bitmap into
+ * them. mkfs --reserve-growth creates it.
+ */
+#define EXFAT_GROW_RESERVE_NAME	"$GROWTH"
+
+struct exfat_walk_extent {
+	unsigned int start_clu;
+	unsigned int nr_clus;
+	unsigned int owner;	/* first cluster of the owning object */
+	bool dir;		/* the owner is a directory */
+};
+
+/* two entries in the directory starting at dir_clu have the same name */
+struct exfat_name_collision {
+	unsigned int dir_clu;
+	unsigned short name_hash;
+};
+
+/* the FAT entry of clu, in a chain being followed, points nowhere valid */
+struct exfat_bad_link {
+	unsigned int clu;
+	unsigned int next;
+};
+
+struct exfat_walk_result {
+	struct exfat_walk_extent *extents;
+	size_t nr_extents, extents_cap;
+	struct exfat_name_collision *collisions;
+	size_t nr_collisions, collisions_cap;
+	struct exfat_bad_link *bad_links;
+	size_t nr_bad_links, bad_links_cap;
+	unsigned long long nr_files;
+	unsigned long long nr_dirs;
+	unsigned long long nr_bad_sets;
+	unsigned long long nr_bad_checksums;
+	unsigned long long nr_bad_chains;
+	unsigned long long nr_bad_hashes;
+};
+
+struct exfat_extsort;
+
+int exfat_walk_tree(struct exfat_volume *vol, unsigned int nr_threads,
+		struct exfat_walk_result *res);
+int exfat_walk_tree_spill(struct exfat_volume *vol, unsigned int nr_threads,
+		struct exfat_extsort *xs, struct exfat_walk_result *res);
+void exfat_walk_result_free(struct exfat_walk_result *res);
+
+/*
+ * External sort of walk extents
+ */
+
+/* read ahead from each run while merging, and written at a time */
+#define EXFAT_EXTSORT_BUF_SIZE	(64 * 1024)
+
+/* sorted runs kept in temporary files, unlinked once created */
+struct exfat_extsort {
+	pthread_mutex_t lock;
+	const char *dir;
+	size_t run_extents;		/* extents sorted in memory at a time */
+	unsigned int max_fanin;		/* runs merged at once */
+	int *runs;
+	unsigned int nr_runs, runs_cap;
+	unsigned long long nr_extents;
+	unsigned int nr_passes;		/* intermediate merge passes */
+};
+
+struct extsort_cursor;
+
+struct exfat_extsort_iter {
+	struct exfat_extsort *xs;
+	struct extsort_cursor *cursors;
+	unsigned int *heap;
+	unsigned int nr_heap;
+};
+
+void exfat_extsort_init(struct exfat_extsort *xs, const char *dir,
+		size_t mem_limit);
+void exfat_extsort_free(struct exfat_extsort *xs);
+int exfat_extsort_add_run(struct exfat_extsort *xs,
+		struct exfat_walk_extent *exts, size_t nr);
+int exfat_extsort_merge_begin(struct exfat_extsort *xs,
+		struct exfat_extsort_iter *it);
+int exfat_extsort_merge_next(struct exfat_extsort_iter *it,
+		struct exfat_walk_extent *e);
+void exfat_extsort_merge_end(struct exfat_extsort_iter *it);
+
+/*
+ * Shadow allocation bitmap
+ */
+
+/* bit n stands for cluster n + EXFAT_FIRST_CLUSTER, like on disk */
+struct exfat_bitmap {
+	char *bits;
+	unsigned int nr_bits;
+	size_t len;
+};
+
+enum {
+	EXFAT_DIFF_LEAKED,	/* marked on disk, owned by nothing */
+	EXFAT_DIFF_UNMARKED,	/* in use, free on disk: double allocation */
+};
+
+struct exfat_bitmap_diff {
+	unsigned long long nr_leaked;
+	unsigned long long nr_unmarked;
+	unsigned long long nr_used;
+	unsigned int perc_in_use;
+};
+
+typedef void (*exfat_bitmap_diff_fn)(void *arg, unsigned int clu,
+		unsigned int nr_clus, int kind);
+
+int exfat_bitmap_alloc(struct exfat_bitmap *bm, unsigned int nr_clus);
+void exfat_bitmap_free(struct exfat_bitmap *bm);
+unsigned int exfat_bitmap_set_extent(struct exfat_bitmap *bm,
+		unsigned int clu, unsigned int nr);
+void exfat_bitmap_diff(const struct exfat_bitmap *shadow, const char *disk,
+		exfat_bitmap_diff_fn fn, void *arg, struct exfat_bitmap_diff *d);
+void exfat_bitmap_diff_range(const char *disk, unsigned int nr_bits,
+		unsigned int clu, unsigned int nr, bool used,
+		exfat_bitmap_diff_fn fn, void *arg, struct exfat_bitmap_diff *d);
+
+/*
+ * Repair journal
+ */
+
+/* patches a queue collects before it hands them to the journal */
+#define EXFAT_JOURNAL_CHUNK_PATCHES	1024
+/* the most bytes one commit write covers */
+#define EXFAT_JOURNAL_BATCH_SIZE	(1024 * 1024)
+/* unpatched bytes read and written again rather than split a batch */
+#define EXFAT_JOURNAL_MAX_GAP		(64 * 1024)
+
+/* set the @mask bits of the little-endian 32-bit word at @off to @value */
+struct exfat_journal_patch {
+	unsigned long long off;
+	__u32 value;
+	__u32 mask;
+};
+
+struct exfat_journal_chunk {
+	struct exfat_journal_chunk *next;
+	unsigned int nr;
+	struct exfat_journal_patch patches[EXFAT_JOURNAL_CHUNK_PATCHES];
+};
+
+struct exfat_journal {
+	struct exfat_volume *vol;
+	struct exfat_io *io;		/* the patches are written through it */
+	/* full chunks of every queue, pushed without a lock */
+	struct exfat_journal_chunk *published;
+	__le16 flags;			/* VolumeFlags while it is written */
+	unsigned long long nr_patches;	/* applied, after merging */
+	unsigned long long nr_merged;	/* into a patch of the same word */
+	unsigned long long nr_batches;
+};
+
+/* one per thread, only the thread that owns it adds to it */
+struct exfat_journal_queue {
+	struct exfat_journal *j;
+	struct exfat_journal_chunk *cur;
+	int error;
+};
+
+void exfat_journal_init(struct exfat_journal *j, struct exfat_volume *vol,
+		struct exfat_io *io);
+void exfat_journal_free(struct exfat_journal *j);
+void exfat_journal_queue_init(struct exfat_journal_queue *q,
+		struct exfat_journal *j);
+int exfat_journal_add(struct exfat_journal_queue *q, unsigned long long off,
+		__u32 value, __u32 mask);
+int exfat_journal_set_fat(struct exfat_journal_queue *q, unsigned int clu,
+		unsigned int next);
+int exfat_journal_set_bits(struct exfat_journal_queue *q, unsigned int clu,
+		unsigned int nr_clus, bool set);
+int exfat_journal_queue_flush(struct exfat_journal_queue *q);
+int exfat_journal_commit(struct exfat_journal *j, unsigned short vol_flags);
+
+/*
+ * Free space index
+ */
+
+struct exfat_free_extent {
+	unsigned int clu;
+	unsigned int nr_clus;
+};
+
+/* built once from a bitmap, the same extents in two orders */
+struct exfat_free_index {
+	struct exfat_free_extent *exts;		/* by cluster */
+	struct exfat_free_extent *by_len;	/* longest first */
+	unsigned int nr_exts;
+	unsigned long long nr_free;
+};
+
+int exfat_free_index_build(struct exfat_free_index *fi, const char *bitmap,
+		unsigned int nr_clus);
+void exfat_free_index_free(struct exfat_free_index *fi);
+const struct exfat_free_extent *exfat_free_index_largest(
+		const struct exfat_free_index *fi, unsigned int nth);
+const struct exfat_free_extent *exfat_free_index_best_fit(
+		const struct exfat_free_index *fi, unsigned int nr_clus);
+
+/*
+ * Phase timing and I/O counters
+ */
+
+#define EXFAT_STATS_MAX_PHASES	16
+
+enum {
+	EXFAT_STATS_OFF,
+	EXFAT_STATS_TEXT,
+	EXFAT_STATS_JSON,
+};
+
+struct exfat_stats_sample {
+	unsigned long long wall_ns;
+	unsigned long long cpu_ns;
+	struct exfat_io_counters io;		/* requests of the tool */
+	/* from /proc, zero where the kernel does not account task I/O */
+	unsigned long long nr_read_calls;	/* read syscalls */
+	unsigned long long nr_write_calls;	/* write syscalls */
+	unsigned long long storage_read;	/* from storage, page faults too */
+	unsigned long long storage_written;
+};
+
+struct exfat_stats_phase {
+	const char *name;
+	unsigned int count;			/* times the phase was entered */
+	struct exfat_stats_sample total;
+	unsigned long long peak_rss_kb;		/* of the process, at its end */
+};
+
+/* counters of the whole process, or of one thread doing one job */
+struct exfat_stats {
+	bool enabled;
+	bool thread;
+	const char *label;
+	struct exfat_stats_phase phases[EXFAT_STATS_MAX_PHASES];
+	unsigned int nr_phases;
+	int cur;
+	struct exfat_stats_sample start;
+	/* syscalls a sample makes itself, taken out of every phase */
+	unsigned long long sample_read_calls;
+};
+
+int exfat_stats_parse_format(const char *arg);
+void exfat_stats_init(struct exfat_stats *st, const char *label,
+		bool enabled, bool thread);
+void exfat_stats_begin(struct exfat_stats *st, const char *name);
+void exfat_stats_end(struct exfat_stats *st);
+void exfat_stats_report(struct exfat_stats **sts, unsigned int nr,
+		int format, FILE *fp);
+
+/*
+ * Checksums
+ */
+
+/* Rotate-and-add over @len bytes of @buf, continuing from @checksum */
+unsigned int exfat_checksum32(const void *buf, size_t len,
+		unsigned int checksum);
+
+/* Hash to detect changed metadata, not a checksum of the format */
+__u64 exfat_hash64(const void *buf, size_t len, __u64 seed);
+
+/* Checksum of the first 11 sectors of a boot region */
+unsigned int exfat_calc_boot_checksum(const void *region,
+		unsigned int sector_size);
+
+/* Checksum of an upcase table, built-in or custom */
+unsigned int exfat_calc_upcase_checksum(const void *table, size_t len);
+
+/* Checksum of a file entry set, SetChecksum itself is skipped */
+unsigned short exfat_calc_dentry_set_checksum(const struct exfat_dentry *set,
+		unsigned int nr_entries);
+
+/* Fill the checksum sector, it covers every sector of the region before it */
+void exfat_set_boot_checksum(void *region, unsigned int sector_size);
+
+/* Returns 0 if every entry of the checksum sector matches the region */
+int exfat_verify_boot_checksum(const void *region, unsigned int sector_size);
+
 /*
  * Exfat Print
  */
 
-unsigned int print_level;
+extern unsigned int print_level;
 
 #define EXFAT_ERROR	(0)
 #define EXFAT_DEBUG	(1)
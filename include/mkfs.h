@@ -6,30 +6,116 @@
 #ifndef _MKFS_H
 
 #define DEFAULT_CLUSTER_SIZE	(1024 * 1024)
+#define DEFAULT_ALIGN_SIZE	(1024 * 1024)
+#define MAX_ALIGN_SIZE		(32 * 1024 * 1024)
 #define DEFAULT_SECTOR_SIZE	(512)
 #define MIN_NUM_SECTOR		(2048)
 #define MAX_CLUSTER_SIZE	(32*1024*1024)
+#define FAT_WRITE_CHUNK_SIZE	(1024 * 1024)
+#define BITMAP_WINDOW_SIZE	(4 * 1024 * 1024)
+#define DISCARD_CHUNK_SIZE	(1024 * 1024 * 1024ULL)
+#define PROGRESS_STEP_SIZE	(8 * 1024 * 1024)
+#define IMAGE_BLOCK_SIZE	(4096)
+#define UPCASE_MERGE_SIZE	(128 * 1024)
 
 struct exfat_mkfs_info {
-	int total_clu_cnt;
-	int used_clu_cnt;
-	int fat_byte_off;
-	int fat_byte_len;
-	int clu_byte_off;
-	int bitmap_byte_off;
-	int bitmap_byte_len;
-	int ut_byte_off;
-	int ut_start_clu;
-	int ut_clus_off;
-	int ut_byte_len;
-	int root_byte_off;
-	int root_byte_len;
-	int root_start_clu;
+	unsigned int total_clu_cnt;
+	unsigned int used_clu_cnt;
+	unsigned long long fat_byte_off;
+	unsigned long long fat_byte_len;
+	unsigned long long clu_byte_off;
+	unsigned long long bitmap_byte_off;
+	unsigned long long bitmap_byte_len;
+	/* clusters the bitmap can grow into, 0 without --reserve-growth */
+	unsigned long long reserve_byte_off;
+	unsigned long long reserve_byte_len;
+	unsigned int reserve_start_clu;
+	unsigned long long ut_byte_off;
+	unsigned int ut_start_clu;
+	unsigned int ut_clus_off;
+	unsigned long long ut_byte_len;
+	unsigned long long root_byte_off;
+	unsigned long long root_byte_len;
+	unsigned int root_start_clu;
+	unsigned int align;	/* FAT and cluster heap alignment */
 };
 
-struct exfat_mkfs_info finfo;
+extern struct exfat_mkfs_info finfo;
 
-int exfat_create_upcase_table(struct exfat_blk_dev *bd,
-		struct exfat_user_input *ui);
+/* everything the layout depends on, the key of a metadata image */
+struct mkfs_geometry {
+	unsigned long long size;
+	unsigned int sector_size;
+	unsigned int phys_sector_size;
+	unsigned int io_min;
+	unsigned int io_opt;
+	unsigned int align_off;
+	unsigned int erase_size;
+	unsigned int cluster_size;
+	unsigned int reserve_clusters;	/* --reserve-growth, in clusters */
+};
+
+/* what a recorded write is part of, for the phase statistics */
+enum {
+	MKFS_PHASE_BOOT,
+	MKFS_PHASE_FAT,
+	MKFS_PHASE_BITMAP,
+	MKFS_PHASE_UPCASE,
+	MKFS_PHASE_ROOT,
+	MKFS_NR_PHASES,
+};
+
+extern const char *mkfs_phase_names[MKFS_NR_PHASES];
+
+/* a recorded write, buf is NULL for zeroes */
+struct mkfs_image_ext {
+	unsigned long long off;
+	size_t len;
+	void *buf;
+	unsigned int phase;
+};
+
+/* the metadata writes of one geometry, built once for all its devices */
+struct mkfs_image {
+	struct mkfs_image_ext *exts;
+	size_t nr_exts, exts_cap;
+	unsigned long long bytes;
+	size_t zero_len;		/* longest extent of zeroes */
+	unsigned long long discard_off;	/* start of the FAT */
+	struct mkfs_geometry geo;
+	struct exfat_buf_pool *pool;
+	unsigned int phase;		/* of the writes recorded now */
+};
+
+struct mkfs_device {
+	struct exfat_blk_dev bd;
+	struct exfat_user_input ui;
+	struct mkfs_geometry geo;
+	struct mkfs_image *img;
+	unsigned int serial;
+	unsigned long long done;	/* bytes written so far */
+	struct exfat_stats stats;	/* of the thread writing it */
+	int ret;
+	bool finished;			/* written and synced, or failed */
+};
+
+/* the progress of a finished device is not shown again */
+#define MKFS_SHOWN_FINISHED	UINT_MAX
+
+/* writes of one progress step, done once written back */
+struct mkfs_step {
+	unsigned long long start, end;	/* device range they cover */
+	unsigned long long bytes;
+};
+
+void mkfs_image_init(struct mkfs_image *img, struct exfat_buf_pool *pool,
+		struct exfat_io *io);
+void mkfs_image_free(struct mkfs_image *img);
+int mkfs_image_save(struct mkfs_image *img, const char *path);
+size_t mkfs_image_next_run(const char *buf, size_t len, size_t pos,
+		size_t *run_len);
+int mkfs_image_save_block_map(struct mkfs_image *img, const char *path);
+int mkfs_image_load(struct mkfs_image *img, struct exfat_buf_pool *pool,
+		const char *path);
 
 #endif /* !_MKFS_H */
@@ -0,0 +1,429 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* AVX2 is built in whatever the build flags, and used if the CPU has it */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BITMAP_AVX2
+#include <immintrin.h>
+#endif
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+/* The bitmap is handled in 64-bit little endian words */
+#define BITMAP_WORD_BITS	64
+
+int exfat_bitmap_alloc(struct exfat_bitmap *bm, unsigned int nr_clus)
+{
+	/* whole words, so the diff never needs a byte tail */
+	bm->nr_bits = nr_clus;
+	bm->len = round_up(((size_t)nr_clus + 7) / 8, sizeof(__u64));
+	bm->bits = calloc(1, bm->len ? bm->len : sizeof(__u64));
+	if (!bm->bits) {
+		exfat_msg(EXFAT_ERROR, "Cannot allocate bitmap: out of memory\n");
+		return -1;
+	}
+	return 0;
+}
+
+void exfat_bitmap_free(struct exfat_bitmap *bm)
+{
+	free(bm->bits);
+	memset(bm, 0, sizeof(*bm));
+}
+
+static inline __u64 bitmap_word(const char *bits, size_t idx)
+{
+	__u64 w;
+
+	memcpy(&w, bits + idx * sizeof(w), sizeof(w));
+	return le64_to_cpu(w);
+}
+
+/* Number of bits already set in [@bit, @bit + @nr) */
+static unsigned int bitmap_count_range(const char *bits, unsigned int bit,
+		unsigned int nr)
+{
+	const unsigned char *p = (const unsigned char *)bits;
+	unsigned int count = 0, end = bit + nr;
+
+	for (; bit < end && bit & 7; bit++)
+		count += p[bit >> 3] >> (bit & 7) & 1;
+	for (; bit + 8 <= end; bit += 8)
+		count += __builtin_popcount(p[bit >> 3]);
+	for (; bit < end; bit++)
+		count += p[bit >> 3] >> (bit & 7) & 1;
+	return count;
+}
+
+/*
+ * Mark the @nr clusters starting at @clu in use. Returns the number of
+ * them that were already marked, i.e. claimed by another owner.
+ */
+unsigned int exfat_bitmap_set_extent(struct exfat_bitmap *bm,
+		unsigned int clu, unsigned int nr)
+{
+	unsigned int bit = clu - EXFAT_FIRST_CLUSTER, dup;
+
+	if (bit >= bm->nr_bits || nr > bm->nr_bits - bit)
+		return 0;
+
+	dup = bitmap_count_range(bm->bits, bit, nr);
+	exfat_set_bit_range(bm->bits, bit, nr);
+	return dup;
+}
+
+struct bitmap_run {
+	exfat_bitmap_diff_fn fn;
+	void *arg;
+	unsigned int start;
+	unsigned int len;
+	int kind;
+};
+
+static void bitmap_run_flush(struct bitmap_run *run)
+{
+	if (run->len)
+		run->fn(run->arg, run->start + EXFAT_FIRST_CLUSTER, run->len,
+			run->kind);
+	run->len = 0;
+}
+
+static inline void bitmap_run_add(struct bitmap_run *run, unsigned int bit,
+		unsigned int len, int kind)
+{
+	if (run->len && run->kind == kind && run->start + run->len == bit) {
+		run->len += len;
+		return;
+	}
+	bitmap_run_flush(run);
+	run->start = bit;
+	run->len = len;
+	run->kind = kind;
+}
+
+/* Turn the differing bits of one word into runs */
+static void bitmap_diff_word(struct bitmap_run *run, struct exfat_bitmap_diff *d,
+		unsigned int base, __u64 diff, __u64 shadow)
+{
+	while (diff) {
+		unsigned int first = __builtin_ctzll(diff), len;
+		__u64 rest = diff >> first;
+		int kind = shadow >> first & 1 ? EXFAT_DIFF_UNMARKED :
+			EXFAT_DIFF_LEAKED;
+		/* bits of the same kind in a row */
+		__u64 same = kind == EXFAT_DIFF_UNMARKED ?
+			rest & (shadow >> first) : rest & ~(shadow >> first);
+
+		len = ~same ? (unsigned int)__builtin_ctzll(~same) :
+			BITMAP_WORD_BITS - first;
+		if (first + len > BITMAP_WORD_BITS)
+			len = BITMAP_WORD_BITS - first;
+
+		if (kind == EXFAT_DIFF_LEAKED)
+			d->nr_leaked += len;
+		else
+			d->nr_unmarked += len;
+		bitmap_run_add(run, base + first, len, kind);
+
+		if (first + len >= BITMAP_WORD_BITS)
+			break;
+		diff &= ~0ULL << (first + len);
+	}
+}
+
+#ifdef BITMAP_AVX2
+/* Diff the first 256-bit blocks of full words, returns the words done */
+__attribute__((target("avx2")))
+static size_t bitmap_diff_avx2(const struct exfat_bitmap *shadow,
+		const char *disk, size_t full_words, struct bitmap_run *run,
+		struct exfat_bitmap_diff *d)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= full_words; i += 4) {
+		__m256i s = _mm256_loadu_si256((const __m256i *)
+			(shadow->bits + i * sizeof(__u64)));
+		__m256i o = _mm256_loadu_si256((const __m256i *)
+			(disk + i * sizeof(__u64)));
+		__m256i x = _mm256_xor_si256(s, o);
+		unsigned int j;
+
+		if (_mm256_testz_si256(x, x)) {
+			d->nr_used += __builtin_popcountll(
+				_mm256_extract_epi64(s, 0)) +
+				__builtin_popcountll(_mm256_extract_epi64(s, 1)) +
+				__builtin_popcountll(_mm256_extract_epi64(s, 2)) +
+				__builtin_popcountll(_mm256_extract_epi64(s, 3));
+			continue;
+		}
+
+		for (j = i; j < i + 4; j++) {
+			__u64 sw = bitmap_word(shadow->bits, j);
+			__u64 dw = bitmap_word(disk, j);
+
+			d->nr_used += __builtin_popcountll(sw);
+			bitmap_diff_word(run, d, j * BITMAP_WORD_BITS,
+				sw ^ dw, sw);
+		}
+	}
+	return i;
+}
+#endif
+
+/*
+ * Compare the shadow bitmap built from the reachable clusters with the
+ * on-disk bitmap. Differences are passed to @fn as cluster extents,
+ * LEAKED for clusters marked on disk that nothing owns, UNMARKED for
+ * clusters in use that the disk bitmap has free. Equal words, the common
+ * case, are skipped in blocks and spend only a popcount for the usage.
+ */
+void exfat_bitmap_diff(const struct exfat_bitmap *shadow, const char *disk,
+		exfat_bitmap_diff_fn fn, void *arg, struct exfat_bitmap_diff *d)
+{
+	size_t nr_words = ((size_t)shadow->nr_bits + BITMAP_WORD_BITS - 1) /
+		BITMAP_WORD_BITS;
+	size_t full_words = shadow->nr_bits / BITMAP_WORD_BITS, i = 0;
+	struct bitmap_run run = { .fn = fn, .arg = arg };
+
+	memset(d, 0, sizeof(*d));
+
+#ifdef BITMAP_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		i = bitmap_diff_avx2(shadow, disk, full_words, &run, d);
+#endif
+	for (; i < nr_words; i++) {
+		__u64 sw = bitmap_word(shadow->bits, i);
+		__u64 dw, x;
+
+		/* the on-disk bitmap need not be padded to a whole word */
+		if (i < full_words) {
+			dw = bitmap_word(disk, i);
+		} else {
+			unsigned int tail = shadow->nr_bits % BITMAP_WORD_BITS;
+
+			dw = 0;
+			memcpy(&dw, disk + i * sizeof(__u64), (tail + 7) / 8);
+			dw = le64_to_cpu(dw) & ((1ULL << tail) - 1);
+		}
+
+		d->nr_used += __builtin_popcountll(sw);
+		x = sw ^ dw;
+		if (x)
+			bitmap_diff_word(&run, d, i * BITMAP_WORD_BITS, x, sw);
+	}
+	bitmap_run_flush(&run);
+
+	d->perc_in_use = shadow->nr_bits ?
+		d->nr_used * 100 / shadow->nr_bits : 0;
+}
+
+/* Word @idx of a bitmap of @nr_bits bits that need not be padded */
+static inline __u64 bitmap_word_tail(const char *bits, size_t idx,
+		unsigned int nr_bits)
+{
+	unsigned int tail = nr_bits - idx * BITMAP_WORD_BITS;
+	__u64 w = 0;
+
+	if (tail >= BITMAP_WORD_BITS)
+		return bitmap_word(bits, idx);
+	memcpy(&w, bits + idx * sizeof(w), (tail + 7) / 8);
+	return le64_to_cpu(w) & ((1ULL << tail) - 1);
+}
+
+/*
+ * Compare @nr clusters of the on-disk bitmap from @clu on with clusters
+ * that are all in use, or all free without @used, adding to the counts
+ * of @d. This is exfat_bitmap_diff() for callers that know the clusters
+ * in use as sorted extents rather than as a shadow bitmap. perc_in_use
+ * is left to the caller.
+ */
+void exfat_bitmap_diff_range(const char *disk, unsigned int nr_bits,
+		unsigned int clu, unsigned int nr, bool used,
+		exfat_bitmap_diff_fn fn, void *arg, struct exfat_bitmap_diff *d)
+{
+	struct bitmap_run run = { .fn = fn, .arg = arg };
+	unsigned int bit = clu - EXFAT_FIRST_CLUSTER, end;
+
+	if (bit >= nr_bits || !nr)
+		return;
+	end = nr > nr_bits - bit ? nr_bits : bit + nr;
+	if (used)
+		d->nr_used += end - bit;
+
+	while (bit < end) {
+		size_t idx = bit / BITMAP_WORD_BITS;
+		unsigned int first = bit % BITMAP_WORD_BITS;
+		unsigned int last = end - idx * BITMAP_WORD_BITS;
+		__u64 mask = ~0ULL << first, sw, x;
+
+		if (last < BITMAP_WORD_BITS)
+			mask &= (1ULL << last) - 1;
+		sw = used ? mask : 0;
+		x = (bitmap_word_tail(disk, idx, nr_bits) & mask) ^ sw;
+		if (x)
+			bitmap_diff_word(&run, d, idx * BITMAP_WORD_BITS, x,
+				sw);
+		bit = (idx + 1) * BITMAP_WORD_BITS;
+	}
+	bitmap_run_flush(&run);
+}
+
+#define FREE_INDEX_INIT_EXTS	64
+
+static int free_index_add(struct exfat_free_index *fi, unsigned int *cap,
+		unsigned int bit, unsigned int len)
+{
+	if (fi->nr_exts == *cap) {
+		unsigned int new_cap = *cap ? *cap * 2 : FREE_INDEX_INIT_EXTS;
+		struct exfat_free_extent *p = realloc(fi->exts,
+			new_cap * sizeof(*p));
+
+		if (!p)
+			return -1;
+		fi->exts = p;
+		*cap = new_cap;
+	}
+	fi->exts[fi->nr_exts].clu = bit + EXFAT_FIRST_CLUSTER;
+	fi->exts[fi->nr_exts].nr_clus = len;
+	fi->nr_exts++;
+	fi->nr_free += len;
+	return 0;
+}
+
+static int free_extent_cmp_len(const void *a, const void *b)
+{
+	const struct exfat_free_extent *x = a, *y = b;
+
+	if (x->nr_clus != y->nr_clus)
+		return x->nr_clus < y->nr_clus ? 1 : -1;
+	return x->clu < y->clu ? -1 : x->clu > y->clu;
+}
+
+/*
+ * Collect the free runs of the @nr_clus bits of @bitmap, an on-disk
+ * allocation bitmap or a shadow one. Runs are found a word at a time:
+ * the next free bit and the next used bit are each one count of trailing
+ * zeroes away, and words entirely used or entirely free inside a run
+ * cost a single compare.
+ */
+int exfat_free_index_build(struct exfat_free_index *fi, const char *bitmap,
+		unsigned int nr_clus)
+{
+	size_t nr_words = ((size_t)nr_clus + BITMAP_WORD_BITS - 1) /
+		BITMAP_WORD_BITS;
+	size_t full_words = nr_clus / BITMAP_WORD_BITS, i;
+	unsigned int cap = 0, start = 0;
+	bool in_run = false;
+
+	memset(fi, 0, sizeof(*fi));
+
+	for (i = 0; i < nr_words; i++) {
+		unsigned int base = i * BITMAP_WORD_BITS, pos = 0;
+		__u64 w;
+
+		if (i < full_words) {
+			w = ~bitmap_word(bitmap, i);
+		} else {
+			unsigned int tail = nr_clus % BITMAP_WORD_BITS;
+
+			/* bits past the last cluster count as used */
+			w = 0;
+			memcpy(&w, bitmap + i * sizeof(__u64), (tail + 7) / 8);
+			w = ~le64_to_cpu(w) & ((1ULL << tail) - 1);
+		}
+
+		/* w has the free clusters set */
+		if (w == (in_run ? ~0ULL : 0))
+			continue;
+
+		for (;;) {
+			__u64 rest;
+
+			if (!in_run) {
+				rest = w >> pos;
+				if (!rest)
+					break;
+				pos += __builtin_ctzll(rest);
+				start = base + pos;
+				in_run = true;
+			}
+
+			rest = ~w >> pos;
+			if (!rest)
+				break;
+			pos += __builtin_ctzll(rest);
+			in_run = false;
+			if (free_index_add(fi, &cap, start, base + pos - start))
+				goto nomem;
+		}
+	}
+	if (in_run && free_index_add(fi, &cap, start, nr_clus - start))
+		goto nomem;
+
+	fi->by_len = malloc((fi->nr_exts ? fi->nr_exts : 1) *
+		sizeof(*fi->by_len));
+	if (!fi->by_len)
+		goto nomem;
+	memcpy(fi->by_len, fi->exts, fi->nr_exts * sizeof(*fi->by_len));
+	qsort(fi->by_len, fi->nr_exts, sizeof(*fi->by_len),
+		free_extent_cmp_len);
+	return 0;
+nomem:
+	exfat_msg(EXFAT_ERROR, "Cannot build free space index: out of memory\n");
+	exfat_free_index_free(fi);
+	return -1;
+}
+
+void exfat_free_index_free(struct exfat_free_index *fi)
+{
+	free(fi->exts);
+	free(fi->by_len);
+	memset(fi, 0, sizeof(*fi));
+}
+
+/* The @nth longest free extent, 0 for the longest, NULL past the last */
+const struct exfat_free_extent *exfat_free_index_largest(
+		const struct exfat_free_index *fi, unsigned int nth)
+{
+	return nth < fi->nr_exts ? &fi->by_len[nth] : NULL;
+}
+
+/* Number of extents in @fi->by_len longer than @nr_clus - 1 */
+static unsigned int free_index_count_fit(const struct exfat_free_index *fi,
+		unsigned int nr_clus)
+{
+	unsigned int lo = 0, hi = fi->nr_exts;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (fi->by_len[mid].nr_clus >= nr_clus)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * The shortest free extent that holds @nr_clus clusters, the lowest one
+ * of those as long. Returns NULL if no extent is long enough.
+ */
+const struct exfat_free_extent *exfat_free_index_best_fit(
+		const struct exfat_free_index *fi, unsigned int nr_clus)
+{
+	unsigned int nr_fit = free_index_count_fit(fi, nr_clus), len;
+
+	if (!nr_fit)
+		return NULL;
+
+	/* the fitting extents are a prefix, the first of the shortest wins */
+	len = fi->by_len[nr_fit - 1].nr_clus;
+	return &fi->by_len[free_index_count_fit(fi, len + 1)];
+}
@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+/*
+ * Buffers come in power of two size classes. A free buffer links itself
+ * into the list of its class through its first bytes, so the pool needs
+ * no memory of its own besides the list heads.
+ */
+struct pool_free_buf {
+	struct pool_free_buf *next;
+};
+
+static unsigned int pool_class(size_t len)
+{
+	unsigned int shift = EXFAT_POOL_MIN_SHIFT;
+
+	while (shift < EXFAT_POOL_MAX_SHIFT && ((size_t)1 << shift) < len)
+		shift++;
+	return shift - EXFAT_POOL_MIN_SHIFT;
+}
+
+/*
+ * Buffers are aligned to @sector_size and @io_opt, and never less than a
+ * page, so they can be used for direct I/O. When @io is given every new
+ * buffer is registered with it.
+ */
+void exfat_pool_init(struct exfat_buf_pool *pool, unsigned int sector_size,
+		unsigned int io_opt, struct exfat_io *io)
+{
+	size_t align = sysconf(_SC_PAGESIZE);
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	if (sector_size > align)
+		align = sector_size;
+	/* an odd optimal I/O size is a hint only, it cannot align memory */
+	if (io_opt > align && !(io_opt & (io_opt - 1)) &&
+	    io_opt <= EXFAT_POOL_MAX_ALIGN)
+		align = io_opt;
+	pool->align = align;
+	pool->io = io;
+}
+
+/*
+ * Get a buffer of at least @len bytes, recycled from an earlier
+ * exfat_pool_put() of the same size class when there is one. The content
+ * is undefined. Returns NULL if @len is too big or without memory.
+ */
+void *exfat_pool_get(struct exfat_buf_pool *pool, size_t len)
+{
+	unsigned int class = pool_class(len);
+	size_t size = (size_t)1 << (class + EXFAT_POOL_MIN_SHIFT);
+	struct pool_free_buf *fb;
+	void *buf;
+
+	if (len > size)
+		return NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	fb = pool->free[class];
+	if (fb) {
+		pool->free[class] = fb->next;
+		pool->nr_recycled++;
+		pthread_mutex_unlock(&pool->lock);
+		return fb;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (posix_memalign(&buf, pool->align, size))
+		return NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->nr_allocated++;
+	pool->bytes_allocated += size;
+	if (pool->io)
+		exfat_io_register_buffer(pool->io, buf, size);
+	pthread_mutex_unlock(&pool->lock);
+	return buf;
+}
+
+void *exfat_pool_zalloc(struct exfat_buf_pool *pool, size_t len)
+{
+	void *buf = exfat_pool_get(pool, len);
+
+	if (buf)
+		memset(buf, 0, len);
+	return buf;
+}
+
+/* Give back a buffer got for @len bytes, it is kept for the next user */
+void exfat_pool_put(struct exfat_buf_pool *pool, void *buf, size_t len)
+{
+	unsigned int class = pool_class(len);
+	struct pool_free_buf *fb = buf;
+
+	if (!buf)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	fb->next = pool->free[class];
+	pool->free[class] = fb;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Free every buffer, all of them must have been put back */
+void exfat_pool_destroy(struct exfat_buf_pool *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < EXFAT_POOL_NR_CLASSES; i++) {
+		while (pool->free[i]) {
+			struct pool_free_buf *fb = pool->free[i];
+
+			pool->free[i] = fb->next;
+			free(fb);
+		}
+	}
+	pthread_mutex_destroy(&pool->lock);
+}
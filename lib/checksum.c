@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+/* VolumeFlags and PercentInUse are not covered by the boot checksum */
+#define BOOT_VOL_FLAGS_OFF	106
+#define BOOT_PERC_IN_USE_OFF	112
+
+static inline unsigned int ror32(unsigned int x)
+{
+	return (x >> 1) | (x << 31);
+}
+
+/*
+ * The checksum is a rotate-and-add over every byte, so each step depends
+ * on the previous one. What can be saved is the per byte load and the
+ * branches: load a 64-bit word at a time and unroll the eight steps.
+ */
+unsigned int exfat_checksum32(const void *buf, size_t len,
+		unsigned int checksum)
+{
+	const unsigned char *p = buf;
+
+	for (; len >= sizeof(__u64); len -= sizeof(__u64)) {
+		__u64 w;
+
+		memcpy(&w, p, sizeof(w));
+		w = le64_to_cpu(w);
+		p += sizeof(w);
+
+		checksum = ror32(checksum) + (unsigned char)(w);
+		checksum = ror32(checksum) + (unsigned char)(w >> 8);
+		checksum = ror32(checksum) + (unsigned char)(w >> 16);
+		checksum = ror32(checksum) + (unsigned char)(w >> 24);
+		checksum = ror32(checksum) + (unsigned char)(w >> 32);
+		checksum = ror32(checksum) + (unsigned char)(w >> 40);
+		checksum = ror32(checksum) + (unsigned char)(w >> 48);
+		checksum = ror32(checksum) + (unsigned char)(w >> 56);
+	}
+
+	while (len--)
+		checksum = ror32(checksum) + *p++;
+
+	return checksum;
+}
+
+#define HASH64_PRIME1		0x9E3779B185EBCA87ULL
+#define HASH64_PRIME2		0xC2B2AE3D27D4EB4FULL
+
+static inline __u64 rol64(__u64 x, unsigned int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * A fast 64-bit hash to tell whether metadata changed between two runs,
+ * a multiply and rotate per word like xxHash64. It is not meant to
+ * resist anyone crafting collisions.
+ */
+__u64 exfat_hash64(const void *buf, size_t len, __u64 seed)
+{
+	const unsigned char *p = buf;
+	__u64 h = seed ^ (len * HASH64_PRIME1);
+
+	for (; len >= sizeof(__u64); len -= sizeof(__u64)) {
+		__u64 w;
+
+		memcpy(&w, p, sizeof(w));
+		p += sizeof(w);
+		h ^= rol64(le64_to_cpu(w) * HASH64_PRIME2, 31) * HASH64_PRIME1;
+		h = rol64(h, 27) * HASH64_PRIME1 + HASH64_PRIME2;
+	}
+
+	while (len--)
+		h = rol64(h ^ (*p++ * HASH64_PRIME1), 11) * HASH64_PRIME2;
+
+	/* final avalanche */
+	h ^= h >> 33;
+	h *= HASH64_PRIME2;
+	h ^= h >> 29;
+	return h ^ h >> 32;
+}
+
+unsigned int exfat_calc_boot_checksum(const void *region,
+		unsigned int sector_size)
+{
+	const unsigned char *p = region;
+	unsigned int checksum;
+
+	/* main boot sector without VolumeFlags and PercentInUse */
+	checksum = exfat_checksum32(p, BOOT_VOL_FLAGS_OFF, 0);
+	checksum = exfat_checksum32(p + BOOT_VOL_FLAGS_OFF + 2,
+		BOOT_PERC_IN_USE_OFF - BOOT_VOL_FLAGS_OFF - 2, checksum);
+	checksum = exfat_checksum32(p + BOOT_PERC_IN_USE_OFF + 1,
+		sector_size - BOOT_PERC_IN_USE_OFF - 1, checksum);
+
+	/* extended boot, OEM parameter and reserved sectors */
+	return exfat_checksum32(p + sector_size,
+		(CHECKSUM_NUM - 1) * sector_size, checksum);
+}
+
+static inline unsigned short ror16(unsigned short x)
+{
+	return (x >> 1) | (x << 15);
+}
+
+/*
+ * Entry set checksum over @nr_entries entries starting at the file entry,
+ * which skips the SetChecksum field of the file entry itself.
+ */
+unsigned short exfat_calc_dentry_set_checksum(const struct exfat_dentry *set,
+		unsigned int nr_entries)
+{
+	const unsigned char *p = (const unsigned char *)set;
+	unsigned short checksum = 0;
+	unsigned int i, len = nr_entries * DENTRY_SIZE;
+
+	checksum = ror16(checksum) + p[0];
+	checksum = ror16(checksum) + p[1];
+	for (i = 4; i < len; i++)
+		checksum = ror16(checksum) + p[i];
+
+	return checksum;
+}
+
+unsigned int exfat_calc_upcase_checksum(const void *table, size_t len)
+{
+	return exfat_checksum32(table, len, 0);
+}
+
+void exfat_set_boot_checksum(void *region, unsigned int sector_size)
+{
+	unsigned int checksum = exfat_calc_boot_checksum(region, sector_size);
+	__le32 *checksum_sec = (__le32 *)((char *)region +
+		CHECKSUM_NUM * sector_size);
+	unsigned int i;
+
+	for (i = 0; i < sector_size / sizeof(__le32); i++)
+		checksum_sec[i] = cpu_to_le32(checksum);
+}
+
+int exfat_verify_boot_checksum(const void *region, unsigned int sector_size)
+{
+	const __le32 *checksum_sec;
+	unsigned int checksum, i;
+
+	checksum = cpu_to_le32(exfat_calc_boot_checksum(region, sector_size));
+	checksum_sec = (const __le32 *)((const char *)region +
+		CHECKSUM_NUM * sector_size);
+
+	for (i = 0; i < sector_size / sizeof(__le32); i++) {
+		if (checksum_sec[i] != checksum)
+			return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+#define EXFAT_MIN_SECONDARY	2	/* stream extension and one name */
+#define EXFAT_MAX_SECONDARY	18	/* stream extension and 17 names */
+#define EXFAT_NAME_PER_DENTRY	15
+
+/* in use secondary entries have both the in use and category bits set */
+#define IS_EXFAT_SECONDARY(type)	(((type) & 0xC0) == 0xC0)
+
+#ifdef __SSE2__
+/* Gather the type bytes of four entries into the low four bytes */
+static inline __m128i exfat_load_types4(const struct exfat_dentry *d)
+{
+	__m128i a = _mm_loadu_si128((const __m128i *)&d[0]);
+	__m128i b = _mm_loadu_si128((const __m128i *)&d[1]);
+	__m128i c = _mm_loadu_si128((const __m128i *)&d[2]);
+	__m128i e = _mm_loadu_si128((const __m128i *)&d[3]);
+
+	return _mm_unpacklo_epi16(_mm_unpacklo_epi8(a, b),
+		_mm_unpacklo_epi8(c, e));
+}
+
+/* Gather the type bytes of sixteen entries into one vector */
+static inline __m128i exfat_load_types16(const struct exfat_dentry *d)
+{
+	__m128i lo = _mm_unpacklo_epi32(exfat_load_types4(d),
+		exfat_load_types4(d + 4));
+	__m128i hi = _mm_unpacklo_epi32(exfat_load_types4(d + 8),
+		exfat_load_types4(d + 12));
+
+	return _mm_unpacklo_epi64(lo, hi);
+}
+#endif
+
+/*
+ * Return the index of the first file or end of directory entry at or
+ * after @pos, or @nr if there is none.
+ */
+static inline unsigned int exfat_scan_dentries(const struct exfat_dentry *d,
+		unsigned int pos, unsigned int nr)
+{
+#ifdef __SSE2__
+	const __m128i file = _mm_set1_epi8((char)EXFAT_FILE);
+	const __m128i unused = _mm_set1_epi8(EXFAT_UNUSED);
+
+	for (; pos + 16 <= nr; pos += 16) {
+		__m128i types = exfat_load_types16(d + pos);
+		int mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(types, file),
+			_mm_cmpeq_epi8(types, unused)));
+
+		if (mask)
+			return pos + __builtin_ctz(mask);
+	}
+#endif
+	for (; pos < nr; pos++) {
+		if (d[pos].type == EXFAT_FILE || d[pos].type == EXFAT_UNUSED)
+			break;
+	}
+	return pos;
+}
+
+void exfat_dentry_iter_init(struct exfat_dentry_iter *iter, const void *buf,
+		size_t len, unsigned int flags)
+{
+	iter->dentries = buf;
+	iter->nr_dentries = len / DENTRY_SIZE;
+	iter->pos = 0;
+	iter->flags = flags;
+}
+
+/*
+ * Yield the next file entry set of the directory. Returns 1 with @set
+ * filled in, 0 at the end of the directory, or -1 if the set at
+ * @set->index is malformed, in which case the iterator moves past its
+ * file entry.
+ */
+int exfat_dentry_iter_next(struct exfat_dentry_iter *iter,
+		struct exfat_dentry_set *set)
+{
+	const struct exfat_dentry *d = iter->dentries;
+	unsigned int pos, nr_ext, i, name_len;
+
+	pos = exfat_scan_dentries(d, iter->pos, iter->nr_dentries);
+	if (pos >= iter->nr_dentries || d[pos].type == EXFAT_UNUSED) {
+		iter->pos = iter->nr_dentries;
+		return 0;
+	}
+
+	memset(set, 0, sizeof(*set));
+	set->index = pos;
+	set->file = &d[pos];
+	iter->pos = pos + 1;
+
+	nr_ext = d[pos].file_num_ext;
+	if (nr_ext < EXFAT_MIN_SECONDARY || nr_ext > EXFAT_MAX_SECONDARY ||
+	    nr_ext >= iter->nr_dentries - pos)
+		return -1;
+
+	for (i = 1; i <= nr_ext; i++) {
+		if (!IS_EXFAT_SECONDARY(d[pos + i].type))
+			return -1;
+	}
+
+	if (d[pos + 1].type != EXFAT_STREAM)
+		return -1;
+	set->stream = &d[pos + 1];
+
+	name_len = set->stream->stream_name_len;
+	set->nr_names = (name_len + EXFAT_NAME_PER_DENTRY - 1) /
+		EXFAT_NAME_PER_DENTRY;
+	if (!set->nr_names || set->nr_names > nr_ext - 1)
+		return -1;
+
+	for (i = 0; i < set->nr_names; i++) {
+		if (d[pos + 2 + i].type != EXFAT_NAME)
+			return -1;
+	}
+	set->name = &d[pos + 2];
+	set->nr_entries = nr_ext + 1;
+
+	if (iter->flags & EXFAT_ITER_VERIFY_CHECKSUM) {
+		set->checksum_ok = exfat_calc_dentry_set_checksum(set->file,
+			set->nr_entries) == le16_to_cpu(set->file->file_checksum);
+	}
+
+	iter->pos = pos + set->nr_entries;
+	return 1;
+}
@@ -0,0 +1,380 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+#define EXTSORT_INIT_RUNS	16
+#define EXTSORT_BUF_EXTENTS	(EXFAT_EXTSORT_BUF_SIZE / \
+				 sizeof(struct exfat_walk_extent))
+
+/* one run being merged, read EXTSORT_BUF_EXTENTS at a time */
+struct extsort_cursor {
+	int fd;
+	struct exfat_walk_extent *buf;
+	size_t nr, pos;
+};
+
+/*
+ * Keep @mem_limit bytes for sorting and merging. Half of it holds the
+ * extents sorted into one run, the other half the read buffers of the
+ * runs merged at once, so the two phases never need more together.
+ */
+void exfat_extsort_init(struct exfat_extsort *xs, const char *dir,
+		size_t mem_limit)
+{
+	memset(xs, 0, sizeof(*xs));
+	if (!dir)
+		dir = getenv("TMPDIR");
+	xs->dir = dir && *dir ? dir : "/tmp";
+
+	xs->run_extents = mem_limit / 2 / sizeof(struct exfat_walk_extent);
+	if (xs->run_extents < EXTSORT_BUF_EXTENTS)
+		xs->run_extents = EXTSORT_BUF_EXTENTS;
+	/* one buffer is kept for the output of intermediate passes */
+	xs->max_fanin = mem_limit / 2 / EXFAT_EXTSORT_BUF_SIZE;
+	xs->max_fanin = xs->max_fanin > 3 ? xs->max_fanin - 1 : 2;
+
+	pthread_mutex_init(&xs->lock, NULL);
+}
+
+void exfat_extsort_free(struct exfat_extsort *xs)
+{
+	unsigned int i;
+
+	for (i = 0; i < xs->nr_runs; i++)
+		close(xs->runs[i]);
+	free(xs->runs);
+	pthread_mutex_destroy(&xs->lock);
+	memset(xs, 0, sizeof(*xs));
+}
+
+static int extsort_tmpfile(struct exfat_extsort *xs)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/exfat-spill-XXXXXX", xs->dir) >=
+	    (int)sizeof(path)) {
+		exfat_msg(EXFAT_ERROR, "spill directory name too long\n");
+		return -1;
+	}
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		exfat_msg(EXFAT_ERROR, "Cannot create spill file in %s : %s\n",
+			xs->dir, strerror(errno));
+		return -1;
+	}
+	/* nothing to clean up, whatever way the process ends */
+	unlink(path);
+	return fd;
+}
+
+static int extsort_write(int fd, const void *buf, size_t len)
+{
+	while (len) {
+		ssize_t nbytes = write(fd, buf, len);
+
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+			exfat_msg(EXFAT_ERROR, "spill file write failed : %s\n",
+				strerror(errno));
+			return -1;
+		}
+		buf = (const char *)buf + nbytes;
+		len -= nbytes;
+	}
+	return 0;
+}
+
+static inline bool extsort_less(const struct exfat_walk_extent *a,
+		const struct exfat_walk_extent *b)
+{
+	if (a->start_clu != b->start_clu)
+		return a->start_clu < b->start_clu;
+	return a->owner < b->owner;
+}
+
+static int extsort_cmp(const void *a, const void *b)
+{
+	const struct exfat_walk_extent *ea = a, *eb = b;
+
+	if (extsort_less(ea, eb))
+		return -1;
+	return extsort_less(eb, ea);
+}
+
+static int extsort_push_run(struct exfat_extsort *xs, int fd)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&xs->lock);
+	if (xs->nr_runs == xs->runs_cap) {
+		unsigned int cap = xs->runs_cap ? xs->runs_cap * 2 :
+			EXTSORT_INIT_RUNS;
+		int *runs = realloc(xs->runs, cap * sizeof(*runs));
+
+		if (!runs) {
+			ret = -1;
+			goto out;
+		}
+		xs->runs = runs;
+		xs->runs_cap = cap;
+	}
+	xs->runs[xs->nr_runs++] = fd;
+out:
+	pthread_mutex_unlock(&xs->lock);
+	return ret;
+}
+
+/*
+ * Sort the @nr extents of @exts by cluster and write them out as one run.
+ * @exts is reordered in place, it is free for reuse once this returns.
+ * Safe to call from several threads at once.
+ */
+int exfat_extsort_add_run(struct exfat_extsort *xs,
+		struct exfat_walk_extent *exts, size_t nr)
+{
+	int fd;
+
+	if (!nr)
+		return 0;
+
+	qsort(exts, nr, sizeof(*exts), extsort_cmp);
+
+	fd = extsort_tmpfile(xs);
+	if (fd < 0)
+		return -1;
+	if (extsort_write(fd, exts, nr * sizeof(*exts)) ||
+	    extsort_push_run(xs, fd)) {
+		close(fd);
+		return -1;
+	}
+	__atomic_add_fetch(&xs->nr_extents, nr, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Refill an empty cursor, returns 0 at the end of its run */
+static int extsort_fill(struct extsort_cursor *c)
+{
+	size_t len = 0, want = EXTSORT_BUF_EXTENTS * sizeof(*c->buf);
+
+	while (len < want) {
+		ssize_t nbytes = read(c->fd, (char *)c->buf + len, want - len);
+
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+			exfat_msg(EXFAT_ERROR, "spill file read failed : %s\n",
+				strerror(errno));
+			return -1;
+		}
+		if (!nbytes)
+			break;
+		len += nbytes;
+	}
+
+	if (len % sizeof(*c->buf)) {
+		exfat_msg(EXFAT_ERROR, "spill file truncated\n");
+		return -1;
+	}
+	c->nr = len / sizeof(*c->buf);
+	c->pos = 0;
+	return c->nr != 0;
+}
+
+static inline bool extsort_heap_less(struct exfat_extsort_iter *it,
+		unsigned int a, unsigned int b)
+{
+	struct extsort_cursor *ca = &it->cursors[it->heap[a]];
+	struct extsort_cursor *cb = &it->cursors[it->heap[b]];
+
+	return extsort_less(&ca->buf[ca->pos], &cb->buf[cb->pos]);
+}
+
+static void extsort_heap_down(struct exfat_extsort_iter *it, unsigned int i)
+{
+	for (;;) {
+		unsigned int l = 2 * i + 1, r = l + 1, min = i, tmp;
+
+		if (l < it->nr_heap && extsort_heap_less(it, l, min))
+			min = l;
+		if (r < it->nr_heap && extsort_heap_less(it, r, min))
+			min = r;
+		if (min == i)
+			return;
+		tmp = it->heap[i];
+		it->heap[i] = it->heap[min];
+		it->heap[min] = tmp;
+		i = min;
+	}
+}
+
+static void extsort_close(struct exfat_extsort_iter *it, unsigned int nr)
+{
+	unsigned int i;
+
+	if (it->cursors)
+		for (i = 0; i < nr; i++)
+			free(it->cursors[i].buf);
+	free(it->cursors);
+	free(it->heap);
+	it->cursors = NULL;
+	it->heap = NULL;
+	it->nr_heap = 0;
+}
+
+/* Start merging the @nr runs in @fds from their beginning */
+static int extsort_open(struct exfat_extsort_iter *it, const int *fds,
+		unsigned int nr)
+{
+	unsigned int i;
+	int ret;
+
+	it->nr_heap = 0;
+	it->cursors = calloc(nr ? nr : 1, sizeof(*it->cursors));
+	it->heap = calloc(nr ? nr : 1, sizeof(*it->heap));
+	if (!it->cursors || !it->heap)
+		goto err;
+
+	for (i = 0; i < nr; i++) {
+		struct extsort_cursor *c = &it->cursors[i];
+
+		c->fd = fds[i];
+		c->buf = malloc(EXTSORT_BUF_EXTENTS * sizeof(*c->buf));
+		if (!c->buf || lseek(c->fd, 0, SEEK_SET) < 0)
+			goto err;
+		ret = extsort_fill(c);
+		if (ret < 0)
+			goto err;
+		if (ret)
+			it->heap[it->nr_heap++] = i;
+	}
+
+	for (i = it->nr_heap / 2; i-- > 0;)
+		extsort_heap_down(it, i);
+	return 0;
+err:
+	exfat_msg(EXFAT_ERROR, "Cannot start extent merge\n");
+	extsort_close(it, nr);
+	return -1;
+}
+
+/*
+ * Merge the first max_fanin runs into one until they can all be merged at
+ * once. The new run goes last, so every run is merged about as often.
+ */
+static int extsort_reduce(struct exfat_extsort *xs)
+{
+	struct exfat_walk_extent *out;
+	unsigned int fanin = xs->max_fanin, i;
+	int ret = -1;
+
+	out = malloc(EXTSORT_BUF_EXTENTS * sizeof(*out));
+	if (!out)
+		return -1;
+
+	while (xs->nr_runs > fanin) {
+		struct exfat_extsort_iter it = { .xs = xs };
+		struct exfat_walk_extent e;
+		size_t nr_out = 0;
+		int fd, r;
+
+		fd = extsort_tmpfile(xs);
+		if (fd < 0)
+			goto out;
+		if (extsort_open(&it, xs->runs, fanin)) {
+			close(fd);
+			goto out;
+		}
+
+		while ((r = exfat_extsort_merge_next(&it, &e)) > 0) {
+			out[nr_out++] = e;
+			if (nr_out == EXTSORT_BUF_EXTENTS) {
+				if (extsort_write(fd, out,
+						nr_out * sizeof(*out)))
+					break;
+				nr_out = 0;
+			}
+		}
+		extsort_close(&it, fanin);
+		if (r || extsort_write(fd, out, nr_out * sizeof(*out))) {
+			close(fd);
+			goto out;
+		}
+
+		for (i = 0; i < fanin; i++)
+			close(xs->runs[i]);
+		memmove(xs->runs, xs->runs + fanin,
+			(xs->nr_runs - fanin) * sizeof(*xs->runs));
+		xs->nr_runs -= fanin;
+		xs->runs[xs->nr_runs++] = fd;
+		xs->nr_passes++;
+	}
+	ret = 0;
+out:
+	free(out);
+	return ret;
+}
+
+/*
+ * Start returning every extent added so far, in cluster order. Runs are
+ * merged in intermediate passes first if there are more than the memory
+ * limit allows to read at once.
+ */
+int exfat_extsort_merge_begin(struct exfat_extsort *xs,
+		struct exfat_extsort_iter *it)
+{
+	memset(it, 0, sizeof(*it));
+	it->xs = xs;
+
+	if (extsort_reduce(xs)) {
+		exfat_msg(EXFAT_ERROR, "extent merge pass failed\n");
+		return -1;
+	}
+	exfat_msg(EXFAT_DEBUG, "Extent sort: %llu extents, %u runs, "
+		"%u merge passes\n", xs->nr_extents, xs->nr_runs,
+		xs->nr_passes);
+	return extsort_open(it, xs->runs, xs->nr_runs);
+}
+
+/* Returns 1 with the next extent in @e, 0 at the end, -1 on error */
+int exfat_extsort_merge_next(struct exfat_extsort_iter *it,
+		struct exfat_walk_extent *e)
+{
+	struct extsort_cursor *c;
+	int ret;
+
+	if (!it->nr_heap)
+		return 0;
+
+	c = &it->cursors[it->heap[0]];
+	*e = c->buf[c->pos++];
+
+	if (c->pos == c->nr) {
+		ret = extsort_fill(c);
+		if (ret < 0)
+			return -1;
+		if (!ret)
+			it->heap[0] = it->heap[--it->nr_heap];
+	}
+	if (it->nr_heap)
+		extsort_heap_down(it, 0);
+	return 1;
+}
+
+void exfat_extsort_merge_end(struct exfat_extsort_iter *it)
+{
+	extsort_close(it, it->xs ? it->xs->nr_runs : 0);
+}
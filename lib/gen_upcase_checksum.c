@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+/*
+ * Build time helper, prints the checksum of the built-in upcase table as
+ * a header so it does not have to be computed or hard-coded.
+ */
+
+#include <stdio.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+int main(void)
+{
+	printf("/* Generated by gen_upcase_checksum, do not edit */\n");
+	printf("#ifndef _UPCASE_CHECKSUM_H\n");
+	printf("#define _UPCASE_CHECKSUM_H\n\n");
+	printf("#define EXFAT_UPCASE_TABLE_CHECKSUM\t0x%08x\n\n",
+		exfat_calc_upcase_checksum(exfat_upcase_table,
+			EXFAT_UPCASE_TABLE_SIZE));
+	printf("#endif /* !_UPCASE_CHECKSUM_H */\n");
+	return 0;
+}
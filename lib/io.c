@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+#define IO_INIT_DEFERRED	16
+
+/* of the process and of each thread, a recorder without a file is left out */
+static struct exfat_io_counters io_total;
+static __thread struct exfat_io_counters io_thread;
+
+static inline void io_count(struct exfat_io *io, bool write, size_t len)
+{
+	if (io->fd < 0)
+		return;
+
+	if (write) {
+		io_thread.nr_writes++;
+		io_thread.bytes_written += len;
+		__atomic_add_fetch(&io_total.nr_writes, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&io_total.bytes_written, len,
+			__ATOMIC_RELAXED);
+	} else {
+		io_thread.nr_reads++;
+		io_thread.bytes_read += len;
+		__atomic_add_fetch(&io_total.nr_reads, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&io_total.bytes_read, len,
+			__ATOMIC_RELAXED);
+	}
+}
+
+void exfat_io_get_counters(struct exfat_io_counters *c, bool thread)
+{
+	if (thread) {
+		*c = io_thread;
+		return;
+	}
+	c->nr_reads = __atomic_load_n(&io_total.nr_reads, __ATOMIC_RELAXED);
+	c->bytes_read = __atomic_load_n(&io_total.bytes_read,
+		__ATOMIC_RELAXED);
+	c->nr_writes = __atomic_load_n(&io_total.nr_writes, __ATOMIC_RELAXED);
+	c->bytes_written = __atomic_load_n(&io_total.bytes_written,
+		__ATOMIC_RELAXED);
+}
+
+/*
+ * Synchronous backend, every request is complete when it returns
+ */
+
+static int psync_read(struct exfat_io *io, void *buf, size_t len,
+		unsigned long long off)
+{
+	while (len) {
+		ssize_t nbytes = pread(io->fd, buf, len, off);
+
+		if (nbytes <= 0) {
+			if (nbytes < 0 && errno == EINTR)
+				continue;
+			exfat_msg(EXFAT_ERROR,
+				"read failed, offset : %llu, nbytes : %zd\n",
+				off, nbytes);
+			return -1;
+		}
+		buf = (char *)buf + nbytes;
+		len -= nbytes;
+		off += nbytes;
+	}
+	return 0;
+}
+
+static int psync_write(struct exfat_io *io, const void *buf, size_t len,
+		unsigned long long off)
+{
+	while (len) {
+		ssize_t nbytes = pwrite(io->fd, buf, len, off);
+
+		if (nbytes <= 0) {
+			if (nbytes < 0 && errno == EINTR)
+				continue;
+			exfat_msg(EXFAT_ERROR,
+				"write failed, offset : %llu, nbytes : %zd\n",
+				off, nbytes);
+			return -1;
+		}
+		buf = (const char *)buf + nbytes;
+		len -= nbytes;
+		off += nbytes;
+	}
+	return 0;
+}
+
+static const struct exfat_io_ops psync_ops = {
+	.name	= "psync",
+	.read	= psync_read,
+	.write	= psync_write,
+};
+
+/*
+ * Set up @io on @fd. EXFAT_IO_URING falls back to the synchronous backend
+ * when io_uring is not built in or the kernel refuses it, so callers can
+ * always ask for it.
+ */
+int exfat_io_init(struct exfat_io *io, int fd, int backend, unsigned int flags)
+{
+	memset(io, 0, sizeof(*io));
+	io->fd = fd;
+	io->flags = flags;
+	io->depth = EXFAT_IO_DEPTH;
+
+	if (flags & EXFAT_IO_DIRECT) {
+		int fl = fcntl(fd, F_GETFL);
+
+		if (fl < 0 || fcntl(fd, F_SETFL, fl | O_DIRECT) < 0) {
+			exfat_msg(EXFAT_DEBUG, "O_DIRECT not supported : %s\n",
+				strerror(errno));
+			io->flags &= ~EXFAT_IO_DIRECT;
+		}
+	}
+
+	io->ops = &psync_ops;
+	if (backend == EXFAT_IO_URING && exfat_io_uring_ops.init) {
+		io->ops = &exfat_io_uring_ops;
+		if (io->ops->init(io)) {
+			exfat_msg(EXFAT_DEBUG,
+				"io_uring unavailable, using psync\n");
+			io->ops = &psync_ops;
+		}
+	}
+
+	exfat_msg(EXFAT_DEBUG, "I/O backend : %s%s\n", io->ops->name,
+		io->flags & EXFAT_IO_DIRECT ? ", O_DIRECT" : "");
+	return 0;
+}
+
+/*
+ * Set up @io with a backend of the caller's own, @priv is left for it.
+ * Its init callback is not used, @ops only needs to be ready to queue.
+ */
+void exfat_io_init_ops(struct exfat_io *io, const struct exfat_io_ops *ops,
+		void *priv)
+{
+	memset(io, 0, sizeof(*io));
+	io->fd = -1;
+	io->depth = EXFAT_IO_DEPTH;
+	io->ops = ops;
+	io->priv = priv;
+}
+
+/*
+ * Queue a read of @len bytes at @off into @buf. With an asynchronous
+ * backend @buf is only filled once exfat_io_flush() returns.
+ */
+int exfat_io_read(struct exfat_io *io, void *buf, size_t len,
+		unsigned long long off)
+{
+	io->nr_reads++;
+	io->bytes_read += len;
+	io_count(io, false, len);
+	/* a backend without reads, e.g. one that only records writes */
+	if (!io->ops->read || io->ops->read(io, buf, len, off)) {
+		io->error = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Queue a write of @len bytes at @off. @buf must stay untouched until
+ * exfat_io_flush(), exfat_io_defer_free() hands it over to @io instead.
+ */
+int exfat_io_write(struct exfat_io *io, const void *buf, size_t len,
+		unsigned long long off)
+{
+	io->nr_writes++;
+	io->bytes_written += len;
+	io_count(io, true, len);
+	if (io->ops->write(io, buf, len, off)) {
+		io->error = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Register a buffer that will be used for many requests. Backends that
+ * can pin it use it without mapping it on every request.
+ */
+int exfat_io_register_buffer(struct exfat_io *io, void *buf, size_t len)
+{
+	if (!io->ops->register_buffer)
+		return 0;
+	return io->ops->register_buffer(io, buf, len);
+}
+
+static void exfat_io_release(struct exfat_io_deferred *d)
+{
+	if (d->pool)
+		exfat_pool_put(d->pool, d->buf, d->len);
+	else
+		free(d->buf);
+}
+
+/*
+ * Give @buf back to @pool, or free it if @pool is NULL, once the requests
+ * queued so far are complete.
+ */
+void exfat_io_defer_put(struct exfat_io *io, struct exfat_buf_pool *pool,
+		void *buf, size_t len)
+{
+	struct exfat_io_deferred d = {
+		.buf	= buf,
+		.pool	= pool,
+		.len	= len,
+	};
+
+	if (io->nr_deferred == io->deferred_cap) {
+		size_t cap = io->deferred_cap ? io->deferred_cap * 2 :
+			IO_INIT_DEFERRED;
+		struct exfat_io_deferred *p = realloc(io->deferred,
+			cap * sizeof(*p));
+
+		if (!p) {
+			/* cannot keep it around, wait so it can go now */
+			exfat_io_flush(io);
+			exfat_io_release(&d);
+			return;
+		}
+		io->deferred = p;
+		io->deferred_cap = cap;
+	}
+	io->deferred[io->nr_deferred++] = d;
+}
+
+/* Free @buf once the requests queued so far are complete */
+void exfat_io_defer_free(struct exfat_io *io, void *buf)
+{
+	exfat_io_defer_put(io, NULL, buf, 0);
+}
+
+/*
+ * Wait for every queued request. Returns -1 if any request failed since
+ * the last flush.
+ */
+int exfat_io_flush(struct exfat_io *io)
+{
+	int ret;
+
+	if (io->ops->flush && io->ops->flush(io))
+		io->error = -1;
+
+	while (io->nr_deferred)
+		exfat_io_release(&io->deferred[--io->nr_deferred]);
+
+	ret = io->error;
+	io->error = 0;
+	return ret;
+}
+
+/*
+ * Start writing back what the completed writes left dirty in the page
+ * cache between @off and @off + @len, and with @wait also wait for it.
+ * Only this file is written back and the device cache is not flushed,
+ * exfat_io_sync() does that once at the end. Direct I/O leaves nothing
+ * to write back, neither do files that do not support it.
+ */
+int exfat_io_writeback(struct exfat_io *io, unsigned long long off,
+		unsigned long long len, bool wait)
+{
+	unsigned int flags = SYNC_FILE_RANGE_WRITE;
+
+	if (io->fd < 0 || io->flags & EXFAT_IO_DIRECT || io->no_writeback ||
+	    !len)
+		return 0;
+
+	if (wait)
+		flags |= SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WAIT_AFTER;
+	if (sync_file_range(io->fd, off, len, flags) < 0) {
+		if (errno == ENOSYS || errno == EINVAL || errno == ESPIPE) {
+			io->no_writeback = true;
+			return 0;
+		}
+		exfat_msg(EXFAT_ERROR, "sync_file_range failed : %s\n",
+			strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Flush and make everything written so far durable. Only the data of
+ * this file is synced, once, with the flush of the device cache that
+ * comes with it. Other files and devices are left alone.
+ */
+int exfat_io_sync(struct exfat_io *io)
+{
+	int ret = exfat_io_flush(io);
+
+	if (fdatasync(io->fd) < 0) {
+		exfat_msg(EXFAT_ERROR, "fdatasync failed : %s\n",
+			strerror(errno));
+		ret = -1;
+	}
+	return ret;
+}
+
+void exfat_io_exit(struct exfat_io *io)
+{
+	exfat_io_flush(io);
+	if (io->ops->exit)
+		io->ops->exit(io);
+	free(io->deferred);
+	memset(io, 0, sizeof(*io));
+	io->fd = -1;
+}
@@ -0,0 +1,366 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * The rings are driven through the raw system calls, the few operations
+ * needed here do not justify a dependency on liburing.
+ */
+
+struct uring_req {
+	int op;
+	char *buf;
+	size_t len;
+	size_t done;
+	unsigned long long off;
+	int buf_index;		/* registered buffer, -1 if none */
+};
+
+struct uring {
+	int fd;
+	int ring_fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct uring_req *reqs;
+	unsigned int *free_reqs;
+	unsigned int nr_free, nr_queued, nr_inflight;
+	int error;		/* a request failed since the last flush */
+
+	struct iovec *bufs;
+	unsigned int nr_bufs;
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+		unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg,
+		unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_exit(struct exfat_io *io)
+{
+	struct uring *u = io->priv;
+
+	if (!u)
+		return;
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_ring && u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_len);
+	if (u->sq_ring)
+		munmap(u->sq_ring, u->sq_ring_len);
+	if (u->ring_fd >= 0)
+		close(u->ring_fd);
+	free(u->reqs);
+	free(u->free_reqs);
+	free(u->bufs);
+	free(u);
+	io->priv = NULL;
+}
+
+static int uring_init(struct exfat_io *io)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	unsigned int i;
+
+	u = calloc(1, sizeof(*u));
+	if (!u)
+		return -1;
+	io->priv = u;
+	u->fd = io->fd;
+
+	memset(&p, 0, sizeof(p));
+	u->ring_fd = uring_setup(io->depth, &p);
+	if (u->ring_fd < 0)
+		goto err;
+
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_len = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_len > u->sq_ring_len)
+			u->sq_ring_len = u->cq_ring_len;
+		u->cq_ring_len = u->sq_ring_len;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		goto err;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->ring_fd,
+			IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			goto err;
+		}
+	}
+
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto err;
+	}
+
+	u->sq_head = (unsigned int *)((char *)u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->sq_ring + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_ring + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_ring + p.sq_off.array);
+	u->cq_head = (unsigned int *)((char *)u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_ring + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+
+	/* never more requests in flight than the SQ ring holds */
+	io->depth = p.sq_entries;
+	u->reqs = calloc(io->depth, sizeof(*u->reqs));
+	u->free_reqs = calloc(io->depth, sizeof(*u->free_reqs));
+	if (!u->reqs || !u->free_reqs)
+		goto err;
+	for (i = 0; i < io->depth; i++)
+		u->free_reqs[i] = io->depth - 1 - i;
+	u->nr_free = io->depth;
+	return 0;
+err:
+	uring_exit(io);
+	return -1;
+}
+
+/* Put request @idx, or what is left of it, on the submission ring */
+static void uring_queue(struct uring *u, unsigned int idx)
+{
+	struct uring_req *r = &u->reqs[idx];
+	unsigned int tail = *u->sq_tail, slot = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[slot];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = r->op;
+	sqe->fd = u->fd;
+	sqe->addr = (unsigned long)(r->buf + r->done);
+	sqe->len = r->len - r->done;
+	sqe->off = r->off + r->done;
+	sqe->user_data = idx;
+	if (r->buf_index >= 0) {
+		sqe->opcode = r->op == IORING_OP_READ ? IORING_OP_READ_FIXED :
+			IORING_OP_WRITE_FIXED;
+		sqe->buf_index = r->buf_index;
+	}
+
+	u->sq_array[slot] = slot;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->nr_queued++;
+}
+
+/*
+ * Submit what is queued and reap at least @min_complete completions. A
+ * failed request is recorded in @u->error, -1 is only returned when the
+ * ring itself cannot be entered.
+ */
+static int uring_reap(struct exfat_io *io, unsigned int min_complete)
+{
+	struct uring *u = io->priv;
+	unsigned int head;
+
+	while (u->nr_queued || min_complete) {
+		int n = uring_enter(u->ring_fd, u->nr_queued, min_complete,
+			min_complete ? IORING_ENTER_GETEVENTS : 0);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			exfat_msg(EXFAT_ERROR, "io_uring_enter failed : %s\n",
+				strerror(errno));
+			return -1;
+		}
+		u->nr_inflight += n;
+		u->nr_queued -= n;
+		if (min_complete)
+			break;
+	}
+
+	head = *u->cq_head;
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		unsigned int idx = cqe->user_data;
+		struct uring_req *r = &u->reqs[idx];
+
+		head++;
+		u->nr_inflight--;
+
+		if (cqe->res <= 0) {
+			exfat_msg(EXFAT_ERROR, "%s failed, offset : %llu, "
+				"res : %d\n", r->op == IORING_OP_READ ?
+				"read" : "write", r->off + r->done, cqe->res);
+			u->error = -1;
+		} else {
+			r->done += cqe->res;
+			/* short transfer, queue the rest again */
+			if (r->done < r->len) {
+				uring_queue(u, idx);
+				continue;
+			}
+		}
+		u->free_reqs[u->nr_free++] = idx;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static int uring_find_buffer(struct uring *u, const char *buf, size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < u->nr_bufs; i++) {
+		const char *base = u->bufs[i].iov_base;
+
+		if (buf >= base && buf + len <= base + u->bufs[i].iov_len)
+			return i;
+	}
+	return -1;
+}
+
+static int uring_submit(struct exfat_io *io, int op, void *buf, size_t len,
+		unsigned long long off)
+{
+	struct uring *u = io->priv;
+	struct uring_req *r;
+	unsigned int idx;
+
+	/* no free request, wait for one to complete */
+	while (!u->nr_free)
+		if (uring_reap(io, 1))
+			return -1;
+
+	idx = u->free_reqs[--u->nr_free];
+	r = &u->reqs[idx];
+	r->op = op;
+	r->buf = buf;
+	r->len = len;
+	r->done = 0;
+	r->off = off;
+	r->buf_index = uring_find_buffer(u, buf, len);
+	uring_queue(u, idx);
+	return 0;
+}
+
+static int uring_read(struct exfat_io *io, void *buf, size_t len,
+		unsigned long long off)
+{
+	return uring_submit(io, IORING_OP_READ, buf, len, off);
+}
+
+static int uring_write(struct exfat_io *io, const void *buf, size_t len,
+		unsigned long long off)
+{
+	return uring_submit(io, IORING_OP_WRITE, (void *)buf, len, off);
+}
+
+static int uring_flush(struct exfat_io *io)
+{
+	struct uring *u = io->priv;
+	int ret;
+
+	while (u->nr_inflight || u->nr_queued)
+		if (uring_reap(io, 1))
+			return -1;
+
+	ret = u->error;
+	u->error = 0;
+	return ret;
+}
+
+/*
+ * Registered buffers are pinned once instead of on every request. The
+ * kernel takes the whole table at once, so it is registered again with
+ * the new buffer added.
+ */
+static int uring_register_buffer(struct exfat_io *io, void *buf, size_t len)
+{
+	struct uring *u = io->priv;
+	struct iovec *bufs;
+
+	if (uring_flush(io))
+		return -1;
+
+	bufs = realloc(u->bufs, (u->nr_bufs + 1) * sizeof(*bufs));
+	if (!bufs)
+		return -1;
+	u->bufs = bufs;
+	bufs[u->nr_bufs].iov_base = buf;
+	bufs[u->nr_bufs].iov_len = len;
+
+	if (u->nr_bufs)
+		uring_register(u->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	if (uring_register(u->ring_fd, IORING_REGISTER_BUFFERS, bufs,
+			u->nr_bufs + 1) < 0) {
+		exfat_msg(EXFAT_DEBUG, "cannot register buffers : %s\n",
+			strerror(errno));
+		/* requests still work, just without fixed buffers */
+		u->nr_bufs = 0;
+		return 0;
+	}
+	u->nr_bufs++;
+	return 0;
+}
+
+const struct exfat_io_ops exfat_io_uring_ops = {
+	.name		= "io_uring",
+	.init		= uring_init,
+	.read		= uring_read,
+	.write		= uring_write,
+	.flush		= uring_flush,
+	.register_buffer = uring_register_buffer,
+	.exit		= uring_exit,
+};
+
+#else
+
+/* not built in, exfat_io_init() falls back to the synchronous backend */
+const struct exfat_io_ops exfat_io_uring_ops = {
+	.name		= "io_uring",
+};
+
+#endif /* HAVE_IO_URING */
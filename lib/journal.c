@@ -0,0 +1,349 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+/*
+ * Repairs found by several threads at once are collected here as patches
+ * of 32-bit words of the FAT and the allocation bitmap. Each thread fills
+ * chunks of its own queue and pushes the full ones onto the journal with
+ * a compare-and-swap, so adding a patch never waits for another thread.
+ * One committer then takes every chunk, sorts the patches by offset and
+ * writes them out as few large read-modify-write batches.
+ */
+void exfat_journal_init(struct exfat_journal *j, struct exfat_volume *vol,
+		struct exfat_io *io)
+{
+	memset(j, 0, sizeof(*j));
+	j->vol = vol;
+	j->io = io;
+}
+
+static void journal_free_chunks(struct exfat_journal_chunk *c)
+{
+	while (c) {
+		struct exfat_journal_chunk *next = c->next;
+
+		free(c);
+		c = next;
+	}
+}
+
+/* Patches not committed yet are dropped */
+void exfat_journal_free(struct exfat_journal *j)
+{
+	journal_free_chunks(__atomic_exchange_n(&j->published, NULL,
+		__ATOMIC_ACQUIRE));
+}
+
+void exfat_journal_queue_init(struct exfat_journal_queue *q,
+		struct exfat_journal *j)
+{
+	memset(q, 0, sizeof(*q));
+	q->j = j;
+}
+
+/* Push @c onto the published chunks, safe against other threads */
+static void journal_publish(struct exfat_journal *j,
+		struct exfat_journal_chunk *c)
+{
+	c->next = __atomic_load_n(&j->published, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&j->published, &c->next, c, true,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Queue a patch of the word at device offset @off. Patches of the same
+ * bits from different queues are applied in no particular order, every
+ * FAT entry and bitmap bit is to be repaired by one thread only.
+ */
+int exfat_journal_add(struct exfat_journal_queue *q, unsigned long long off,
+		__u32 value, __u32 mask)
+{
+	struct exfat_journal_patch *p;
+
+	if (q->error)
+		return -1;
+	if (!q->cur) {
+		q->cur = malloc(sizeof(*q->cur));
+		if (!q->cur) {
+			exfat_msg(EXFAT_ERROR,
+				"Cannot allocate repair journal\n");
+			q->error = -1;
+			return -1;
+		}
+		q->cur->nr = 0;
+	}
+
+	p = &q->cur->patches[q->cur->nr++];
+	p->off = off;
+	p->value = value & mask;
+	p->mask = mask;
+
+	if (q->cur->nr == EXFAT_JOURNAL_CHUNK_PATCHES) {
+		journal_publish(q->j, q->cur);
+		q->cur = NULL;
+	}
+	return 0;
+}
+
+/* Point the FAT entry of @clu at @next, in every FAT */
+int exfat_journal_set_fat(struct exfat_journal_queue *q, unsigned int clu,
+		unsigned int next)
+{
+	struct exfat_volume *vol = q->j->vol;
+	unsigned int i;
+
+	for (i = 0; i < vol->pbr.bsx.num_fats; i++)
+		if (exfat_journal_add(q, vol->fat_byte_off +
+				i * vol->fat_byte_len +
+				(unsigned long long)clu * sizeof(__le32), next,
+				~0U))
+			return -1;
+	return 0;
+}
+
+/* Mark @nr_clus clusters from @clu in use, or free, in the bitmap */
+int exfat_journal_set_bits(struct exfat_journal_queue *q, unsigned int clu,
+		unsigned int nr_clus, bool set)
+{
+	struct exfat_volume *vol = q->j->vol;
+	unsigned long long bitmap_off = exfat_cluster_offset(vol,
+		vol->bitmap_clu);
+	unsigned long long bit = clu - EXFAT_FIRST_CLUSTER;
+	unsigned long long end = bit + nr_clus;
+
+	while (bit < end) {
+		unsigned int first = bit % 32;
+		unsigned int nr = end - bit < 32 - first ? end - bit :
+			32 - first;
+		__u32 mask = (nr == 32 ? ~0U : ((1U << nr) - 1)) << first;
+
+		if (exfat_journal_add(q, bitmap_off + bit / 32 * 4,
+				set ? mask : 0, mask))
+			return -1;
+		bit += nr;
+	}
+	return 0;
+}
+
+/* Hand the patches of the current chunk over, returns any earlier error */
+int exfat_journal_queue_flush(struct exfat_journal_queue *q)
+{
+	if (q->cur) {
+		if (q->cur->nr)
+			journal_publish(q->j, q->cur);
+		else
+			free(q->cur);
+		q->cur = NULL;
+	}
+	return q->error;
+}
+
+static int journal_patch_cmp(const void *a, const void *b)
+{
+	const struct exfat_journal_patch *pa = a, *pb = b;
+
+	if (pa->off != pb->off)
+		return pa->off < pb->off ? -1 : 1;
+	return 0;
+}
+
+/* Take every published patch in offset order, one patch per word */
+static struct exfat_journal_patch *journal_collect(struct exfat_journal *j,
+		size_t *nr)
+{
+	struct exfat_journal_chunk *chunks, *c;
+	struct exfat_journal_patch *patches;
+	size_t total = 0, i, n;
+
+	chunks = __atomic_exchange_n(&j->published, NULL, __ATOMIC_ACQUIRE);
+	for (c = chunks; c; c = c->next)
+		total += c->nr;
+
+	*nr = 0;
+	patches = malloc((total ? total : 1) * sizeof(*patches));
+	if (!patches) {
+		exfat_msg(EXFAT_ERROR, "Cannot sort repair journal\n");
+		journal_free_chunks(chunks);
+		return NULL;
+	}
+	for (c = chunks, n = 0; c; c = c->next) {
+		memcpy(patches + n, c->patches, c->nr * sizeof(*patches));
+		n += c->nr;
+	}
+	journal_free_chunks(chunks);
+
+	qsort(patches, total, sizeof(*patches), journal_patch_cmp);
+	for (i = 0, n = 0; i < total; i++) {
+		struct exfat_journal_patch *p = &patches[i];
+
+		if (n && patches[n - 1].off == p->off) {
+			struct exfat_journal_patch *q = &patches[n - 1];
+
+			q->value = (q->value & ~p->mask) | p->value;
+			q->mask |= p->mask;
+			j->nr_merged++;
+			continue;
+		}
+		patches[n++] = *p;
+	}
+	*nr = n;
+	return patches;
+}
+
+/* the sectors under some patches, read, patched and written as one */
+struct journal_batch {
+	const struct exfat_journal_patch *patches;
+	size_t nr;
+	unsigned long long start;
+	size_t len;
+	char *buf;
+};
+
+/*
+ * Read the batches of one round at once, then patch them and queue their
+ * writes. The writes go on while the next round is read, the rounds do
+ * not share a sector. Buffers go back once their write is done.
+ */
+static int journal_write_round(struct exfat_journal *j,
+		struct journal_batch *batches, unsigned int nr)
+{
+	unsigned int i;
+	size_t k;
+	int ret = 0;
+
+	for (i = 0; i < nr; i++) {
+		struct journal_batch *b = &batches[i];
+
+		b->buf = malloc(b->len);
+		if (!b->buf || exfat_io_read(j->io, b->buf, b->len, b->start))
+			ret = -1;
+	}
+	if (exfat_io_flush(j->io))
+		ret = -1;
+
+	for (i = 0; i < nr; i++) {
+		struct journal_batch *b = &batches[i];
+
+		if (ret) {
+			free(b->buf);
+			continue;
+		}
+		for (k = 0; k < b->nr; k++) {
+			const struct exfat_journal_patch *p = &b->patches[k];
+			__le32 *w = (__le32 *)(b->buf + (p->off - b->start));
+
+			*w = cpu_to_le32((le32_to_cpu(*w) & ~p->mask) |
+				p->value);
+		}
+		exfat_io_defer_free(j->io, b->buf);
+		if (exfat_io_write(j->io, b->buf, b->len, b->start))
+			ret = -1;
+	}
+	j->nr_batches += nr;
+	return ret;
+}
+
+/*
+ * Split the sorted patches into batches of at most about
+ * EXFAT_JOURNAL_BATCH_SIZE bytes, with no gap over EXFAT_JOURNAL_MAX_GAP.
+ * Patches in one sector always go in the same batch.
+ */
+static int journal_write_patches(struct exfat_journal *j,
+		const struct exfat_journal_patch *patches, size_t nr)
+{
+	unsigned long long sector_size = j->vol->sector_size;
+	struct journal_batch batches[EXFAT_IO_DEPTH];
+	unsigned int nr_batches = 0;
+	size_t first, i;
+
+	for (first = 0, i = 1; i <= nr; i++) {
+		struct journal_batch *b;
+		unsigned long long start, end;
+
+		if (i < nr &&
+		    (round_down(patches[i].off, sector_size) ==
+		     round_down(patches[i - 1].off, sector_size) ||
+		     (patches[i].off + sizeof(__le32) - patches[first].off <=
+		      EXFAT_JOURNAL_BATCH_SIZE &&
+		      patches[i].off - patches[i - 1].off <=
+		      EXFAT_JOURNAL_MAX_GAP)))
+			continue;
+
+		start = round_down(patches[first].off, sector_size);
+		end = round_up(patches[i - 1].off + sizeof(__le32),
+			sector_size);
+		b = &batches[nr_batches++];
+		b->patches = patches + first;
+		b->nr = i - first;
+		b->start = start;
+		b->len = end - start;
+		first = i;
+
+		if (nr_batches == EXFAT_IO_DEPTH || i == nr) {
+			if (journal_write_round(j, batches, nr_batches))
+				return -1;
+			nr_batches = 0;
+		}
+	}
+	return 0;
+}
+
+static int journal_write_flags(struct exfat_journal *j,
+		unsigned short vol_flags)
+{
+	/* VolumeFlags is not part of the boot checksum */
+	j->flags = cpu_to_le16(vol_flags);
+	if (exfat_io_write(j->io, &j->flags, sizeof(j->flags),
+			offsetof(struct pbr, bsx.vol_flags)))
+		return -1;
+	return exfat_io_sync(j->io);
+}
+
+/*
+ * Apply every patch published so far. The volume is marked dirty while
+ * the patches are written, a crash in between leaves it for the next
+ * check. @vol_flags are written once every patch is on disk.
+ */
+int exfat_journal_commit(struct exfat_journal *j, unsigned short vol_flags)
+{
+	struct exfat_journal_patch *patches;
+	size_t nr;
+	int ret = -1;
+
+	patches = journal_collect(j, &nr);
+	if (!patches)
+		return -1;
+	if (!nr) {
+		ret = 0;
+		goto out;
+	}
+
+	if (journal_write_flags(j, j->vol->vol_flags | VOL_DIRTY))
+		goto out;
+
+	if (journal_write_patches(j, patches, nr) || exfat_io_sync(j->io))
+		goto out;
+
+	if (journal_write_flags(j, vol_flags))
+		goto out;
+	j->nr_patches += nr;
+	ret = 0;
+out:
+	if (ret)
+		exfat_msg(EXFAT_ERROR, "repair journal commit failed\n");
+	exfat_msg(EXFAT_DEBUG, "Repair journal : %zu patches, %llu merged, "
+		"%llu batches\n", nr, j->nr_merged, j->nr_batches);
+	free(patches);
+	return ret;
+}
@@ -3,6 +3,12 @@
  *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
  */
 
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
 #include "exfat_ondisk.h"
 #include "exfat_tools.h"
 
@@ -15,6 +21,8 @@
 #define BIT_MASK(nr)            ((1) << ((nr) % 32))
 #define BIT_WORD(nr)            ((nr) / 32)
 
+unsigned int print_level;
+
 static inline void set_bit(int nr, volatile unsigned int *addr)
 {
         unsigned long mask = BIT_MASK(nr);
@@ -62,3 +70,106 @@ void exfat_clear_bit(struct exfat_blk_dev *bd, char *bitmap,
 
 	clear_bit_le(b, bitmap);
 }
+
+static inline void exfat_fill_bit_range(char *bitmap, unsigned int clu,
+		unsigned int count, bool set)
+{
+	unsigned char *p = (unsigned char *)bitmap + (clu >> 3);
+	unsigned int first = clu & 7;
+	unsigned char mask;
+
+	if (!count)
+		return;
+
+	/* leading partial byte */
+	if (first) {
+		unsigned int nbits = 8 - first < count ? 8 - first : count;
+
+		mask = ((1U << nbits) - 1) << first;
+		if (set)
+			*p |= mask;
+		else
+			*p &= ~mask;
+		p++;
+		count -= nbits;
+	}
+
+	/* whole bytes, memset() is expected to use the widest stores */
+	if (count >= 8) {
+		memset(p, set ? 0xff : 0, count >> 3);
+		p += count >> 3;
+		count &= 7;
+	}
+
+	/* trailing partial byte */
+	if (count) {
+		mask = (1U << count) - 1;
+		if (set)
+			*p |= mask;
+		else
+			*p &= ~mask;
+	}
+}
+
+void exfat_set_bit_range(char *bitmap, unsigned int clu, unsigned int count)
+{
+	exfat_fill_bit_range(bitmap, clu, count, true);
+}
+
+void exfat_clear_bit_range(char *bitmap, unsigned int clu,
+		unsigned int count)
+{
+	exfat_fill_bit_range(bitmap, clu, count, false);
+}
+
+/* Parse a byte count with an optional binary K, M, G or T suffix */
+int exfat_parse_size(const char *str, unsigned long long *size)
+{
+	char *end;
+	unsigned int shift = 0;
+
+	errno = 0;
+	*size = strtoull(str, &end, 0);
+	if (errno || end == str)
+		return -1;
+
+	switch (*end) {
+	case 'T': case 't':
+		shift += 10;
+		/* fall through */
+	case 'G': case 'g':
+		shift += 10;
+		/* fall through */
+	case 'M': case 'm':
+		shift += 10;
+		/* fall through */
+	case 'K': case 'k':
+		shift += 10;
+		end++;
+		break;
+	}
+	if (*end || (*size << shift) >> shift != *size)
+		return -1;
+	*size <<= shift;
+	return 0;
+}
+
+/* Parse a decimal count from 1 to @max, nothing else may follow it */
+int exfat_parse_count(const char *str, unsigned int max, unsigned int *val)
+{
+	unsigned long n;
+	char *end;
+
+	/* strtoul() would take "-1" as ULONG_MAX */
+	while (isspace((unsigned char)*str))
+		str++;
+	if (*str == '-')
+		return -1;
+
+	errno = 0;
+	n = strtoul(str, &end, 10);
+	if (errno || end == str || *end || !n || n > max)
+		return -1;
+	*val = n;
+	return 0;
+}
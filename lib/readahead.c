@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+/*
+ * Tell the kernel about @len bytes at @off that are going to be read. The
+ * hint goes to the mapping when there is one, since that is where the
+ * pages are faulted in from.
+ */
+static void exfat_ra_issue(struct exfat_volume *vol, unsigned long long off,
+		unsigned long long len)
+{
+	/* several walkers share the volume */
+	__atomic_add_fetch(&vol->nr_ra_issued, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&vol->ra_bytes, len, __ATOMIC_RELAXED);
+
+	if (vol->map) {
+		unsigned long long page_mask = sysconf(_SC_PAGESIZE) - 1;
+		unsigned long long start = off & ~page_mask;
+
+		madvise((char *)vol->map + start, len + off - start,
+			MADV_WILLNEED);
+		return;
+	}
+	posix_fadvise(vol->fd, off, len, POSIX_FADV_WILLNEED);
+}
+
+/*
+ * Advise clusters from the front of the chain until @ra->window bytes
+ * are ahead of the reader. Physically contiguous clusters are merged into
+ * a single hint, whether the object has the NoFatChain flag or its FAT
+ * chain just happens to be in order.
+ */
+static void exfat_ra_fill(struct exfat_readahead *ra)
+{
+	struct exfat_volume *vol = ra->vol;
+
+	while (ra->ahead < ra->window && ra->nr_left &&
+	       exfat_cluster_valid(vol, ra->next_clu)) {
+		unsigned int start = ra->next_clu, nr = 1;
+		unsigned int budget = (ra->window - ra->ahead) >>
+			vol->cluster_size_bits;
+
+		if (!budget)
+			budget = 1;
+		if (budget > ra->nr_left)
+			budget = ra->nr_left;
+
+		if (ra->contiguous) {
+			nr = budget;
+			if (nr > vol->clu_count - (start - EXFAT_FIRST_CLUSTER))
+				nr = vol->clu_count -
+					(start - EXFAT_FIRST_CLUSTER);
+			ra->next_clu = start + nr;
+		} else {
+			unsigned int clu = exfat_fat_next(vol, start);
+
+			while (nr < budget && clu == start + nr &&
+			       exfat_cluster_valid(vol, clu))
+				clu = exfat_fat_next(vol, start + nr++);
+			ra->next_clu = clu;
+		}
+
+		ra->nr_left -= nr;
+		ra->ahead += (unsigned long long)nr << vol->cluster_size_bits;
+		exfat_ra_issue(vol, exfat_cluster_offset(vol, start),
+			(unsigned long long)nr << vol->cluster_size_bits);
+	}
+}
+
+/*
+ * Start reading ahead the @nr_clus clusters of an object starting at
+ * @clu. The window is taken from the volume, EXFAT_RA_WINDOW by default.
+ */
+void exfat_ra_start(struct exfat_readahead *ra, struct exfat_volume *vol,
+		unsigned int clu, unsigned int nr_clus, bool contiguous)
+{
+	memset(ra, 0, sizeof(*ra));
+	ra->vol = vol;
+	ra->next_clu = clu;
+	ra->nr_left = nr_clus;
+	ra->contiguous = contiguous;
+	ra->window = vol->ra_window;
+	if (ra->window)
+		exfat_ra_fill(ra);
+}
+
+/* The reader is done with @nr_clus more clusters, keep the window full */
+void exfat_ra_consume(struct exfat_readahead *ra, unsigned int nr_clus)
+{
+	unsigned long long len = (unsigned long long)nr_clus <<
+		ra->vol->cluster_size_bits;
+
+	if (!ra->window)
+		return;
+
+	ra->ahead = len < ra->ahead ? ra->ahead - len : 0;
+	exfat_ra_fill(ra);
+}
@@ -0,0 +1,258 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+/* --stats gives the text table, --stats=json the same as a document */
+int exfat_stats_parse_format(const char *arg)
+{
+	if (!arg || !strcmp(arg, "text"))
+		return EXFAT_STATS_TEXT;
+	if (!strcmp(arg, "json"))
+		return EXFAT_STATS_JSON;
+	return -1;
+}
+
+static void stats_calibrate(struct exfat_stats *st);
+
+/*
+ * @thread counts only the calling thread, for a job that runs on a
+ * thread of its own next to others. I/O done by kernel workers on its
+ * behalf, io_uring's for one, is then not counted.
+ */
+void exfat_stats_init(struct exfat_stats *st, const char *label,
+		bool enabled, bool thread)
+{
+	memset(st, 0, sizeof(*st));
+	st->enabled = enabled;
+	st->thread = thread;
+	st->label = label;
+	st->cur = -1;
+	if (enabled)
+		stats_calibrate(st);
+}
+
+static unsigned long long stats_clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clk, &ts))
+		return 0;
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_read_io(struct exfat_stats_sample *s, bool thread)
+{
+	FILE *fp = fopen(thread ? "/proc/thread-self/io" : "/proc/self/io",
+		"r");
+	char key[32];
+	unsigned long long val;
+
+	if (!fp)
+		return;
+
+	while (fscanf(fp, "%31[^:]: %llu\n", key, &val) == 2) {
+		if (!strcmp(key, "syscr"))
+			s->nr_read_calls = val;
+		else if (!strcmp(key, "syscw"))
+			s->nr_write_calls = val;
+		else if (!strcmp(key, "read_bytes"))
+			s->storage_read = val;
+		else if (!strcmp(key, "write_bytes"))
+			s->storage_written = val;
+	}
+	fclose(fp);
+}
+
+static void stats_sample(struct exfat_stats_sample *s, bool thread)
+{
+	memset(s, 0, sizeof(*s));
+	exfat_io_get_counters(&s->io, thread);
+	stats_read_io(s, thread);
+	s->cpu_ns = stats_clock_ns(thread ? CLOCK_THREAD_CPUTIME_ID :
+		CLOCK_PROCESS_CPUTIME_ID);
+	s->wall_ns = stats_clock_ns(CLOCK_MONOTONIC);
+}
+
+static void stats_calibrate(struct exfat_stats *st)
+{
+	struct exfat_stats_sample a, b;
+
+	stats_sample(&a, st->thread);
+	stats_sample(&b, st->thread);
+	st->sample_read_calls = b.nr_read_calls - a.nr_read_calls;
+}
+
+static unsigned long long stats_peak_rss_kb(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+	return ru.ru_maxrss;
+}
+
+/*
+ * Start counting for the phase @name, ending the one in progress. A
+ * phase entered again adds to what it counted before. @name has to
+ * outlive @st, it is kept as is.
+ */
+void exfat_stats_begin(struct exfat_stats *st, const char *name)
+{
+	unsigned int i;
+
+	if (!st->enabled)
+		return;
+	exfat_stats_end(st);
+
+	for (i = 0; i < st->nr_phases; i++)
+		if (!strcmp(st->phases[i].name, name))
+			break;
+	if (i == st->nr_phases) {
+		if (st->nr_phases == EXFAT_STATS_MAX_PHASES)
+			return;
+		st->phases[st->nr_phases++].name = name;
+	}
+
+	st->cur = i;
+	st->phases[i].count++;
+	stats_sample(&st->start, st->thread);
+}
+
+#define stats_add(t, e, s, field) ((t)->field += (e)->field - (s)->field)
+
+void exfat_stats_end(struct exfat_stats *st)
+{
+	struct exfat_stats_phase *p;
+	struct exfat_stats_sample end;
+
+	if (!st->enabled || st->cur < 0)
+		return;
+
+	stats_sample(&end, st->thread);
+	p = &st->phases[st->cur];
+	stats_add(&p->total, &end, &st->start, wall_ns);
+	stats_add(&p->total, &end, &st->start, cpu_ns);
+	stats_add(&p->total, &end, &st->start, io.nr_reads);
+	stats_add(&p->total, &end, &st->start, io.bytes_read);
+	stats_add(&p->total, &end, &st->start, io.nr_writes);
+	stats_add(&p->total, &end, &st->start, io.bytes_written);
+	/* what reading /proc for the sample took is not the phase's */
+	if (end.nr_read_calls - st->start.nr_read_calls >=
+	    st->sample_read_calls)
+		end.nr_read_calls -= st->sample_read_calls;
+	else
+		end.nr_read_calls = st->start.nr_read_calls;
+	stats_add(&p->total, &end, &st->start, nr_read_calls);
+	stats_add(&p->total, &end, &st->start, nr_write_calls);
+	stats_add(&p->total, &end, &st->start, storage_read);
+	stats_add(&p->total, &end, &st->start, storage_written);
+	p->peak_rss_kb = stats_peak_rss_kb();
+	st->cur = -1;
+}
+
+static void stats_print_text(struct exfat_stats *st, FILE *fp)
+{
+	unsigned int i;
+
+	fprintf(fp, "%s:\n", st->label);
+	fprintf(fp, "  %-12s %5s %10s %10s %8s %8s %10s %10s %8s %10s %10s "
+		"%9s\n", "phase", "count", "wall ms", "cpu ms", "reads",
+		"writes", "read KB", "written KB", "syscalls", "dev rd KB",
+		"dev wr KB", "peak RSS");
+
+	for (i = 0; i < st->nr_phases; i++) {
+		struct exfat_stats_phase *p = &st->phases[i];
+		struct exfat_stats_sample *s = &p->total;
+
+		fprintf(fp, "  %-12s %5u %10.3f %10.3f %8llu %8llu %10llu "
+			"%10llu %8llu %10llu %10llu %9llu\n", p->name,
+			p->count, s->wall_ns / 1e6, s->cpu_ns / 1e6,
+			s->io.nr_reads, s->io.nr_writes, s->io.bytes_read >> 10,
+			s->io.bytes_written >> 10,
+			s->nr_read_calls + s->nr_write_calls,
+			s->storage_read >> 10, s->storage_written >> 10,
+			p->peak_rss_kb);
+	}
+}
+
+static void stats_print_json_string(const char *str, FILE *fp)
+{
+	const unsigned char *p = (const unsigned char *)str;
+
+	fputc('"', fp);
+	for (; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(fp, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(fp, "\\u%04x", *p);
+		else
+			fputc(*p, fp);
+	}
+	fputc('"', fp);
+}
+
+static void stats_print_json(struct exfat_stats *st, FILE *fp)
+{
+	unsigned int i;
+
+	fprintf(fp, "    {\n      \"label\": ");
+	stats_print_json_string(st->label, fp);
+	fprintf(fp, ",\n      \"phases\": [");
+
+	for (i = 0; i < st->nr_phases; i++) {
+		struct exfat_stats_phase *p = &st->phases[i];
+		struct exfat_stats_sample *s = &p->total;
+
+		fprintf(fp, "%s\n        { \"name\": ", i ? "," : "");
+		stats_print_json_string(p->name, fp);
+		fprintf(fp, ", \"count\": %u, \"wall_ns\": %llu, "
+			"\"cpu_ns\": %llu, \"reads\": %llu, "
+			"\"bytes_read\": %llu, \"writes\": %llu, "
+			"\"bytes_written\": %llu, \"read_syscalls\": %llu, "
+			"\"write_syscalls\": %llu, \"storage_read\": %llu, "
+			"\"storage_written\": %llu, \"peak_rss_kb\": %llu }",
+			p->count, s->wall_ns, s->cpu_ns, s->io.nr_reads,
+			s->io.bytes_read, s->io.nr_writes, s->io.bytes_written,
+			s->nr_read_calls, s->nr_write_calls, s->storage_read,
+			s->storage_written, p->peak_rss_kb);
+	}
+	fprintf(fp, "\n      ]\n    }");
+}
+
+/* Print the phases of @nr sets of counters, then the peak RSS */
+void exfat_stats_report(struct exfat_stats **sts, unsigned int nr,
+		int format, FILE *fp)
+{
+	unsigned int i;
+
+	if (format == EXFAT_STATS_JSON)
+		fprintf(fp, "{\n  \"stats\": [\n");
+
+	for (i = 0; i < nr; i++) {
+		exfat_stats_end(sts[i]);
+		if (format == EXFAT_STATS_JSON) {
+			if (i)
+				fprintf(fp, ",\n");
+			stats_print_json(sts[i], fp);
+		} else {
+			stats_print_text(sts[i], fp);
+		}
+	}
+
+	if (format == EXFAT_STATS_JSON)
+		fprintf(fp, "\n  ],\n  \"peak_rss_kb\": %llu\n}\n",
+			stats_peak_rss_kb());
+	else
+		fprintf(fp, "peak RSS : %llu KB\n", stats_peak_rss_kb());
+}
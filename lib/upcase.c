@@ -0,0 +1,281 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+#include "upcase_checksum.h"
+
+/* in a compressed table, 0xFFFF is followed by a count of identity entries */
+#define UPCASE_IDENTITY_RUN	0xFFFF
+
+const unsigned int exfat_upcase_table_checksum = EXFAT_UPCASE_TABLE_CHECKSUM;
+
+static unsigned short upcase_default[EXFAT_UPCASE_CHARS];
+static pthread_once_t upcase_default_once = PTHREAD_ONCE_INIT;
+
+#define NAME_SET_INIT_SLOTS	64
+#define NAME_SET_EMPTY		0xFFFFFFFF
+
+/*
+ * Expand an upcase table, compressed or not, into a flat array with one
+ * entry for every UTF-16 code unit. Characters past the end of the table
+ * map to themselves.
+ */
+int exfat_upcase_expand(const void *table, size_t len, unsigned short *flat)
+{
+	const unsigned char *p = table;
+	unsigned int ch = 0, i;
+
+	for (i = 0; i < EXFAT_UPCASE_CHARS; i++)
+		flat[i] = i;
+
+	for (; len >= 2; len -= 2, p += 2) {
+		unsigned int v = p[0] | p[1] << 8;
+
+		if (v == UPCASE_IDENTITY_RUN && len >= 4) {
+			p += 2;
+			len -= 2;
+			ch += p[0] | p[1] << 8;
+			continue;
+		}
+
+		if (ch >= EXFAT_UPCASE_CHARS)
+			return -1;
+		flat[ch++] = v;
+	}
+	return 0;
+}
+
+static void upcase_default_init(void)
+{
+	exfat_upcase_expand(exfat_upcase_table, EXFAT_UPCASE_TABLE_SIZE,
+		upcase_default);
+}
+
+/*
+ * The built-in table expanded, on first use only. It is never written
+ * again, every volume and thread that has the table shares it.
+ */
+const unsigned short *exfat_upcase_default(void)
+{
+	pthread_once(&upcase_default_once, upcase_default_init);
+	return upcase_default;
+}
+
+/*
+ * Read the volume upcase table and expand it once. Workers only ever read
+ * vol->upcase, so it is shared without locking. Most volumes have the
+ * built-in table, they get the expanded copy every volume shares.
+ */
+int exfat_volume_load_upcase(struct exfat_volume *vol)
+{
+	unsigned int clu = vol->ut_clu, nr_clus = 0;
+	unsigned long long off = 0;
+	unsigned short *upcase = NULL;
+	unsigned char *table;
+	int ret = -1;
+
+	if (!vol->ut_clu || !vol->ut_len ||
+	    vol->ut_len > EXFAT_UPCASE_CHARS * 2 * 2) {
+		exfat_msg(EXFAT_ERROR, "no valid upcase table entry\n");
+		return -1;
+	}
+
+	table = malloc(round_up(vol->ut_len, vol->cluster_size));
+	if (!table)
+		goto out;
+
+	/* the table can have a FAT chain, it is only a cluster or two */
+	while (off < vol->ut_len) {
+		const void *p = NULL;
+
+		if (exfat_cluster_valid(vol, clu) && nr_clus++ < vol->clu_count)
+			p = exfat_volume_read_cluster(vol, table + off, clu);
+		if (!p) {
+			exfat_msg(EXFAT_ERROR, "broken upcase table chain\n");
+			goto out;
+		}
+		/* a zero-copy read points into the mapping */
+		if (p != table + off)
+			memcpy(table + off, p, vol->cluster_size);
+		off += vol->cluster_size;
+		clu = exfat_fat_next(vol, clu);
+	}
+
+	if (exfat_calc_upcase_checksum(table, vol->ut_len) !=
+	    vol->ut_checksum) {
+		exfat_msg(EXFAT_ERROR, "upcase table checksum mismatch\n");
+		goto out;
+	}
+
+	if (vol->ut_len == EXFAT_UPCASE_TABLE_SIZE &&
+	    !memcmp(table, exfat_upcase_table, EXFAT_UPCASE_TABLE_SIZE)) {
+		vol->upcase = exfat_upcase_default();
+		ret = 0;
+		goto out;
+	}
+
+	upcase = malloc(EXFAT_UPCASE_CHARS * sizeof(*upcase));
+	if (!upcase)
+		goto out;
+	if (exfat_upcase_expand(table, vol->ut_len, upcase)) {
+		exfat_msg(EXFAT_ERROR, "upcase table is too long\n");
+		goto out;
+	}
+	vol->upcase = upcase;
+	vol->upcase_alloced = true;
+	upcase = NULL;
+	ret = 0;
+out:
+	free(upcase);
+	free(table);
+	return ret;
+}
+
+/*
+ * Gather the name of @set into @name, upcased with @upcase, and return its
+ * NameHash. All name entries are handled in one pass, the upcased copy is
+ * kept so duplicates can be compared without looking the table up again.
+ * Returns -1 if the name entries hold fewer characters than NameLength.
+ */
+int exfat_upcase_name(const unsigned short *upcase,
+		const struct exfat_dentry_set *set, unsigned short *name,
+		unsigned int *name_len)
+{
+	unsigned int len = set->stream->stream_name_len, i;
+	unsigned short hash = 0;
+
+	if (!len || len > set->nr_names * EXFAT_NAME_ENTRY_CHARS)
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		const struct exfat_dentry *ed = set->name + i / EXFAT_NAME_ENTRY_CHARS;
+		unsigned short ch = le16_to_cpu(ed->name_unicode[i %
+			EXFAT_NAME_ENTRY_CHARS]);
+
+		if (upcase)
+			ch = upcase[ch];
+		name[i] = ch;
+		hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (ch & 0xFF);
+		hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (ch >> 8);
+	}
+	*name_len = len;
+	return hash;
+}
+
+void exfat_name_set_init(struct exfat_name_set *ns)
+{
+	memset(ns, 0, sizeof(*ns));
+}
+
+void exfat_name_set_reset(struct exfat_name_set *ns)
+{
+	if (ns->nr_names)
+		memset(ns->slots, 0xFF, ns->nr_slots * sizeof(*ns->slots));
+	ns->nr_names = 0;
+	ns->pool_len = 0;
+}
+
+void exfat_name_set_free(struct exfat_name_set *ns)
+{
+	free(ns->slots);
+	free(ns->names);
+	free(ns->pool);
+	memset(ns, 0, sizeof(*ns));
+}
+
+static unsigned int *name_set_lookup(struct exfat_name_set *ns,
+		unsigned short hash, const unsigned short *name,
+		unsigned int len)
+{
+	unsigned int mask = ns->nr_slots - 1, i = hash & mask;
+
+	for (;; i = (i + 1) & mask) {
+		unsigned int *slot = &ns->slots[i];
+		struct exfat_name_set_entry *e;
+
+		if (*slot == NAME_SET_EMPTY)
+			return slot;
+
+		e = &ns->names[*slot];
+		if (e->hash == hash && e->len == len &&
+		    !memcmp(ns->pool + e->off, name, len * sizeof(*name)))
+			return slot;
+	}
+}
+
+static int name_set_grow(struct exfat_name_set *ns)
+{
+	unsigned int nr_slots = ns->nr_slots ? ns->nr_slots * 2 :
+		NAME_SET_INIT_SLOTS;
+	unsigned int *slots, i;
+	struct exfat_name_set_entry *names;
+
+	slots = malloc(nr_slots * sizeof(*slots));
+	names = realloc(ns->names, nr_slots / 2 * sizeof(*names));
+	if (!slots || !names) {
+		free(slots);
+		if (names)
+			ns->names = names;
+		return -1;
+	}
+
+	free(ns->slots);
+	ns->slots = slots;
+	ns->names = names;
+	ns->nr_slots = nr_slots;
+	memset(slots, 0xFF, nr_slots * sizeof(*slots));
+	for (i = 0; i < ns->nr_names; i++) {
+		struct exfat_name_set_entry *e = &names[i];
+
+		*name_set_lookup(ns, e->hash, ns->pool + e->off, e->len) = i;
+	}
+	return 0;
+}
+
+/*
+ * Insert an upcased name. Linear probing on the name hash, kept at most
+ * half full. Returns 1 if the directory already has the name, 0 if it was
+ * added and -1 without memory.
+ */
+int exfat_name_set_insert(struct exfat_name_set *ns, unsigned short hash,
+		const unsigned short *name, unsigned int len)
+{
+	struct exfat_name_set_entry *e;
+	unsigned int *slot;
+
+	if ((ns->nr_names + 1) * 2 > ns->nr_slots && name_set_grow(ns))
+		return -1;
+
+	if (ns->pool_len + len > ns->pool_cap) {
+		size_t cap = ns->pool_cap ? ns->pool_cap : 1024;
+		unsigned short *pool;
+
+		while (ns->pool_len + len > cap)
+			cap *= 2;
+		pool = realloc(ns->pool, cap * sizeof(*pool));
+		if (!pool)
+			return -1;
+		ns->pool = pool;
+		ns->pool_cap = cap;
+	}
+
+	slot = name_set_lookup(ns, hash, name, len);
+	if (*slot != NAME_SET_EMPTY)
+		return 1;
+
+	e = &ns->names[ns->nr_names];
+	e->hash = hash;
+	e->len = len;
+	e->off = ns->pool_len;
+	memcpy(ns->pool + ns->pool_len, name, len * sizeof(*name));
+	ns->pool_len += len;
+	*slot = ns->nr_names++;
+	return 0;
+}
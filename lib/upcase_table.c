@@ -3,7 +3,16 @@
  *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
  */
 
-static const unsigned char upcase_table[EXFAT_UPCASE_TABLE_SIZE] = {
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+/*
+ * Compressed upcase table, read-only and shared by every tool. Linked
+ * into gen_upcase_checksum too, which computes its checksum at build
+ * time. The zeroes after it pad it to any sector size, so it can be
+ * written out as it is.
+ */
+const unsigned char exfat_upcase_table[EXFAT_UPCASE_TABLE_PADDED] = {
 	0x00, 0x00, 0x01, 0x00, 0x02, 0x00, 0x03, 0x00, 0x04, 0x00, 0x05, 0x00,
 	0x06, 0x00, 0x07, 0x00, 0x08, 0x00, 0x09, 0x00, 0x0A, 0x00, 0x0B, 0x00,
 	0x0C, 0x00, 0x0D, 0x00, 0x0E, 0x00, 0x0F, 0x00, 0x10, 0x00, 0x11, 0x00,
@@ -492,16 +501,3 @@ static const unsigned char upcase_table[EXFAT_UPCASE_TABLE_SIZE] = {
 	0xF8, 0xFF, 0xF9, 0xFF, 0xFA, 0xFF, 0xFB, 0xFF, 0xFC, 0xFF, 0xFD, 0xFF,
 	0xFE, 0xFF, 0xFF, 0xFF
 };
-
-int exfat_create_upcase_table(struct exfat_blk_dev *bd,
-		struct exfat_user_input *ui)
-{
-	int ut_off, nbytes;
-
-	lseek(bd->dev_fd, finfo.ut_byte_off, SEEK_SET);
-	nbytes = write(bd->dev_fd, upcase_table, EXFAT_UPCASE_TABLE_SIZE);
-	if (nbytes != EXFAT_UPCASE_TABLE_SIZE)
-		return -1;
-
-	return 0;
-}
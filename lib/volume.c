@@ -0,0 +1,436 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+#define EXFAT_MIN_SECT_SIZE_BITS	9
+#define EXFAT_MAX_SECT_SIZE_BITS	12
+#define EXFAT_MAX_CLU_SIZE_BITS		25
+#define EXFAT_MIN_FAT_OFFSET		(2 * BACKUP_BOOT_SEC_NUM)
+#define EXFAT_VOL_LOAD_CHUNK		(1024 * 1024)
+
+/*
+ * Read @len bytes at @off. When the volume is mapped the returned pointer
+ * points into the mapping and @buf is not touched, otherwise the data is
+ * read into @buf.
+ */
+const void *exfat_volume_read(struct exfat_volume *vol, void *buf,
+		size_t len, unsigned long long off)
+{
+	ssize_t nbytes;
+
+	if (off > vol->dev_size || len > vol->dev_size - off) {
+		exfat_msg(EXFAT_ERROR,
+			"read beyond the device, offset : %llu, len : %zu\n",
+			off, len);
+		return NULL;
+	}
+
+	if (vol->map)
+		return (const char *)vol->map + off;
+
+	nbytes = pread(vol->fd, buf, len, off);
+	if (nbytes != (ssize_t)len) {
+		exfat_msg(EXFAT_ERROR,
+			"read failed, offset : %llu, nbytes : %zd\n",
+			off, nbytes);
+		return NULL;
+	}
+	return buf;
+}
+
+const void *exfat_volume_read_cluster(struct exfat_volume *vol, void *buf,
+		unsigned int clu)
+{
+	if (!exfat_cluster_valid(vol, clu)) {
+		exfat_msg(EXFAT_ERROR, "invalid cluster : %u\n", clu);
+		return NULL;
+	}
+	return exfat_volume_read(vol, buf, vol->cluster_size,
+		exfat_cluster_offset(vol, clu));
+}
+
+/*
+ * Map a metadata area. Without a device mapping it is read into a buffer
+ * that exfat_volume_close() frees, as a batch of EXFAT_VOL_LOAD_CHUNK
+ * sized reads the I/O backend can have in flight together. Returns 0,
+ * -EIO if any read failed or came up short, or -1 on other errors.
+ */
+static int exfat_volume_load(struct exfat_volume *vol,
+		unsigned long long off, size_t len, void **data, bool *alloced)
+{
+	size_t done, chunk;
+	char *buf;
+	int ret = 0;
+
+	*alloced = false;
+	if (vol->map) {
+		*data = (char *)vol->map + off;
+		return 0;
+	}
+
+	if (off > vol->dev_size || len > vol->dev_size - off) {
+		exfat_msg(EXFAT_ERROR,
+			"read beyond the device, offset : %llu, len : %zu\n",
+			off, len);
+		return -1;
+	}
+
+	buf = malloc(len);
+	if (!buf) {
+		exfat_msg(EXFAT_ERROR, "Cannot allocate %zu bytes\n", len);
+		return -1;
+	}
+
+	for (done = 0; done < len; done += chunk) {
+		chunk = len - done < EXFAT_VOL_LOAD_CHUNK ? len - done :
+			EXFAT_VOL_LOAD_CHUNK;
+		if (exfat_io_read(&vol->io, buf + done, chunk, off + done)) {
+			ret = -EIO;
+			break;
+		}
+	}
+	/* the reads queued so far are waited for before the buffer goes */
+	if (exfat_io_flush(&vol->io))
+		ret = -EIO;
+	if (ret) {
+		exfat_msg(EXFAT_ERROR, "read failed, offset : %llu, len : %zu\n",
+			off, len);
+		free(buf);
+		return ret;
+	}
+	*data = buf;
+	*alloced = true;
+	return 0;
+}
+
+static int exfat_check_boot_sector(struct exfat_volume *vol,
+		const struct pbr *ppbr)
+{
+	const struct bsx64 *pbsx = &ppbr->bsx;
+	unsigned long long vol_len, fat_len, heap_end;
+	unsigned int i;
+
+	if (le16_to_cpu(ppbr->signature) != PBR_SIGNATURE ||
+	    memcmp(ppbr->bpb.oem_name, "EXFAT   ", 8)) {
+		exfat_msg(EXFAT_ERROR, "not an exFAT boot sector\n");
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(ppbr->bpb.res_zero); i++) {
+		if (ppbr->bpb.res_zero[i]) {
+			exfat_msg(EXFAT_ERROR,
+				"must be zero field is not zero\n");
+			return -1;
+		}
+	}
+
+	if (pbsx->sect_size_bits < EXFAT_MIN_SECT_SIZE_BITS ||
+	    pbsx->sect_size_bits > EXFAT_MAX_SECT_SIZE_BITS) {
+		exfat_msg(EXFAT_ERROR, "invalid sector size bits : %u\n",
+			pbsx->sect_size_bits);
+		return -1;
+	}
+
+	if (pbsx->sect_size_bits + pbsx->sect_per_clus_bits >
+	    EXFAT_MAX_CLU_SIZE_BITS) {
+		exfat_msg(EXFAT_ERROR, "invalid sectors per cluster bits : %u\n",
+			pbsx->sect_per_clus_bits);
+		return -1;
+	}
+
+	if (pbsx->num_fats != 1 && pbsx->num_fats != 2) {
+		exfat_msg(EXFAT_ERROR, "invalid number of FATs : %u\n",
+			pbsx->num_fats);
+		return -1;
+	}
+
+	vol->sector_size_bits = pbsx->sect_size_bits;
+	vol->sector_size = 1U << vol->sector_size_bits;
+	vol->cluster_size_bits = pbsx->sect_size_bits + pbsx->sect_per_clus_bits;
+	vol->cluster_size = 1U << vol->cluster_size_bits;
+	vol->clu_count = le32_to_cpu(pbsx->clu_count);
+	vol->root_clu = le32_to_cpu(pbsx->root_cluster);
+	vol->vol_flags = le16_to_cpu(pbsx->vol_flags);
+	vol->vol_serial = le32_to_cpu(pbsx->vol_serial);
+
+	vol_len = le64_to_cpu(pbsx->vol_length) << vol->sector_size_bits;
+	vol->fat_byte_off = (unsigned long long)le32_to_cpu(pbsx->fat_offset) <<
+		vol->sector_size_bits;
+	fat_len = (unsigned long long)le32_to_cpu(pbsx->fat_length) <<
+		vol->sector_size_bits;
+	vol->fat_byte_len = fat_len;
+	vol->heap_byte_off = (unsigned long long)le32_to_cpu(pbsx->clu_offset) <<
+		vol->sector_size_bits;
+	heap_end = vol->heap_byte_off +
+		((unsigned long long)vol->clu_count << vol->cluster_size_bits);
+
+	if (le32_to_cpu(pbsx->fat_offset) < EXFAT_MIN_FAT_OFFSET) {
+		exfat_msg(EXFAT_ERROR, "FAT overlaps the boot regions\n");
+		return -1;
+	}
+
+	if (fat_len < ((unsigned long long)vol->clu_count +
+		       EXFAT_FIRST_CLUSTER) * sizeof(__le32)) {
+		exfat_msg(EXFAT_ERROR, "FAT too small for %u clusters\n",
+			vol->clu_count);
+		return -1;
+	}
+
+	if (vol->heap_byte_off < vol->fat_byte_off + fat_len * pbsx->num_fats) {
+		exfat_msg(EXFAT_ERROR, "cluster heap overlaps the FAT\n");
+		return -1;
+	}
+
+	if (heap_end > vol_len) {
+		exfat_msg(EXFAT_ERROR, "cluster heap exceeds the volume\n");
+		return -1;
+	}
+
+	if (vol_len > vol->dev_size) {
+		exfat_msg(EXFAT_ERROR,
+			"volume length(%llu) exceeds the device(%llu)\n",
+			vol_len, vol->dev_size);
+		return -1;
+	}
+
+	if (!exfat_cluster_valid(vol, vol->root_clu)) {
+		exfat_msg(EXFAT_ERROR, "invalid root cluster : %u\n",
+			vol->root_clu);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Find the sector size of the boot region starting at @region_sec */
+static unsigned int exfat_probe_sector_size(struct exfat_volume *vol,
+		unsigned int region_sec)
+{
+	struct pbr pbr;
+	unsigned int bits;
+
+	for (bits = EXFAT_MIN_SECT_SIZE_BITS;
+	     bits <= EXFAT_MAX_SECT_SIZE_BITS; bits++) {
+		if (pread(vol->fd, &pbr, sizeof(pbr),
+			  (unsigned long long)region_sec << bits) !=
+		    sizeof(pbr))
+			return 0;
+		if (pbr.bsx.sect_size_bits == bits)
+			return 1U << bits;
+		/* the main boot region always starts at offset 0 */
+		if (!region_sec)
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Read either boot region, check the checksum and the geometry. Returns
+ * 0 on success, -1 if the region is not usable.
+ */
+static int exfat_load_boot_region(struct exfat_volume *vol,
+		unsigned int region_sec)
+{
+	size_t region_len;
+	char *region;
+	unsigned int sector_size;
+	int ret = -1;
+
+	sector_size = exfat_probe_sector_size(vol, region_sec);
+	if (!sector_size) {
+		exfat_msg(EXFAT_ERROR, "invalid sector size in boot sector\n");
+		return -1;
+	}
+
+	region_len = BACKUP_BOOT_SEC_NUM * sector_size;
+	region = malloc(region_len);
+	if (!region)
+		return -1;
+
+	if (pread(vol->fd, region, region_len,
+		  (unsigned long long)region_sec * sector_size) !=
+	    (ssize_t)region_len)
+		goto out;
+
+	memcpy(&vol->pbr, region, sizeof(vol->pbr));
+	if (exfat_check_boot_sector(vol, &vol->pbr))
+		goto out;
+
+	if (exfat_verify_boot_checksum(region, sector_size)) {
+		exfat_msg(EXFAT_ERROR, "boot region checksum mismatch\n");
+		goto out;
+	}
+
+	ret = 0;
+out:
+	free(region);
+	return ret;
+}
+
+/*
+ * Find the allocation bitmap and upcase table entries in the root
+ * directory. They are the critical primary entries every volume has.
+ */
+static int exfat_find_root_entries(struct exfat_volume *vol)
+{
+	unsigned int clu = vol->root_clu, nr_clus = 0;
+	unsigned int i, nr_dentries = vol->cluster_size / DENTRY_SIZE;
+	const struct exfat_dentry *ed;
+	void *buf;
+	int ret = -1;
+
+	buf = malloc(vol->cluster_size);
+	if (!buf)
+		return -1;
+
+	while (exfat_cluster_valid(vol, clu) && nr_clus++ < vol->clu_count) {
+		ed = exfat_volume_read_cluster(vol, buf, clu);
+		if (!ed)
+			goto out;
+
+		for (i = 0; i < nr_dentries; i++, ed++) {
+			switch (ed->type) {
+			case EXFAT_UNUSED:
+				goto done;
+			case EXFAT_BITMAP:
+				vol->bitmap_clu = le32_to_cpu(ed->bitmap_start_clu);
+				vol->bitmap_len = le64_to_cpu(ed->bitmap_size);
+				break;
+			case EXFAT_UPCASE:
+				vol->ut_clu = le32_to_cpu(ed->upcase_start_clu);
+				vol->ut_len = le64_to_cpu(ed->upcase_size);
+				vol->ut_checksum =
+					le32_to_cpu(ed->upcase_checksum);
+				break;
+			}
+		}
+		clu = exfat_fat_next(vol, clu);
+	}
+done:
+	if (!exfat_cluster_valid(vol, vol->bitmap_clu) ||
+	    vol->bitmap_len < round_up(vol->clu_count, 8) / 8) {
+		exfat_msg(EXFAT_ERROR, "no valid allocation bitmap entry\n");
+		goto out;
+	}
+
+	/* the bitmap is contiguous, it has no FAT chain guarantee though */
+	if (exfat_cluster_offset(vol, vol->bitmap_clu) + vol->bitmap_len >
+	    vol->dev_size) {
+		exfat_msg(EXFAT_ERROR, "allocation bitmap exceeds the device\n");
+		goto out;
+	}
+
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+int exfat_volume_open(struct exfat_volume *vol, const char *name,
+		unsigned int flags)
+{
+	long long dev_size;
+	void *data;
+	int ret = -1;
+
+	memset(vol, 0, sizeof(*vol));
+	vol->fd = open(name, O_RDONLY);
+	if (vol->fd < 0) {
+		exfat_msg(EXFAT_ERROR, "open failed : %s, %s\n", name,
+			strerror(errno));
+		return -1;
+	}
+
+	dev_size = lseek(vol->fd, 0, SEEK_END);
+	if (dev_size <= 0) {
+		exfat_msg(EXFAT_ERROR, "invalid device size(%s) : %lld\n",
+			name, dev_size);
+		goto err;
+	}
+	vol->dev_size = dev_size;
+	vol->ra_window = EXFAT_RA_WINDOW;
+	exfat_io_init(&vol->io, vol->fd, EXFAT_IO_URING, 0);
+
+	if (exfat_load_boot_region(vol, BOOT_SEC_NUM)) {
+		exfat_msg(EXFAT_ERROR, "main boot region is corrupted, "
+			"trying the backup boot region\n");
+		if (exfat_load_boot_region(vol, BACKUP_BOOT_SEC_NUM))
+			goto err;
+		vol->backup_boot = true;
+	}
+
+	/* zero-copy access through the page cache when it can be mapped */
+	if (!(flags & EXFAT_VOL_NO_MMAP)) {
+		vol->map = mmap(NULL, vol->dev_size, PROT_READ, MAP_SHARED,
+			vol->fd, 0);
+		if (vol->map == MAP_FAILED) {
+			exfat_msg(EXFAT_DEBUG, "mmap failed, using pread : %s\n",
+				strerror(errno));
+			vol->map = NULL;
+		}
+	}
+
+	ret = exfat_volume_load(vol, vol->fat_byte_off, vol->fat_byte_len,
+		&data, &vol->fat_alloced);
+	if (ret)
+		goto err;
+	vol->fat = data;
+	ret = -1;
+
+	if (exfat_find_root_entries(vol))
+		goto err;
+
+	ret = exfat_volume_load(vol,
+		exfat_cluster_offset(vol, vol->bitmap_clu), vol->bitmap_len,
+		&data, &vol->bitmap_alloced);
+	if (ret)
+		goto err;
+	vol->bitmap = data;
+
+	/* names are still walked without it, their hashes are not checked */
+	exfat_volume_load_upcase(vol);
+
+	exfat_msg(EXFAT_DEBUG, "Sector size : %u, cluster size : %u\n",
+		vol->sector_size, vol->cluster_size);
+	exfat_msg(EXFAT_DEBUG, "FAT offset : %llu, length : %llu\n",
+		vol->fat_byte_off, vol->fat_byte_len);
+	exfat_msg(EXFAT_DEBUG, "Cluster heap offset : %llu, count : %u\n",
+		vol->heap_byte_off, vol->clu_count);
+	exfat_msg(EXFAT_DEBUG, "Root cluster : %u, bitmap cluster : %u\n",
+		vol->root_clu, vol->bitmap_clu);
+	exfat_msg(EXFAT_DEBUG, "Access : %s\n", vol->map ? "mmap" : "pread");
+	return 0;
+err:
+	exfat_volume_close(vol);
+	return ret;
+}
+
+void exfat_volume_close(struct exfat_volume *vol)
+{
+	if (vol->upcase_alloced)
+		free((void *)vol->upcase);
+	if (vol->bitmap_alloced)
+		free(vol->bitmap);
+	if (vol->fat_alloced)
+		free(vol->fat);
+	if (vol->map)
+		munmap(vol->map, vol->dev_size);
+	if (vol->io.ops)
+		exfat_io_exit(&vol->io);
+	if (vol->fd >= 0)
+		close(vol->fd);
+	memset(vol, 0, sizeof(*vol));
+	vol->fd = -1;
+}
@@ -0,0 +1,728 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+#define EXFAT_MAX_DIR_SIZE	((unsigned long long)MAX_EXFAT_DENTRIES * \
+				 DENTRY_SIZE)
+#define WALK_INIT_CAPACITY	64
+
+struct walk_task {
+	unsigned int clu;
+	unsigned long long size;	/* 0 when only the FAT knows it */
+	bool contiguous;
+};
+
+/*
+ * Each worker owns a deque of directories. The owner pushes and pops at
+ * the tail, idle workers steal from the head, so a thief takes the oldest
+ * and usually biggest subtree.
+ */
+struct walk_deque {
+	pthread_mutex_t lock;
+	struct walk_task *tasks;
+	size_t head, tail, capacity;
+};
+
+struct walker;
+
+struct walk_worker {
+	pthread_t thread;
+	bool started;
+	struct walker *walker;
+	struct walk_deque deque;
+	char *dir_buf;
+	size_t dir_buf_len;
+	struct exfat_name_set names;
+	/* results local to this worker, merged once all are done */
+	struct exfat_walk_result res;
+	int error;
+};
+
+struct walker {
+	struct exfat_volume *vol;
+	unsigned int nr_workers;
+	struct walk_worker *workers;
+	/* directories queued or being parsed */
+	unsigned long pending;
+	/* a bit per cluster, set for the first cluster of each directory */
+	unsigned char *dirs_seen;
+	/* sorted runs of extents, NULL to keep every extent in memory */
+	struct exfat_extsort *spill;
+	size_t spill_extents;		/* extents a worker buffers */
+	/* a run could not be spilled, the walk cannot complete */
+	bool aborted;
+};
+
+static void *walk_grow(void *array, size_t *capacity, size_t size)
+{
+	size_t new_cap = *capacity ? *capacity * 2 : WALK_INIT_CAPACITY;
+	void *p = realloc(array, new_cap * size);
+
+	if (p)
+		*capacity = new_cap;
+	return p;
+}
+
+static int walk_push(struct walk_worker *w, struct walk_task *t)
+{
+	struct walk_deque *dq = &w->deque;
+	int ret = 0;
+
+	__atomic_add_fetch(&w->walker->pending, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail == dq->capacity) {
+		if (dq->head) {
+			memmove(dq->tasks, dq->tasks + dq->head,
+				(dq->tail - dq->head) * sizeof(*t));
+			dq->tail -= dq->head;
+			dq->head = 0;
+		} else {
+			struct walk_task *tasks = walk_grow(dq->tasks,
+				&dq->capacity, sizeof(*t));
+
+			if (!tasks) {
+				ret = -1;
+				goto out;
+			}
+			dq->tasks = tasks;
+		}
+	}
+	dq->tasks[dq->tail++] = *t;
+out:
+	pthread_mutex_unlock(&dq->lock);
+	if (ret)
+		__atomic_sub_fetch(&w->walker->pending, 1, __ATOMIC_SEQ_CST);
+	return ret;
+}
+
+/*
+ * Mark the directory starting at @clu as queued. Returns true if it was
+ * already, the tree then reaches it twice or loops back to it.
+ */
+static bool walk_dir_seen(struct walker *walker, unsigned int clu)
+{
+	unsigned int bit;
+	unsigned char mask;
+
+	/* walk_chain() counts the chain as broken */
+	if (!exfat_cluster_valid(walker->vol, clu))
+		return false;
+
+	bit = clu - EXFAT_FIRST_CLUSTER;
+	mask = 1 << (bit & 7);
+	return __atomic_fetch_or(&walker->dirs_seen[bit >> 3], mask,
+		__ATOMIC_RELAXED) & mask;
+}
+
+static bool walk_pop(struct walk_deque *dq, struct walk_task *t, bool steal)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->head < dq->tail) {
+		*t = steal ? dq->tasks[dq->head++] : dq->tasks[--dq->tail];
+		found = true;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
+
+static bool walk_steal(struct walk_worker *w, struct walk_task *t)
+{
+	struct walker *walker = w->walker;
+	unsigned int self = w - walker->workers, i;
+
+	for (i = 1; i < walker->nr_workers; i++) {
+		struct walk_worker *victim =
+			&walker->workers[(self + i) % walker->nr_workers];
+
+		if (walk_pop(&victim->deque, t, true))
+			return true;
+	}
+	return false;
+}
+
+static int walk_add_extent(struct walk_worker *w, unsigned int clu,
+		unsigned int nr_clus, unsigned int owner, bool dir)
+{
+	struct exfat_walk_result *res = &w->res;
+	struct exfat_walk_extent *e;
+
+	/* extend the last extent while the chain stays contiguous */
+	if (res->nr_extents) {
+		e = &res->extents[res->nr_extents - 1];
+		if (e->owner == owner && e->start_clu + e->nr_clus == clu) {
+			e->nr_clus += nr_clus;
+			return 0;
+		}
+	}
+
+	if (res->nr_extents == res->extents_cap) {
+		if (w->walker->spill && res->extents_cap) {
+			/* the buffer is full, it goes out as a sorted run */
+			if (__atomic_load_n(&w->walker->aborted,
+					__ATOMIC_RELAXED) ||
+			    exfat_extsort_add_run(w->walker->spill,
+					res->extents, res->nr_extents)) {
+				__atomic_store_n(&w->walker->aborted, true,
+					__ATOMIC_RELAXED);
+				return -1;
+			}
+			res->nr_extents = 0;
+		} else {
+			e = walk_grow(res->extents, &res->extents_cap,
+				sizeof(*e));
+			if (!e)
+				return -1;
+			res->extents = e;
+		}
+	}
+
+	e = &res->extents[res->nr_extents++];
+	e->start_clu = clu;
+	e->nr_clus = nr_clus;
+	e->owner = owner;
+	e->dir = dir;
+	return 0;
+}
+
+static int walk_add_collision(struct exfat_walk_result *res,
+		unsigned int dir_clu, unsigned short hash)
+{
+	struct exfat_name_collision *c;
+
+	if (res->nr_collisions == res->collisions_cap) {
+		c = walk_grow(res->collisions, &res->collisions_cap,
+			sizeof(*c));
+		if (!c)
+			return -1;
+		res->collisions = c;
+	}
+
+	c = &res->collisions[res->nr_collisions++];
+	c->dir_clu = dir_clu;
+	c->name_hash = hash;
+	return 0;
+}
+
+static int walk_add_bad_link(struct exfat_walk_result *res,
+		unsigned int clu, unsigned int next)
+{
+	struct exfat_bad_link *l;
+
+	if (res->nr_bad_links == res->bad_links_cap) {
+		l = walk_grow(res->bad_links, &res->bad_links_cap,
+			sizeof(*l));
+		if (!l)
+			return -1;
+		res->bad_links = l;
+	}
+
+	l = &res->bad_links[res->nr_bad_links++];
+	l->clu = clu;
+	l->next = next;
+	return 0;
+}
+
+/* Length of a FAT chain up to EOF, 0 if it is broken */
+static unsigned int walk_chain_len(struct exfat_volume *vol, unsigned int clu)
+{
+	unsigned int nr_clus = 0;
+
+	while (exfat_cluster_valid(vol, clu) && nr_clus < vol->clu_count) {
+		nr_clus++;
+		clu = exfat_fat_next(vol, clu);
+		if (clu == EXFAT_EOF_CLUSTER)
+			return nr_clus;
+	}
+	return 0;
+}
+
+/*
+ * Loops in a chain are found with Brent's method: each link is compared
+ * against a cluster saved every power of two steps, the steps since then
+ * give the length of the loop once it is found.
+ */
+struct walk_loop {
+	unsigned int mark, power, steps;
+};
+
+static void walk_loop_init(struct walk_loop *l, unsigned int clu)
+{
+	l->mark = clu;
+	l->power = 1;
+	l->steps = 0;
+}
+
+/* Returns true if the link to @next closes a loop */
+static bool walk_loop_step(struct walk_loop *l, unsigned int next)
+{
+	if (next == l->mark)
+		return true;
+	if (++l->steps == l->power) {
+		l->mark = next;
+		l->power <<= 1;
+		l->steps = 0;
+	}
+	return false;
+}
+
+/*
+ * The chain from @clu runs into a loop @l found. Keep the link closing it,
+ * from the last cluster before one repeats, as a bad link.
+ */
+static int walk_add_loop(struct walk_worker *w, unsigned int clu,
+		struct walk_loop *l)
+{
+	struct exfat_volume *vol = w->walker->vol;
+	unsigned int ahead = clu, last = clu, i;
+
+	for (i = 0; i <= l->steps; i++) {
+		last = ahead;
+		ahead = exfat_fat_next(vol, ahead);
+	}
+	while (ahead != clu) {
+		clu = exfat_fat_next(vol, clu);
+		last = ahead;
+		ahead = exfat_fat_next(vol, ahead);
+	}
+	return walk_add_bad_link(&w->res, last, clu);
+}
+
+/*
+ * Record the clusters of the object starting at @clu, owned by @clu. The
+ * FAT is followed for as many clusters as @size needs, unless the object
+ * is contiguous. With @read, the clusters are also read into the
+ * directory buffer, with the chain read ahead and a contiguous object
+ * read at once. Returns the number of clusters, 0 if the chain is broken
+ * before @size or on error. A chain that does not end at @size is counted
+ * as broken but its clusters up to @size are still returned, and the rest
+ * of it is followed to find a loop there. Links out of the heap or closing
+ * a loop are kept as bad links for the FAT check, only chains followed here
+ * are ever looked at.
+ */
+static unsigned int walk_chain(struct walk_worker *w, unsigned int clu,
+		unsigned long long size, bool contiguous, bool read)
+{
+	struct exfat_volume *vol = w->walker->vol;
+	struct exfat_readahead ra;
+	struct walk_loop loop;
+	unsigned int owner = clu, nr_clus, next, i;
+	unsigned long long count;
+	bool dir = read, looped = false;
+
+	if (!exfat_cluster_valid(vol, clu))
+		goto bad;
+
+	count = (size >> vol->cluster_size_bits) +
+		!!(size & (vol->cluster_size - 1));
+	if (count > vol->clu_count ||
+	    (contiguous && clu - EXFAT_FIRST_CLUSTER + count > vol->clu_count))
+		goto bad;
+	nr_clus = count;
+	walk_loop_init(&loop, clu);
+
+	if (read && (size_t)nr_clus << vol->cluster_size_bits >
+	    w->dir_buf_len) {
+		size_t len = (size_t)nr_clus << vol->cluster_size_bits;
+		char *buf = realloc(w->dir_buf, len);
+
+		if (!buf)
+			goto nomem;
+		w->dir_buf = buf;
+		w->dir_buf_len = len;
+	}
+
+	if (read && contiguous) {
+		size_t len = (size_t)nr_clus << vol->cluster_size_bits;
+		const void *src = exfat_volume_read(vol, w->dir_buf, len,
+			exfat_cluster_offset(vol, clu));
+
+		if (!src)
+			goto bad;
+		if (src != w->dir_buf)
+			memcpy(w->dir_buf, src, len);
+		read = false;
+	}
+
+	if (read)
+		exfat_ra_start(&ra, vol, clu, nr_clus, false);
+
+	for (i = 0; i < nr_clus; i++) {
+		if (!exfat_cluster_valid(vol, clu))
+			goto bad;
+
+		if (read) {
+			char *dst = w->dir_buf +
+				((size_t)i << vol->cluster_size_bits);
+			const void *src = exfat_volume_read_cluster(vol, dst,
+				clu);
+
+			if (!src)
+				goto bad;
+			if (src != dst)
+				memcpy(dst, src, vol->cluster_size);
+			exfat_ra_consume(&ra, 1);
+		}
+
+		if (contiguous) {
+			clu++;
+			continue;
+		}
+
+		if (walk_add_extent(w, clu, 1, owner, dir))
+			goto nomem;
+		next = exfat_fat_next(vol, clu);
+		if (next != EXFAT_EOF_CLUSTER &&
+		    (next == clu || !exfat_cluster_valid(vol, next))) {
+			if (walk_add_bad_link(&w->res, clu, next))
+				goto nomem;
+			if (i + 1 < nr_clus)
+				goto bad;
+		} else if (next != EXFAT_EOF_CLUSTER &&
+			   walk_loop_step(&loop, next)) {
+			if (walk_add_loop(w, owner, &loop))
+				goto nomem;
+			if (i + 1 < nr_clus)
+				goto bad;
+			looped = true;
+		}
+		clu = next;
+		if (clu == EXFAT_EOF_CLUSTER && i + 1 < nr_clus)
+			goto bad;
+	}
+
+	if (contiguous && walk_add_extent(w, owner, nr_clus, owner, dir))
+		goto nomem;
+	/* a chain going on past the size is broken too, its tail unowned */
+	if (!contiguous && clu != EXFAT_EOF_CLUSTER) {
+		w->res.nr_bad_chains++;
+		/* a chain of valid clusters ends or loops, Brent finds it */
+		while (!looped && exfat_cluster_valid(vol, clu)) {
+			next = exfat_fat_next(vol, clu);
+			if (walk_loop_step(&loop, next)) {
+				if (walk_add_loop(w, owner, &loop))
+					goto nomem;
+				break;
+			}
+			clu = next;
+		}
+	}
+	return nr_clus;
+bad:
+	w->res.nr_bad_chains++;
+	return 0;
+nomem:
+	w->error = -1;
+	return 0;
+}
+
+static void walk_dir(struct walk_worker *w, struct walk_task *t)
+{
+	struct exfat_volume *vol = w->walker->vol;
+	struct exfat_dentry_iter iter;
+	struct exfat_dentry_set set;
+	unsigned short name[EXFAT_MAX_NAME_LEN];
+	unsigned int nr_clus, name_len;
+	int ret, hash;
+
+	nr_clus = walk_chain(w, t->clu, t->size, t->contiguous, true);
+	if (!nr_clus)
+		return;
+
+	exfat_dentry_iter_init(&iter, w->dir_buf,
+		(size_t)nr_clus << vol->cluster_size_bits,
+		EXFAT_ITER_VERIFY_CHECKSUM);
+	exfat_name_set_reset(&w->names);
+
+	while ((ret = exfat_dentry_iter_next(&iter, &set))) {
+		struct walk_task sub;
+		unsigned int start_clu;
+		unsigned long long size;
+		bool contiguous;
+
+		if (ret < 0) {
+			w->res.nr_bad_sets++;
+			continue;
+		}
+
+		if (!set.checksum_ok)
+			w->res.nr_bad_checksums++;
+
+		/*
+		 * Without a usable upcase table names are compared as they
+		 * are and the stored hash is trusted.
+		 */
+		hash = exfat_upcase_name(vol->upcase, &set, name, &name_len);
+		if (hash < 0) {
+			w->res.nr_bad_sets++;
+			continue;
+		}
+		if (!vol->upcase)
+			hash = le16_to_cpu(set.stream->stream_name_hash);
+		else if (hash != le16_to_cpu(set.stream->stream_name_hash))
+			w->res.nr_bad_hashes++;
+
+		ret = exfat_name_set_insert(&w->names, hash, name, name_len);
+		if (ret < 0 ||
+		    (ret > 0 && walk_add_collision(&w->res, t->clu, hash))) {
+			w->error = -1;
+			return;
+		}
+
+		start_clu = le32_to_cpu(set.stream->stream_start_clu);
+		size = le64_to_cpu(set.stream->stream_size);
+		contiguous = set.stream->stream_flags & EXFAT_SF_CONTIGUOUS;
+
+		if (le16_to_cpu(set.file->file_attr) & ATTR_SUBDIR) {
+			w->res.nr_dirs++;
+			if (!size)
+				continue;
+			if (size > EXFAT_MAX_DIR_SIZE) {
+				w->res.nr_bad_chains++;
+				continue;
+			}
+			if (walk_dir_seen(w->walker, start_clu)) {
+				exfat_msg(EXFAT_ERROR,
+					"directory at cluster %u reached twice\n",
+					start_clu);
+				w->res.nr_bad_chains++;
+				continue;
+			}
+			sub.clu = start_clu;
+			sub.size = size;
+			sub.contiguous = contiguous;
+			if (walk_push(w, &sub))
+				w->error = -1;
+			continue;
+		}
+
+		w->res.nr_files++;
+		if (size)
+			walk_chain(w, start_clu, size, contiguous, false);
+	}
+}
+
+static void *walk_worker_fn(void *arg)
+{
+	struct walk_worker *w = arg;
+	struct walk_task t;
+
+	for (;;) {
+		if (__atomic_load_n(&w->walker->aborted, __ATOMIC_RELAXED))
+			break;
+		if (walk_pop(&w->deque, &t, false) || walk_steal(w, &t)) {
+			walk_dir(w, &t);
+			__atomic_sub_fetch(&w->walker->pending, 1,
+				__ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		/* nothing queued and nothing being parsed, we are done */
+		if (!__atomic_load_n(&w->walker->pending, __ATOMIC_SEQ_CST))
+			break;
+		sched_yield();
+	}
+	return NULL;
+}
+
+static int walk_merge(struct exfat_walk_result *res,
+		struct exfat_walk_result *r)
+{
+	if (r->nr_extents) {
+		struct exfat_walk_extent *e = realloc(res->extents,
+			(res->nr_extents + r->nr_extents) * sizeof(*e));
+
+		if (!e)
+			return -1;
+		memcpy(e + res->nr_extents, r->extents,
+			r->nr_extents * sizeof(*e));
+		res->extents = e;
+		res->nr_extents += r->nr_extents;
+		res->extents_cap = res->nr_extents;
+	}
+
+	if (r->nr_collisions) {
+		struct exfat_name_collision *c = realloc(res->collisions,
+			(res->nr_collisions + r->nr_collisions) * sizeof(*c));
+
+		if (!c)
+			return -1;
+		memcpy(c + res->nr_collisions, r->collisions,
+			r->nr_collisions * sizeof(*c));
+		res->collisions = c;
+		res->nr_collisions += r->nr_collisions;
+		res->collisions_cap = res->nr_collisions;
+	}
+
+	if (r->nr_bad_links) {
+		struct exfat_bad_link *l = realloc(res->bad_links,
+			(res->nr_bad_links + r->nr_bad_links) * sizeof(*l));
+
+		if (!l)
+			return -1;
+		memcpy(l + res->nr_bad_links, r->bad_links,
+			r->nr_bad_links * sizeof(*l));
+		res->bad_links = l;
+		res->nr_bad_links += r->nr_bad_links;
+		res->bad_links_cap = res->nr_bad_links;
+	}
+
+	res->nr_files += r->nr_files;
+	res->nr_dirs += r->nr_dirs;
+	res->nr_bad_sets += r->nr_bad_sets;
+	res->nr_bad_checksums += r->nr_bad_checksums;
+	res->nr_bad_chains += r->nr_bad_chains;
+	res->nr_bad_hashes += r->nr_bad_hashes;
+	return 0;
+}
+
+static int walk_tree(struct exfat_volume *vol, unsigned int nr_threads,
+		struct exfat_extsort *spill, struct exfat_walk_result *res)
+{
+	struct walker walker;
+	struct walk_worker *w0;
+	struct walk_task root;
+	unsigned int i;
+	int ret = 0;
+
+	memset(res, 0, sizeof(*res));
+	if (!nr_threads)
+		nr_threads = 1;
+
+	memset(&walker, 0, sizeof(walker));
+	walker.vol = vol;
+	walker.nr_workers = nr_threads;
+	walker.workers = calloc(nr_threads, sizeof(*walker.workers));
+	if (!walker.workers)
+		return -1;
+	walker.dirs_seen = calloc((vol->clu_count + 7) / 8, 1);
+	if (!walker.dirs_seen) {
+		free(walker.workers);
+		return -1;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		walker.workers[i].walker = &walker;
+		pthread_mutex_init(&walker.workers[i].deque.lock, NULL);
+	}
+
+	if (spill) {
+		walker.spill = spill;
+		walker.spill_extents = spill->run_extents / nr_threads;
+		if (!walker.spill_extents)
+			walker.spill_extents = 1;
+		for (i = 0; i < nr_threads; i++) {
+			struct exfat_walk_result *r = &walker.workers[i].res;
+
+			r->extents = malloc(walker.spill_extents *
+				sizeof(*r->extents));
+			if (!r->extents) {
+				ret = -1;
+				goto out;
+			}
+			r->extents_cap = walker.spill_extents;
+		}
+	}
+
+	/* the bitmap and upcase table are owned by the volume itself */
+	w0 = &walker.workers[0];
+	walk_chain(w0, vol->bitmap_clu, vol->bitmap_len, false, false);
+	if (vol->ut_clu)
+		walk_chain(w0, vol->ut_clu, vol->ut_len, false, false);
+
+	root.clu = vol->root_clu;
+	root.size = (unsigned long long)walk_chain_len(vol, vol->root_clu) <<
+		vol->cluster_size_bits;
+	root.contiguous = false;
+	walk_dir_seen(&walker, root.clu);
+	if (!root.size) {
+		exfat_msg(EXFAT_ERROR, "broken root directory chain\n");
+		w0->res.nr_bad_chains++;
+	} else if (walk_push(w0, &root)) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 1; i < nr_threads; i++) {
+		if (!pthread_create(&walker.workers[i].thread, NULL,
+				    walk_worker_fn, &walker.workers[i]))
+			walker.workers[i].started = true;
+	}
+	walk_worker_fn(w0);
+
+	for (i = 0; i < nr_threads; i++) {
+		struct walk_worker *w = &walker.workers[i];
+
+		if (w->started)
+			pthread_join(w->thread, NULL);
+		/* what is left in the buffer is the last run of the worker */
+		if (spill && !walker.aborted &&
+		    exfat_extsort_add_run(spill, w->res.extents,
+				w->res.nr_extents))
+			walker.aborted = true;
+		if (walker.aborted)
+			ret = -1;
+		if (spill)
+			w->res.nr_extents = 0;
+		if (w->error || walk_merge(res, &w->res))
+			ret = -1;
+	}
+out:
+	for (i = 0; i < nr_threads; i++) {
+		struct walk_worker *w = &walker.workers[i];
+
+		exfat_walk_result_free(&w->res);
+		free(w->deque.tasks);
+		free(w->dir_buf);
+		exfat_name_set_free(&w->names);
+		pthread_mutex_destroy(&w->deque.lock);
+	}
+	free(walker.workers);
+	free(walker.dirs_seen);
+	if (ret)
+		exfat_walk_result_free(res);
+	return ret;
+}
+
+/*
+ * Walk the whole directory tree with @nr_threads workers. Every cluster
+ * reached from the root directory, including the bitmap and upcase table,
+ * ends up in @res as an extent tagged with the first cluster of its
+ * owner.
+ */
+int exfat_walk_tree(struct exfat_volume *vol, unsigned int nr_threads,
+		struct exfat_walk_result *res)
+{
+	return walk_tree(vol, nr_threads, NULL, res);
+}
+
+/*
+ * Walk the tree like exfat_walk_tree(), but with the extents handed to
+ * @xs in sorted runs instead of kept in @res. Each worker buffers its
+ * share of the runs @xs sorts in memory, whatever the size of the tree.
+ */
+int exfat_walk_tree_spill(struct exfat_volume *vol, unsigned int nr_threads,
+		struct exfat_extsort *xs, struct exfat_walk_result *res)
+{
+	return walk_tree(vol, nr_threads, xs, res);
+}
+
+void exfat_walk_result_free(struct exfat_walk_result *res)
+{
+	free(res->extents);
+	free(res->collisions);
+	free(res->bad_links);
+	memset(res, 0, sizeof(*res));
+}
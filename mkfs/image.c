@@ -0,0 +1,394 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+#include "mkfs.h"
+
+#define IMAGE_INIT_EXTS		16
+#define IMAGE_MAGIC		"EXFATIMG"
+#define IMAGE_VERSION		1
+#define IMAGE_TABLE_ALIGN	4096
+
+/*
+ * A saved image is a sparse file laid out like the device: the metadata
+ * is at its device offset and everything else is a hole. Past the end of
+ * the device follow the table of recorded writes, so runs of zeroes can
+ * be told from holes, and the header with the geometry it was built for.
+ * The header is the last thing in the file.
+ */
+struct image_disk_ext {
+	__le64 off;
+	__le64 len;
+	__le32 flags;
+	__le32 phase;		/* MKFS_PHASE_*, only for the statistics */
+} __attribute__((packed));
+
+#define IMAGE_EXT_ZERO		0x0001
+
+struct image_disk_hdr {
+	char magic[8];
+	__le32 version;
+	__le32 nr_exts;
+	__le64 table_off;
+	__le64 discard_off;
+	__le64 size;
+	__le32 sector_size;
+	__le32 phys_sector_size;
+	__le32 io_min;
+	__le32 io_opt;
+	__le32 align_off;
+	__le32 erase_size;
+	__le32 cluster_size;
+	__le32 reserve_clusters;
+} __attribute__((packed));
+
+/*
+ * The metadata of a geometry is built once by running the usual create
+ * functions against a backend that records their writes instead of
+ * issuing them. The image is then written to every device of that
+ * geometry.
+ */
+
+static bool image_is_zero(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	/* the buffer is zero if its first byte is and it equals itself shifted */
+	return !len || (!p[0] && !memcmp(p, p + 1, len - 1));
+}
+
+static int image_record(struct exfat_io *io, const void *buf, size_t len,
+		unsigned long long off)
+{
+	struct mkfs_image *img = io->priv;
+	struct mkfs_image_ext *ext;
+
+	if (img->nr_exts == img->exts_cap) {
+		size_t cap = img->exts_cap ? img->exts_cap * 2 :
+			IMAGE_INIT_EXTS;
+
+		ext = realloc(img->exts, cap * sizeof(*ext));
+		if (!ext)
+			return -1;
+		img->exts = ext;
+		img->exts_cap = cap;
+	}
+
+	ext = &img->exts[img->nr_exts];
+	ext->off = off;
+	ext->len = len;
+	ext->buf = NULL;
+	ext->phase = img->phase;
+
+	/* zeroes are not kept, a discarded device does not even need them */
+	if (image_is_zero(buf, len)) {
+		if (len > img->zero_len)
+			img->zero_len = len;
+	} else {
+		ext->buf = exfat_pool_get(img->pool, len);
+		if (!ext->buf)
+			return -1;
+		memcpy(ext->buf, buf, len);
+	}
+
+	img->nr_exts++;
+	img->bytes += len;
+	return 0;
+}
+
+static const struct exfat_io_ops image_ops = {
+	.name	= "image",
+	.write	= image_record,
+};
+
+void mkfs_image_init(struct mkfs_image *img, struct exfat_buf_pool *pool,
+		struct exfat_io *io)
+{
+	memset(img, 0, sizeof(*img));
+	img->pool = pool;
+	exfat_io_init_ops(io, &image_ops, img);
+}
+
+void mkfs_image_free(struct mkfs_image *img)
+{
+	size_t i;
+
+	for (i = 0; i < img->nr_exts; i++)
+		exfat_pool_put(img->pool, img->exts[i].buf, img->exts[i].len);
+	free(img->exts);
+	memset(img, 0, sizeof(*img));
+}
+
+/*
+ * Find the first run of non-zero IMAGE_BLOCK_SIZE blocks of @buf at or
+ * after @pos, blocks counting from the start of @buf. Returns its offset
+ * and sets @run_len, or returns @len if the rest is zero.
+ */
+size_t mkfs_image_next_run(const char *buf, size_t len, size_t pos,
+		size_t *run_len)
+{
+	size_t end;
+
+	while (pos < len) {
+		size_t blk = len - pos < IMAGE_BLOCK_SIZE ? len - pos :
+			IMAGE_BLOCK_SIZE;
+
+		if (!image_is_zero(buf + pos, blk))
+			break;
+		pos += blk;
+	}
+
+	for (end = pos; end < len; ) {
+		size_t blk = len - end < IMAGE_BLOCK_SIZE ? len - end :
+			IMAGE_BLOCK_SIZE;
+
+		if (image_is_zero(buf + end, blk))
+			break;
+		end += blk;
+	}
+
+	*run_len = end - pos;
+	return pos;
+}
+
+/*
+ * Write the ranges of the image that hold data to @path, one
+ * "offset length" line in bytes for each, so a flashing tool can skip
+ * the rest. Adjacent ranges are merged.
+ */
+int mkfs_image_save_block_map(struct mkfs_image *img, const char *path)
+{
+	struct mkfs_image_ext *runs = NULL;
+	size_t nr_runs = 0, cap = 0, i;
+	unsigned long long mapped = 0;
+	FILE *fp;
+	int ret = -1;
+
+	for (i = 0; i < img->nr_exts; i++) {
+		struct mkfs_image_ext *ext = &img->exts[i];
+		size_t pos = 0, len;
+
+		if (!ext->buf)
+			continue;
+
+		while ((pos = mkfs_image_next_run(ext->buf, ext->len, pos,
+				&len)) < ext->len) {
+			unsigned long long off = ext->off + pos;
+
+			pos += len;
+			mapped += len;
+			if (nr_runs && runs[nr_runs - 1].off +
+			    runs[nr_runs - 1].len == off) {
+				runs[nr_runs - 1].len += len;
+				continue;
+			}
+
+			if (nr_runs == cap) {
+				struct mkfs_image_ext *p;
+
+				cap = cap ? cap * 2 : IMAGE_INIT_EXTS;
+				p = realloc(runs, cap * sizeof(*p));
+				if (!p)
+					goto out;
+				runs = p;
+			}
+			runs[nr_runs].off = off;
+			runs[nr_runs].len = len;
+			runs[nr_runs].buf = NULL;
+			nr_runs++;
+		}
+	}
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		exfat_msg(EXFAT_ERROR, "open failed : %s, %s\n", path,
+			strerror(errno));
+		goto out;
+	}
+
+	fprintf(fp, "# exfat block map, image size %llu, mapped %llu\n",
+		img->geo.size, mapped);
+	for (i = 0; i < nr_runs; i++)
+		fprintf(fp, "%llu %zu\n", runs[i].off, runs[i].len);
+
+	ret = fclose(fp) ? -1 : 0;
+	if (ret)
+		exfat_msg(EXFAT_ERROR, "write failed : %s, %s\n", path,
+			strerror(errno));
+	else
+		exfat_msg(EXFAT_DEBUG, "Block map : %zu ranges, %llu bytes\n",
+			nr_runs, mapped);
+out:
+	free(runs);
+	return ret;
+}
+
+/* Write @img to @path as a sparse image file, see struct image_disk_hdr */
+int mkfs_image_save(struct mkfs_image *img, const char *path)
+{
+	struct image_disk_ext *table;
+	struct image_disk_hdr hdr;
+	struct exfat_io io;
+	unsigned long long table_off;
+	size_t table_len, i;
+	int fd, ret = -1;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		exfat_msg(EXFAT_ERROR, "open failed : %s, %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	table_len = img->nr_exts * sizeof(*table);
+	table = calloc(1, table_len ? table_len : 1);
+	if (!table)
+		goto close;
+
+	exfat_io_init(&io, fd, EXFAT_IO_PSYNC, 0);
+	for (i = 0; i < img->nr_exts; i++) {
+		struct mkfs_image_ext *ext = &img->exts[i];
+
+		table[i].off = cpu_to_le64(ext->off);
+		table[i].len = cpu_to_le64(ext->len);
+		table[i].phase = cpu_to_le32(ext->phase);
+		if (!ext->buf)
+			table[i].flags = cpu_to_le32(IMAGE_EXT_ZERO);
+		else
+			exfat_io_write(&io, ext->buf, ext->len, ext->off);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+	table_off = round_up(img->geo.size, IMAGE_TABLE_ALIGN);
+	hdr.version = cpu_to_le32(IMAGE_VERSION);
+	hdr.nr_exts = cpu_to_le32(img->nr_exts);
+	hdr.table_off = cpu_to_le64(table_off);
+	hdr.discard_off = cpu_to_le64(img->discard_off);
+	hdr.size = cpu_to_le64(img->geo.size);
+	hdr.sector_size = cpu_to_le32(img->geo.sector_size);
+	hdr.phys_sector_size = cpu_to_le32(img->geo.phys_sector_size);
+	hdr.io_min = cpu_to_le32(img->geo.io_min);
+	hdr.io_opt = cpu_to_le32(img->geo.io_opt);
+	hdr.align_off = cpu_to_le32(img->geo.align_off);
+	hdr.erase_size = cpu_to_le32(img->geo.erase_size);
+	hdr.cluster_size = cpu_to_le32(img->geo.cluster_size);
+	hdr.reserve_clusters = cpu_to_le32(img->geo.reserve_clusters);
+
+	exfat_io_write(&io, table, table_len, table_off);
+	exfat_io_write(&io, &hdr, sizeof(hdr), table_off + table_len);
+	ret = exfat_io_sync(&io);
+	exfat_io_exit(&io);
+	free(table);
+	if (!ret)
+		exfat_msg(EXFAT_DEBUG, "Saved metadata image : %s\n", path);
+close:
+	close(fd);
+	return ret;
+}
+
+/* Read back an image saved by mkfs_image_save(), with its geometry */
+int mkfs_image_load(struct mkfs_image *img, struct exfat_buf_pool *pool,
+		const char *path)
+{
+	struct image_disk_ext *table = NULL;
+	struct image_disk_hdr hdr;
+	struct exfat_io io;
+	unsigned long long table_off;
+	unsigned int nr_exts, i;
+	struct stat st;
+	int fd, ret = -1;
+
+	memset(img, 0, sizeof(*img));
+	img->pool = pool;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		exfat_msg(EXFAT_ERROR, "open failed : %s, %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	exfat_io_init(&io, fd, EXFAT_IO_PSYNC, 0);
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(hdr) ||
+	    exfat_io_read(&io, &hdr, sizeof(hdr), st.st_size - sizeof(hdr)) ||
+	    memcmp(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic)) ||
+	    le32_to_cpu(hdr.version) != IMAGE_VERSION)
+		goto bad;
+
+	nr_exts = le32_to_cpu(hdr.nr_exts);
+	table_off = le64_to_cpu(hdr.table_off);
+	if (table_off + (unsigned long long)nr_exts * sizeof(*table) +
+	    sizeof(hdr) != (unsigned long long)st.st_size)
+		goto bad;
+
+	table = malloc((size_t)nr_exts * sizeof(*table) + 1);
+	img->exts = calloc(nr_exts + 1, sizeof(*img->exts));
+	if (!table || !img->exts)
+		goto out;
+	img->exts_cap = nr_exts + 1;
+	if (exfat_io_read(&io, table, nr_exts * sizeof(*table), table_off))
+		goto bad;
+
+	img->discard_off = le64_to_cpu(hdr.discard_off);
+	img->geo.size = le64_to_cpu(hdr.size);
+	img->geo.sector_size = le32_to_cpu(hdr.sector_size);
+	img->geo.phys_sector_size = le32_to_cpu(hdr.phys_sector_size);
+	img->geo.io_min = le32_to_cpu(hdr.io_min);
+	img->geo.io_opt = le32_to_cpu(hdr.io_opt);
+	img->geo.align_off = le32_to_cpu(hdr.align_off);
+	img->geo.erase_size = le32_to_cpu(hdr.erase_size);
+	img->geo.cluster_size = le32_to_cpu(hdr.cluster_size);
+	img->geo.reserve_clusters = le32_to_cpu(hdr.reserve_clusters);
+
+	for (i = 0; i < nr_exts; i++) {
+		struct mkfs_image_ext *ext = &img->exts[i];
+
+		ext->off = le64_to_cpu(table[i].off);
+		ext->len = le64_to_cpu(table[i].len);
+		ext->phase = le32_to_cpu(table[i].phase);
+		if (ext->off + ext->len > img->geo.size ||
+		    ext->phase >= MKFS_NR_PHASES)
+			goto bad;
+		img->nr_exts++;
+		img->bytes += ext->len;
+
+		if (le32_to_cpu(table[i].flags) & IMAGE_EXT_ZERO) {
+			if (ext->len > img->zero_len)
+				img->zero_len = ext->len;
+			continue;
+		}
+
+		ext->buf = exfat_pool_get(pool, ext->len);
+		if (!ext->buf || exfat_io_read(&io, ext->buf, ext->len,
+				ext->off))
+			goto bad;
+	}
+
+	if (!exfat_io_flush(&io)) {
+		exfat_msg(EXFAT_DEBUG, "Loaded metadata image : %s, "
+			"%zu extents\n", path, img->nr_exts);
+		ret = 0;
+		goto out;
+	}
+bad:
+	exfat_msg(EXFAT_ERROR, "%s is not a valid metadata image\n", path);
+out:
+	exfat_io_exit(&io);
+	close(fd);
+	free(table);
+	if (ret)
+		mkfs_image_free(img);
+	return ret;
+}
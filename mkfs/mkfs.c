@@ -3,6 +3,7 @@
  *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -11,28 +12,27 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "exfat_ondisk.h"
 #include "exfat_tools.h"
 #include "mkfs.h"
 
-static void calc_checksum(char *sector, unsigned short size,
-		bool is_boot_sec, unsigned int *checksum)
-{
-	unsigned int index;
+struct exfat_mkfs_info finfo;
 
-	for (index = 0; index < size; index++)
-	{
-		if (is_boot_sec == true &&
-		    ((index == 106) || (index == 107) || (index == 112)))
-			continue;
-		*checksum = ((*checksum & 1) ? 0x80000000 : 0) +
-			(*checksum >> 1) + (unsigned int)sector[index];
-	}
-}
+const char *mkfs_phase_names[MKFS_NR_PHASES] = {
+	[MKFS_PHASE_BOOT]	= "boot record",
+	[MKFS_PHASE_FAT]	= "FAT",
+	[MKFS_PHASE_BITMAP]	= "bitmap",
+	[MKFS_PHASE_UPCASE]	= "upcase",
+	[MKFS_PHASE_ROOT]	= "root dir",
+};
 
 static void exfat_setup_boot_sector(struct pbr *ppbr,
 		struct exfat_blk_dev *bd, struct exfat_user_input *ui)
@@ -54,11 +54,12 @@ static void exfat_setup_boot_sector(struct pbr *ppbr,
 	pbsx->fat_length = cpu_to_le32(finfo.fat_byte_len / bd->sector_size);
 	pbsx->clu_offset = cpu_to_le32(finfo.clu_byte_off / bd->sector_size);
 	pbsx->clu_count = cpu_to_le32(finfo.total_clu_cnt);
-	pbsx->root_cluster = cpu_to_le32(finfo.root_byte_off / ui->cluster_size);
-	pbsx->vol_serial = 1234;
+	pbsx->root_cluster = cpu_to_le32(finfo.root_start_clu);
+	/* patched for every device when the metadata image is written */
+	pbsx->vol_serial = 0;
 	pbsx->vol_flags = 0;
 	pbsx->sect_size_bits = bd->sector_size_bits;
-	pbsx->sect_per_clus_bits = ui->sec_per_clu / 32;
+	pbsx->sect_per_clus_bits = __builtin_ctz(ui->sec_per_clu);
 	pbsx->num_fats = 1;
 	/* fs_version[0] : minor and fs_version[1] : major */
 	pbsx->fs_version[0] = 0;
@@ -69,255 +70,323 @@ static void exfat_setup_boot_sector(struct pbr *ppbr,
 	ppbr->signature = cpu_to_le16(PBR_SIGNATURE);
 }
 
-static int exfat_write_sector(struct exfat_blk_dev *bd, void *buf, unsigned int sec_off)
-{
-	int bytes;
-	unsigned long long offset = sec_off * bd->sector_size;
-
-	lseek(bd->dev_fd, offset, SEEK_SET);
-	bytes = write(bd->dev_fd, buf, bd->sector_size);
-	if (bytes != bd->sector_size) {
-		exfat_msg(EXFAT_ERROR,
-			"write failed, sec_off : %u, bytes : %d\n", sec_off, bytes);
-		return -1;
-	}
-	return 0;
-}
-
-static int exfat_write_boot_sectors(struct exfat_blk_dev *bd,
-		struct exfat_user_input *ui, unsigned int *checksum)
+static void exfat_setup_boot_region(char *region, struct exfat_blk_dev *bd,
+		struct exfat_user_input *ui)
 {
-	struct pbr *ppbr;
-	int ret;
+	unsigned int sec_idx;
 
-	ppbr = malloc(sizeof(struct pbr));
-	if (!ppbr) {
-		exfat_msg(EXFAT_ERROR, "Cannot allocate pbr: out of memory\n");
-		return -1;
-	}
-	memset(ppbr, 0, sizeof(struct pbr));
+	memset(region, 0, BACKUP_BOOT_SEC_NUM * bd->sector_size);
 
-	exfat_setup_boot_sector(ppbr, bd, ui);
+	/* main boot sector */
+	exfat_setup_boot_sector((struct pbr *)region, bd, ui);
 
-	/* write main boot sector */
-	ret = exfat_write_sector(bd, ppbr, 0);
-	if (ret < 0) {
-		exfat_msg(EXFAT_ERROR,
-			"main boot sector write failed\n");
-		goto free_ppbr;
-	}
+	/* extended boot sectors */
+	for (sec_idx = EXBOOT_SEC_NUM; sec_idx <= EXBOOT_SEC8_NUM; sec_idx++) {
+		__le16 *signature = (__le16 *)(region +
+			(sec_idx + 1) * bd->sector_size - sizeof(__le16));
 
-	/* write backup boot sector */
-	ret = exfat_write_sector(bd, ppbr, 1);
-	if (ret < 0) {
-		exfat_msg(EXFAT_ERROR,
-			"main backup sector write failed\n");
-		goto free_ppbr;
+		*signature = cpu_to_le16(PBR_SIGNATURE);
 	}
 
-	calc_checksum((char *)ppbr, sizeof(struct pbr), true, checksum);
+	/* oem parameter sector */
+	memset(region + OEM_SEC_NUM * bd->sector_size, 0xFF, bd->sector_size);
 
-free_ppbr:
-	free(ppbr);
-	return 0;
+	exfat_set_boot_checksum(region, bd->sector_size);
 }
 
-static int exfat_write_extended_boot_sectors(struct exfat_blk_dev *bd,
-		unsigned int *checksum)
+/*
+ * Every format gets its own serial number, from the time of the format
+ * like other exFAT implementations, mixed with the index of the device
+ * so devices formatted together differ.
+ */
+static unsigned int exfat_new_serial(unsigned int index)
 {
-	int sec_idx;
-	struct expbr ep;
+	struct timespec ts;
 
-	memset(&ep, 0, EXBOOT_SEC8_NUM * bd->sector_size);
-	for (sec_idx = EXBOOT_SEC_NUM; sec_idx <= EXBOOT_SEC8_NUM; sec_idx++) {
-		int ret;
-
-		ep.eb[sec_idx - 1].signature = cpu_to_le16(0xAA55);
-		if (exfat_write_sector(bd, &ep, sec_idx)) {
-			exfat_msg(EXFAT_ERROR,
-				"extended boot sector write failed\n");
-			return -1;
-		}
-
-		calc_checksum((char *) &ep, sizeof(struct expbr), false, checksum);
-	}
-
-	return 0;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((unsigned int)ts.tv_sec << 16 ^ (unsigned int)ts.tv_sec) +
+		(unsigned int)(ts.tv_nsec / 1000) + index * 0x9E3779B9U;
 }
 
-static int exfat_write_oem_sector(struct exfat_blk_dev *bd,
-		unsigned int *checksum)
+/* The only thing that differs between devices sharing an image */
+static void exfat_patch_serial(char *region, unsigned int sector_size,
+		unsigned int serial)
 {
-	char *oem;
-
-	oem = malloc(bd->sector_size);
-	if (oem)
-		return -1;
-
-	memset(oem, 0xFF, bd->sector_size);
-	if (exfat_write_sector(bd, oem, OEM_SEC_NUM)) {
-		exfat_msg(EXFAT_ERROR,
-			"oem sector write failed\n");
-		return -1;
-	}
+	struct pbr *ppbr = (struct pbr *)region;
 
-	calc_checksum((char *)oem, bd->sector_size, false, checksum);
+	ppbr->bsx.vol_serial = cpu_to_le32(serial);
+	exfat_set_boot_checksum(region, sector_size);
 }
 
-static int exfat_write_checksum_sector(struct exfat_blk_dev *bd,
-		unsigned int checksum)
+static int exfat_create_volume_boot_record(struct exfat_blk_dev *bd,
+		struct exfat_user_input *ui)
 {
-	int *checksum_buf;
-
-	checksum_buf = malloc(bd->sector_size);
-	if (checksum_buf)
-		return -1;
+	size_t region_len = BACKUP_BOOT_SEC_NUM * bd->sector_size;
+	char *region;
+	int ret = 0;
 
-	memset(checksum_buf, checksum, bd->sector_size / sizeof(int));
-	if (exfat_write_sector(bd, checksum_buf, OEM_SEC_NUM)) {
+	region = exfat_pool_get(bd->pool, region_len);
+	if (!region) {
 		exfat_msg(EXFAT_ERROR,
-			"checksum sector write failed\n");
+			"Cannot allocate boot region: out of memory\n");
 		return -1;
 	}
-}
-
-static int exfat_create_volume_boot_record(struct exfat_blk_dev *bd,
-		struct exfat_user_input *ui)
-{
-	int ret;
-	unsigned int checksum;
-
-	ret = exfat_write_boot_sectors(bd, ui, &checksum);
-	if (ret)
-		return ret;
 
-	ret = exfat_write_extended_boot_sectors(bd, &checksum);
-	if (ret)
-		return ret;
+	exfat_setup_boot_region(region, bd, ui);
 
-	ret = exfat_write_oem_sector(bd, &checksum);
-	if (ret)
-		return ret;
+	/* main and backup boot regions, the same buffer is written twice */
+	if (exfat_io_write(bd->io, region, region_len, 0) ||
+	    exfat_io_write(bd->io, region, region_len, region_len)) {
+		exfat_msg(EXFAT_ERROR, "boot region write failed\n");
+		ret = -1;
+	}
 
-	ret = exfat_write_checksum_sector(bd, checksum);
+	exfat_io_defer_put(bd->io, bd->pool, region, region_len);
 	return ret;
 }
 
-static int write_fat_entry(int fd, unsigned int entry,
-		unsigned long long offset)
+static inline unsigned int exfat_fat_entry(unsigned int clu,
+		unsigned int count)
 {
-	int nbyte;
-
-	lseek(fd, finfo.fat_byte_off + (offset * sizeof(int)), SEEK_SET);
-	nbyte = write(fd, (char *) &entry, sizeof(unsigned int));
-	if (nbyte != sizeof(int)) {
-		exfat_msg(EXFAT_ERROR,
-			"write failed, offset : %llu, entry : %x\n",
-			offset, entry);
-		return -1;
-	}
+	/* fat entry 0 should be media type field(0xF8) */
+	if (clu == 0)
+		return 0xfffffff8;
+	/* fat entry 1 is historical precedence(0xFFFFFFFF) */
+	if (clu == 1)
+		return 0xffffffff;
+	/* bitmap, reserve, upcase table and root chains end with EOF */
+	if (clu + 1 == finfo.reserve_start_clu ||
+	    clu + 1 == finfo.ut_start_clu || clu + 1 == finfo.root_start_clu ||
+	    clu + 1 == count)
+		return EXFAT_EOF_CLUSTER;
+	return clu + 1;
 }
 
 static int exfat_create_fat_table(struct exfat_blk_dev *bd,
 		struct exfat_user_input *ui)
 {
-	int ret, clu, clu_cnt, bitmap_clu_cnt, ut_cnt, root_cnt;
-	int count;
-
-	/* fat entry 0 should be media type field(0xF8) */
-	ret = write_fat_entry(bd->dev_fd, 0xfffffff8, 0);
-	if (ret) {
-		exfat_msg(EXFAT_ERROR,
-			"fat 0 entry write failed\n");
-		return ret;
-	}
-
-	/* fat entry 1 is historical precedence(0xFFFFFFFF) */
-	ret = write_fat_entry(bd->dev_fd, 0xffffffff, 1);
-	if (ret) {
-		exfat_msg(EXFAT_ERROR,
-			"fat 1 entry write failed\n");
-		return ret;
-	}
+	__le32 *fat_buf;
+	unsigned int clu, count, buf_ents;
+	unsigned long long fat_len, off;
+	size_t buf_len;
 
-	/* write bitmap entries */
+	/* bitmap entries */
 	count = EXFAT_FIRST_CLUSTER;
 	count += round_up(finfo.bitmap_byte_len, ui->cluster_size) /
 		ui->cluster_size;
-	for (clu = EXFAT_FIRST_CLUSTER; clu < count; clu++) {
-		ret = write_fat_entry(bd->dev_fd, clu, clu);
-		if (ret) {
-			exfat_msg(EXFAT_ERROR,
-				"bitmap entry write failed, clu : %d\n", clu);
-			return ret;
-		}
-	}
 
-	/* write upcase table entries */
+	/* the growth reserve, a NoFatChain file but chained all the same */
+	finfo.reserve_start_clu = finfo.reserve_byte_len ? count : 0;
+	count += finfo.reserve_byte_len / ui->cluster_size;
+
+	/* upcase table entries */
+	finfo.ut_start_clu = count;
 	count += round_up(finfo.ut_byte_len, ui->cluster_size) /
 		ui->cluster_size;
-	finfo.ut_start_clu = clu;
-	for (; clu < count; clu++) {
-		ret = write_fat_entry(bd->dev_fd, clu, clu);
-		if (ret) {
+
+	/* root directory entries */
+	finfo.root_start_clu = count;
+	count += round_up(finfo.root_byte_len, ui->cluster_size) /
+		ui->cluster_size;
+
+	/*
+	 * Build the used head of the FAT in memory and queue it as sector
+	 * aligned writes of at most FAT_WRITE_CHUNK_SIZE bytes. Every chunk
+	 * has its own buffer, freed once the writes are done.
+	 */
+	fat_len = round_up((unsigned long long)count * sizeof(__le32),
+		bd->sector_size);
+	buf_len = fat_len < FAT_WRITE_CHUNK_SIZE ? fat_len :
+		FAT_WRITE_CHUNK_SIZE;
+	buf_ents = buf_len / sizeof(__le32);
+
+	for (off = 0, clu = 0; off < fat_len; off += buf_len) {
+		unsigned int i;
+
+		if (fat_len - off < buf_len)
+			buf_len = fat_len - off;
+
+		fat_buf = exfat_pool_zalloc(bd->pool, buf_len);
+		if (!fat_buf) {
 			exfat_msg(EXFAT_ERROR,
-				"upcase entry write failed, clu : %d\n", clu);
-			return ret;
+				"Cannot allocate fat: out of memory\n");
+			return -1;
 		}
-	}
 
-	/* write root directory entries */
-	count += finfo.root_byte_len / ui->cluster_size;
-	finfo.root_start_clu = clu;
-	for (; clu < count; clu++) {
-		ret = write_fat_entry(bd->dev_fd, clu, clu);
-		if (ret) {
+		for (i = 0; i < buf_ents && clu < count; i++, clu++)
+			fat_buf[i] = cpu_to_le32(exfat_fat_entry(clu, count));
+
+		if (exfat_io_write(bd->io, fat_buf, buf_len,
+				finfo.fat_byte_off + off)) {
 			exfat_msg(EXFAT_ERROR,
-				"root entry write failed, clu : %d\n", clu);
+				"fat write failed, offset : %llu\n", off);
+			exfat_io_defer_put(bd->io, bd->pool, fat_buf, buf_len);
+			return -1;
 		}
-			return ret;
+		exfat_io_defer_put(bd->io, bd->pool, fat_buf, buf_len);
 	}
 
 	finfo.used_clu_cnt = count;
 	exfat_msg(EXFAT_DEBUG, "Total used cluster count : %d\n", count);
+	return 0;
+}
+
+static int exfat_create_bitmap(struct exfat_blk_dev *bd)
+{
+	char *bitmap, *zero_win = NULL;
+	unsigned long long off, bitmap_len = finfo.bitmap_byte_len;
+	/* bit 0 stands for the first cluster of the heap */
+	unsigned long long used_bits = finfo.used_clu_cnt - EXFAT_FIRST_CLUSTER;
+	size_t win_len, buf_len;
+	int ret = 0;
+
+	/*
+	 * Write the bitmap in windows of at most BITMAP_WINDOW_SIZE bytes,
+	 * so peak memory does not depend on the volume size. Used clusters
+	 * are all at the head of the bitmap and only those windows get a
+	 * buffer of their own. The rest of the bitmap is written from one
+	 * shared zeroed window. The last window is padded to a whole sector,
+	 * the bitmap clusters have room for it.
+	 */
+	win_len = bitmap_len < BITMAP_WINDOW_SIZE ? bitmap_len :
+		BITMAP_WINDOW_SIZE;
+	buf_len = round_up(win_len, bd->sector_size);
+
+	for (off = 0; off < bitmap_len; off += win_len) {
+		unsigned long long first_bit = off << 3;
+
+		if (bitmap_len - off < win_len)
+			win_len = bitmap_len - off;
+
+		if (first_bit < used_bits) {
+			unsigned long long nbits = used_bits - first_bit;
+
+			bitmap = exfat_pool_zalloc(bd->pool, buf_len);
+			if (!bitmap)
+				goto nomem;
+			exfat_io_defer_put(bd->io, bd->pool, bitmap, buf_len);
+
+			if (nbits > (unsigned long long)win_len << 3)
+				nbits = (unsigned long long)win_len << 3;
+			exfat_set_bit_range(bitmap, 0, nbits);
+		} else {
+			if (!zero_win) {
+				zero_win = exfat_pool_zalloc(bd->pool, buf_len);
+				if (!zero_win)
+					goto nomem;
+				exfat_io_defer_put(bd->io, bd->pool, zero_win,
+					buf_len);
+			}
+			bitmap = zero_win;
+		}
 
+		if (exfat_io_write(bd->io, bitmap,
+				round_up(win_len, bd->sector_size),
+				finfo.bitmap_byte_off + off)) {
+			exfat_msg(EXFAT_ERROR,
+				"bitmap write failed, offset : %llu\n", off);
+			ret = -1;
+			break;
+		}
+	}
 	return ret;
+nomem:
+	exfat_msg(EXFAT_ERROR, "Cannot allocate bitmap: out of memory\n");
+	return -1;
 }
 
-static int exfat_create_bitmap(struct exfat_blk_dev *bd,
-		struct exfat_user_input *ui)
+/*
+ * With clusters of up to UPCASE_MERGE_SIZE, the upcase table and the head
+ * of the root directory right after it are written as one extent.
+ */
+static inline size_t exfat_upcase_merge_len(void)
 {
-	char *bitmap;
-	int i, nbytes;
+	unsigned long long len = finfo.root_byte_off - finfo.ut_byte_off;
 
-	bitmap = malloc(finfo.bitmap_byte_len);
-	if (!bitmap)
-		return -1;
-
-	for (i = 0; i < finfo.used_clu_cnt; i++)
-		exfat_set_bit(bd, bitmap, i);
+	return len <= UPCASE_MERGE_SIZE ? len : 0;
+}
 
-	lseek(bd->dev_fd, finfo.bitmap_byte_off, SEEK_SET);
-	nbytes = write(bd->dev_fd, bitmap, finfo.bitmap_byte_len);
-	if (nbytes != finfo.bitmap_byte_len)
-		exfat_msg(EXFAT_ERROR,
-			"write failed, nbytes : %d, bitmap_len : %d\n",
-			nbytes, finfo.bitmap_byte_len);
+static int exfat_create_upcase_table(struct exfat_blk_dev *bd)
+{
+	if (exfat_upcase_merge_len())
+		return 0;
+
+	/* the shared table is padded for this, the image keeps a copy */
+	if (exfat_io_write(bd->io, exfat_upcase_table,
+			round_up(EXFAT_UPCASE_TABLE_SIZE, bd->sector_size),
+			finfo.ut_byte_off)) {
+		exfat_msg(EXFAT_ERROR, "upcase table write failed\n");
 		return -1;
-
+	}
 	return 0;
 }
 
+/*
+ * The growth reserve is a hidden, read-only system file over the clusters
+ * after the bitmap, so nothing else gets them and fsck sees them in use.
+ */
+static void exfat_set_reserve_entries(struct exfat_dentry *ed)
+{
+	const char *name = EXFAT_GROW_RESERVE_NAME;
+	struct exfat_dentry_set set = {
+		.file = &ed[0], .stream = &ed[1], .name = &ed[2], .nr_names = 1,
+	};
+	unsigned short upcased[EXFAT_NAME_ENTRY_CHARS];
+	unsigned int len = strlen(name), i;
+	int hash;
+
+	ed[0].type = EXFAT_FILE;
+	ed[0].file_num_ext = 2;
+	ed[0].file_attr = cpu_to_le16(ATTR_READONLY | ATTR_HIDDEN |
+		ATTR_SYSTEM);
+
+	ed[1].type = EXFAT_STREAM;
+	ed[1].stream_flags = EXFAT_SF_ALLOC_POSSIBLE | EXFAT_SF_CONTIGUOUS;
+	ed[1].stream_name_len = len;
+	ed[1].stream_start_clu = cpu_to_le32(finfo.reserve_start_clu);
+	ed[1].stream_valid_size = cpu_to_le64(finfo.reserve_byte_len);
+	ed[1].stream_size = cpu_to_le64(finfo.reserve_byte_len);
+
+	ed[2].type = EXFAT_NAME;
+	for (i = 0; i < len; i++)
+		ed[2].name_unicode[i] = cpu_to_le16(name[i]);
+
+	hash = exfat_upcase_name(exfat_upcase_default(), &set, upcased, &len);
+	ed[1].stream_name_hash = cpu_to_le16(hash);
+	ed[0].file_checksum = cpu_to_le16(exfat_calc_dentry_set_checksum(ed,
+		3));
+}
+
 static int exfat_create_root_dir(struct exfat_blk_dev *bd,
 		struct exfat_user_input *ui)
 {
-	struct exfat_dentry ed[3];
-	int dentries_len = sizeof(struct exfat_dentry) * 3;
-	int nbytes;
+	struct exfat_dentry *ed;
+	size_t dentries_len = finfo.root_byte_len;
+	size_t root_len = ui->cluster_size, head_len;
+	size_t ut_len = exfat_upcase_merge_len();
+	char *buf;
+	int ret = 0;
+
+	/*
+	 * The rest of the root cluster has to read as unused entries. It is
+	 * written out as zeroes on its own, so a device the discard already
+	 * zeroed can skip it. The upcase table, if it goes along, is in the
+	 * same buffer before the root cluster.
+	 */
+	head_len = round_up(dentries_len, bd->sector_size);
+	buf = exfat_pool_zalloc(bd->pool, ut_len + root_len);
+	if (!buf) {
+		exfat_msg(EXFAT_ERROR,
+			"Cannot allocate root dir: out of memory\n");
+		return -1;
+	}
+	if (ut_len)
+		memcpy(buf, exfat_upcase_table, EXFAT_UPCASE_TABLE_SIZE);
+	ed = (struct exfat_dentry *)(buf + ut_len);
 
 	/* Set volume label entry */
 	ed[0].type = EXFAT_VOLUME;
-	strcpy(ed[0].vol_label, "EXFAT");
+	strcpy((char *)ed[0].vol_label, "EXFAT");
 	ed[0].vol_char_cnt = strlen("EXFAT");
 
 	/* Set bitmap entry */
@@ -328,20 +397,25 @@ static int exfat_create_root_dir(struct exfat_blk_dev *bd,
 
 	/* Set upcase table entry */
 	ed[2].type = EXFAT_UPCASE;
-	ed[2].upcase_checksum = cpu_to_le32(0xe619d30d);
+	ed[2].upcase_checksum = cpu_to_le32(exfat_upcase_table_checksum);
 	ed[2].upcase_start_clu = finfo.ut_start_clu;
 	ed[2].upcase_size = EXFAT_UPCASE_TABLE_SIZE;
 
-	lseek(bd->dev_fd, finfo.root_byte_off, SEEK_SET);
-	nbytes = write(bd->dev_fd, ed, dentries_len);
-	if (nbytes != dentries_len) {
-		exfat_msg(EXFAT_ERROR,
-			"write failed, nbytes : %d, dentries_len : %d\n",
-			nbytes, dentries_len);
-		return -1;
+	if (finfo.reserve_byte_len)
+		exfat_set_reserve_entries(&ed[3]);
+
+	if (exfat_io_write(bd->io, buf, ut_len + head_len,
+			finfo.root_byte_off - ut_len) ||
+	    (root_len > head_len &&
+	     exfat_io_write(bd->io, (char *)ed + head_len, root_len - head_len,
+			    finfo.root_byte_off + head_len))) {
+		exfat_msg(EXFAT_ERROR, "root dir write failed, root_len : %zu\n",
+			root_len);
+		ret = -1;
 	}
 
-	return 0;
+	exfat_io_defer_put(bd->io, bd->pool, buf, ut_len + root_len);
+	return ret;
 }
 
 static inline unsigned int sector_size_bits(unsigned int size)
@@ -354,16 +428,180 @@ static inline unsigned int sector_size_bits(unsigned int size)
 	return bits;
 }
 
+/*
+ * Read a block device attribute from sysfs, e.g. "queue/optimal_io_size".
+ * Partitions do not have their own queue and device directories, so fall
+ * back to the ones of the whole disk.
+ */
+static unsigned long long exfat_get_sysfs_attr(int fd, const char *attr)
+{
+	static const char * const fmts[] = {
+		"/sys/dev/block/%u:%u/%s",
+		"/sys/dev/block/%u:%u/../%s",
+	};
+	unsigned long long val = 0;
+	char path[PATH_MAX];
+	struct stat st;
+	FILE *fp;
+	unsigned int i;
+
+	if (fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode))
+		return 0;
+
+	for (i = 0; i < sizeof(fmts) / sizeof(fmts[0]); i++) {
+		snprintf(path, sizeof(path), fmts[i], major(st.st_rdev),
+			minor(st.st_rdev), attr);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		if (fscanf(fp, "%llu", &val) != 1)
+			val = 0;
+		fclose(fp);
+		break;
+	}
+	return val;
+}
+
+/*
+ * Tell the device that [@start, @start + @len) holds no data. Block devices
+ * get BLKDISCARD in DISCARD_CHUNK_SIZE pieces aligned to the discard
+ * granularity, falling back to BLKZEROOUT when discard is not supported.
+ * Holes are punched in regular files. Returns 1 if the range is known to
+ * read back as zeroes, 0 if not and -1 on error.
+ */
+static int exfat_discard_range(struct exfat_blk_dev *bd,
+		unsigned long long start, unsigned long long len)
+{
+	unsigned long long end = start + len, chunk, range[2];
+	unsigned int gran = bd->discard_granularity;
+	bool zeroout = false, discarded = false, trimmed;
+	struct stat st;
+
+	if (fstat(bd->dev_fd, &st) < 0)
+		return -1;
+
+	if (S_ISREG(st.st_mode)) {
+		if (fallocate(bd->dev_fd,
+			      FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      start, len) < 0) {
+			exfat_msg(EXFAT_DEBUG, "punch hole failed : %s\n",
+				strerror(errno));
+			return 0;
+		}
+		return 1;
+	}
+
+	if (!S_ISBLK(st.st_mode))
+		return 0;
+
+	if (gran < bd->sector_size)
+		gran = bd->sector_size;
+	trimmed = start % gran || end % gran;
+	start = round_up(start, gran);
+	end = round_down(end, gran);
+	chunk = round_down(DISCARD_CHUNK_SIZE, gran);
+	if (!chunk)
+		chunk = gran;
+
+	for (; start < end; start += range[1]) {
+		range[0] = start;
+		range[1] = end - start < chunk ? end - start : chunk;
+
+		if (!zeroout) {
+			if (!ioctl(bd->dev_fd, BLKDISCARD, &range)) {
+				discarded = true;
+				continue;
+			}
+			if (errno != EOPNOTSUPP && errno != ENOTTY &&
+			    errno != EINVAL)
+				goto err;
+			exfat_msg(EXFAT_DEBUG,
+				"discard not supported, zeroing out\n");
+			zeroout = true;
+		}
+
+		if (ioctl(bd->dev_fd, BLKZEROOUT, &range) < 0)
+			goto err;
+	}
+
+	/*
+	 * discarded blocks are not guaranteed to read back as zeroes, the
+	 * range only counts as zeroed if every chunk of it was zeroed out
+	 */
+	return zeroout && !discarded && !trimmed;
+err:
+	exfat_msg(EXFAT_ERROR, "discard failed, offset : %llu, len : %llu, %s\n",
+		range[0], range[1], strerror(errno));
+	return -1;
+}
+
+/*
+ * Discard everything but the boot regions, which are fully rewritten.
+ * Returns 1 if the FAT and cluster heap now read back as zeroes.
+ */
+static int exfat_discard_volume(struct exfat_blk_dev *bd,
+		unsigned long long fat_byte_off)
+{
+	int ret;
+
+	ret = exfat_discard_range(bd, fat_byte_off, bd->size - fat_byte_off);
+	if (ret < 0)
+		return ret;
+
+	exfat_msg(EXFAT_DEBUG, "Discarded FAT and cluster heap%s\n",
+		ret ? ", zeroed" : "");
+	return ret;
+}
+
+static void exfat_get_blk_dev_topology(struct exfat_blk_dev *bd)
+{
+	int align_off;
+
+	if (ioctl(bd->dev_fd, BLKPBSZGET, &bd->phys_sector_size) < 0 ||
+	    bd->phys_sector_size < bd->sector_size)
+		bd->phys_sector_size = bd->sector_size;
+	if (ioctl(bd->dev_fd, BLKIOMIN, &bd->io_min) < 0)
+		bd->io_min = 0;
+	if (ioctl(bd->dev_fd, BLKIOOPT, &bd->io_opt) < 0)
+		bd->io_opt = 0;
+	/* -1 means the device is misaligned with no usable offset */
+	if (ioctl(bd->dev_fd, BLKALIGNOFF, &align_off) < 0 || align_off < 0)
+		align_off = 0;
+	bd->align_off = align_off;
+
+	/* SD/MMC cards report their allocation unit here */
+	bd->erase_size = exfat_get_sysfs_attr(bd->dev_fd,
+		"device/preferred_erase_size");
+}
+
 static int exfat_get_blk_dev_info(struct exfat_user_input *ui, struct exfat_blk_dev *bd)
 {
 	int fd, ret = -1;
 	long long blk_dev_size;
 
-	fd = open(ui->dev_name, O_RDWR);
-	if (fd < 0)
-		return -1;
+	if (ui->image_size) {
+		struct stat st;
+
+		/* it is only truncated once every device can be formatted */
+		fd = open(ui->dev_name, O_RDWR | O_CREAT, 0644);
+		if (fd < 0)
+			return -1;
+		if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+			exfat_msg(EXFAT_ERROR, "%s is not a regular file\n",
+				ui->dev_name);
+			close(fd);
+			return -1;
+		}
+	} else {
+		fd = open(ui->dev_name, O_RDWR);
+		if (fd < 0)
+			return -1;
+	}
 
-	blk_dev_size = lseek(fd, 0, SEEK_END);
+	if (ui->image_size)
+		blk_dev_size = ui->image_size;
+	else
+		blk_dev_size = lseek(fd, 0, SEEK_END);
 	if (blk_dev_size <= 0) {
 		exfat_msg(EXFAT_ERROR, "invalid block device size(%s) : %lld\n",
 			ui->dev_name, blk_dev_size);
@@ -377,14 +615,21 @@ static int exfat_get_blk_dev_info(struct exfat_user_input *ui, struct exfat_blk_
 	if (ioctl(fd, BLKSSZGET, &bd->sector_size) < 0)
 		bd->sector_size = DEFAULT_SECTOR_SIZE;
 	bd->sector_size_bits = sector_size_bits(bd->sector_size);
+	bd->discard_granularity = exfat_get_sysfs_attr(fd,
+		"queue/discard_granularity");
 	bd->num_sectors = blk_dev_size / DEFAULT_SECTOR_SIZE;
-	bd->num_clusters = blk_dev_size / ui->cluster_size;
+	exfat_get_blk_dev_topology(bd);
 
 	exfat_msg(EXFAT_DEBUG, "Block device name : %s\n", ui->dev_name);
 	exfat_msg(EXFAT_DEBUG, "Block device size : %lld\n", bd->size);
 	exfat_msg(EXFAT_DEBUG, "Block sector size : %u\n", bd->sector_size);
 	exfat_msg(EXFAT_DEBUG, "Number of the sectors : %u\n", bd->num_sectors);
-	exfat_msg(EXFAT_DEBUG, "Number of the clusters : %u\n", bd->num_clusters);
+	exfat_msg(EXFAT_DEBUG, "Physical sector size : %u\n",
+		bd->phys_sector_size);
+	exfat_msg(EXFAT_DEBUG, "Minimum/optimal I/O size : %u/%u\n",
+		bd->io_min, bd->io_opt);
+	exfat_msg(EXFAT_DEBUG, "Alignment offset : %u\n", bd->align_off);
+	exfat_msg(EXFAT_DEBUG, "Erase size : %u\n", bd->erase_size);
 
 	ret = 0;
 	bd->dev_fd = fd;
@@ -394,8 +639,18 @@ out:
 
 static void usage(void)
 {       
-	fprintf(stderr, "Usage: mkfs.exfat\n");
+	fprintf(stderr, "Usage: mkfs.exfat [options] <device>...\n");
 	fprintf(stderr, "\t-c | --cluster-size\n");
+	fprintf(stderr, "\t-d | --discard\n");
+	fprintf(stderr, "\t-j | --jobs\n");
+	fprintf(stderr, "\t     --io-backend=psync|io_uring\n");
+	fprintf(stderr, "\t     --direct\n");
+	fprintf(stderr, "\t     --image=SIZE[K|M|G|T]\n");
+	fprintf(stderr, "\t     --reserve-growth=SIZE[K|M|G|T]\n");
+	fprintf(stderr, "\t     --block-map=FILE\n");
+	fprintf(stderr, "\t     --save-image=FILE\n");
+	fprintf(stderr, "\t     --load-image=FILE\n");
+	fprintf(stderr, "\t     --stats[=text|json]\n");
 	fprintf(stderr, "\t-V | --version\n");
 	fprintf(stderr, "\t-v | --verbose\n");
 	fprintf(stderr, "\t-h | --help\n");
@@ -411,6 +666,16 @@ static void show_version(void)
 
 static struct option opts[] = {
 	{"cluster-size",	required_argument,	NULL,	'c' },
+	{"discard",		no_argument,		NULL,	'd' },
+	{"io-backend",		required_argument,	NULL,	'I' },
+	{"jobs",		required_argument,	NULL,	'j' },
+	{"direct",		no_argument,		NULL,	'D' },
+	{"image",		required_argument,	NULL,	'i' },
+	{"reserve-growth",	required_argument,	NULL,	'R' },
+	{"block-map",		required_argument,	NULL,	'B' },
+	{"save-image",		required_argument,	NULL,	'S' },
+	{"load-image",		required_argument,	NULL,	'L' },
+	{"stats",		optional_argument,	NULL,	'T' },
 	{"version",		no_argument,		NULL,	'V' },
 	{"help",		no_argument,		NULL,	'h' },
 	{"?",			no_argument,		NULL,	'?' },
@@ -420,56 +685,596 @@ static struct option opts[] = {
 static void init_user_input(struct exfat_user_input *ui)
 {
 	memset(ui, 0, sizeof(struct exfat_user_input));
-	/*
-	 * Default cluster size, Need to adjust default cluster size
-	 * according to device size
-	 */
-	ui->cluster_size = 128 * 1024;
+	/* cluster size is picked from the volume size, unless given */
+	ui->cluster_size = 0;
+	ui->io_backend = EXFAT_IO_URING;
+}
+
+/* Default cluster size by volume size, as recommended by the spec */
+static unsigned int exfat_default_cluster_size(unsigned long long size)
+{
+	if (size <= 256ULL * 1024 * 1024)
+		return 4 * 1024;
+	if (size <= 32ULL * 1024 * 1024 * 1024)
+		return 32 * 1024;
+	return 128 * 1024;
 }
 
 static int verify_user_input(struct exfat_blk_dev *bd,
 		struct exfat_user_input *ui)
 {
+	if (ui->reserve_size && ui->reserve_size < bd->size) {
+		exfat_msg(EXFAT_ERROR, "growth reserve size(%llu) is smaller "
+			"than the device(%llu)\n", ui->reserve_size, bd->size);
+		return -1;
+	}
+
+	/* a volume made to grow gets the clusters of its largest size */
+	if (!ui->cluster_size)
+		ui->cluster_size = exfat_default_cluster_size(ui->reserve_size ?
+			ui->reserve_size : bd->size);
+
+	if (ui->cluster_size & (ui->cluster_size - 1) ||
+	    ui->cluster_size < bd->sector_size) {
+		exfat_msg(EXFAT_ERROR,
+			"invalid cluster size(%u), sector size : %u\n",
+			ui->cluster_size, bd->sector_size);
+		return -1;
+	}
+
+	if (ui->reserve_size / ui->cluster_size > EXFAT_MAX_NUM_CLUSTER) {
+		exfat_msg(EXFAT_ERROR, "growth reserve size(%llu) needs more "
+			"than %u clusters of %u bytes\n", ui->reserve_size,
+			EXFAT_MAX_NUM_CLUSTER, ui->cluster_size);
+		return -1;
+	}
+
 	ui->sec_per_clu = ui->cluster_size / bd->sector_size;
+	bd->num_clusters = bd->size / ui->cluster_size;
+	exfat_msg(EXFAT_DEBUG, "Cluster size : %u\n", ui->cluster_size);
+	exfat_msg(EXFAT_DEBUG, "Number of the clusters : %u\n",
+		bd->num_clusters);
 	return 0;
 }
 
-static void exfat_build_mkfs_info(struct exfat_blk_dev *bd,
+static unsigned long long exfat_gcd(unsigned long long a,
+		unsigned long long b)
+{
+	while (b) {
+		unsigned long long t = a % b;
+
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/*
+ * Pick the boundary the FAT and the cluster heap start on: a common
+ * multiple of the physical sector size, the minimum and optimal I/O sizes
+ * (RAID chunk and stripe width) and the erase size, at least 1MB like
+ * partitioning tools use. Hints that would push it past MAX_ALIGN_SIZE
+ * are ignored.
+ */
+static unsigned int exfat_get_align(struct exfat_blk_dev *bd)
+{
+	unsigned long long align = DEFAULT_ALIGN_SIZE;
+	unsigned int hints[] = {
+		bd->phys_sector_size, bd->io_min, bd->io_opt, bd->erase_size,
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(hints) / sizeof(hints[0]); i++) {
+		unsigned long long hint = hints[i], lcm;
+
+		if (!hint || hint % bd->sector_size)
+			continue;
+		/* stripe widths need not be a power of two */
+		lcm = align / exfat_gcd(align, hint) * hint;
+		if (lcm <= MAX_ALIGN_SIZE)
+			align = lcm;
+	}
+
+	return align;
+}
+
+/* Round @off up to the next aligned boundary past the alignment offset */
+static unsigned long long exfat_align_off(struct exfat_blk_dev *bd,
+		unsigned long long off)
+{
+	unsigned long long base = bd->align_off % finfo.align;
+
+	if (off <= base)
+		return base;
+	return base + (off - base + finfo.align - 1) / finfo.align *
+		finfo.align;
+}
+
+static int exfat_build_mkfs_info(struct exfat_blk_dev *bd,
 		struct exfat_user_input *ui)
 {
-	if (DEFAULT_CLUSTER_SIZE < ui->sec_per_clu)
-		finfo.fat_byte_off = ui->cluster_size;
-	else
-		finfo.fat_byte_off = DEFAULT_CLUSTER_SIZE;
-	finfo.fat_byte_len = round_up((bd->num_clusters * sizeof(int)),
-		ui->cluster_size);
-	finfo.clu_byte_off = round_up(finfo.fat_byte_off + finfo.fat_byte_len,
-		DEFAULT_CLUSTER_SIZE);
+	unsigned long long fat_clus;
+
+	finfo.align = exfat_get_align(bd);
+
+	/* the FAT goes past both boot regions on the first boundary */
+	finfo.fat_byte_off = exfat_align_off(bd,
+		2 * BACKUP_BOOT_SEC_NUM * bd->sector_size);
+	/* a FAT for the largest size to grow to, it only costs its space */
+	fat_clus = ui->reserve_size ? ui->reserve_size / ui->cluster_size :
+		bd->num_clusters;
+	finfo.fat_byte_len = round_up((fat_clus + EXFAT_FIRST_CLUSTER) *
+		sizeof(__le32), ui->cluster_size);
+	finfo.clu_byte_off = exfat_align_off(bd,
+		finfo.fat_byte_off + finfo.fat_byte_len);
 	finfo.total_clu_cnt = (bd->size - finfo.clu_byte_off) / ui->cluster_size;
-	finfo.bitmap_byte_off = EXFAT_REVERVED_CLUSTERS * ui->cluster_size;
+
+	/*
+	 * bitmap, upcase table and root directory from the first cluster.
+	 * To grow, the bitmap is followed by the clusters a bitmap for the
+	 * largest size needs more, held by the reserve file.
+	 */
+	finfo.bitmap_byte_off = finfo.clu_byte_off;
 	finfo.bitmap_byte_len = round_up(finfo.total_clu_cnt, 8) / 8;
-	finfo.ut_byte_off = round_up(finfo.bitmap_byte_off + finfo.bitmap_byte_len, ui->cluster_size);
-	finfo.ut_start_clu = finfo.ut_byte_off / ui->cluster_size;
+	finfo.reserve_byte_off = round_up(finfo.bitmap_byte_off +
+		finfo.bitmap_byte_len, ui->cluster_size);
+	finfo.reserve_byte_len = 0;
+	if (ui->reserve_size) {
+		unsigned long long max_clus = (ui->reserve_size -
+			finfo.clu_byte_off) / ui->cluster_size;
+
+		finfo.reserve_byte_len = round_up(round_up(max_clus, 8) / 8,
+			ui->cluster_size) - (finfo.reserve_byte_off -
+			finfo.bitmap_byte_off);
+	}
+	finfo.ut_byte_off = finfo.reserve_byte_off + finfo.reserve_byte_len;
+	finfo.ut_start_clu = EXFAT_FIRST_CLUSTER +
+		(finfo.ut_byte_off - finfo.clu_byte_off) / ui->cluster_size;
 	finfo.ut_byte_len = EXFAT_UPCASE_TABLE_SIZE;
 	finfo.root_byte_off = round_up(finfo.ut_byte_off + finfo.ut_byte_len, ui->cluster_size);
-	finfo.root_start_clu = finfo.root_byte_off / ui->cluster_size;
-	finfo.root_byte_len = sizeof(struct exfat_dentry) * 3;
+	finfo.root_start_clu = EXFAT_FIRST_CLUSTER +
+		(finfo.root_byte_off - finfo.clu_byte_off) / ui->cluster_size;
+	finfo.root_byte_len = sizeof(struct exfat_dentry) *
+		(finfo.reserve_byte_len ? 6 : 3);
+
+	exfat_msg(EXFAT_DEBUG, "Alignment : %u\n", finfo.align);
+	exfat_msg(EXFAT_DEBUG, "FAT offset : %llu, length : %llu\n",
+		finfo.fat_byte_off, finfo.fat_byte_len);
+	exfat_msg(EXFAT_DEBUG, "Cluster heap offset : %llu, count : %u\n",
+		finfo.clu_byte_off, finfo.total_clu_cnt);
+	if (finfo.reserve_byte_len)
+		exfat_msg(EXFAT_DEBUG, "Growth reserve : %llu bytes, up to "
+			"%llu bytes\n", finfo.reserve_byte_len,
+			ui->reserve_size);
+
+	if (finfo.root_byte_off + ui->cluster_size > bd->size) {
+		exfat_msg(EXFAT_ERROR, "device(%llu) too small for the "
+			"metadata, the FAT alone takes %llu\n", bd->size,
+			finfo.fat_byte_len);
+		return -1;
+	}
+	return 0;
+}
+
+static void exfat_get_geometry(struct mkfs_device *dev)
+{
+	struct mkfs_geometry *geo = &dev->geo;
+
+	memset(geo, 0, sizeof(*geo));
+	geo->size = dev->bd.size;
+	geo->sector_size = dev->bd.sector_size;
+	geo->phys_sector_size = dev->bd.phys_sector_size;
+	geo->io_min = dev->bd.io_min;
+	geo->io_opt = dev->bd.io_opt;
+	geo->align_off = dev->bd.align_off;
+	geo->erase_size = dev->bd.erase_size;
+	geo->cluster_size = dev->ui.cluster_size;
+	geo->reserve_clusters = dev->ui.reserve_size / dev->ui.cluster_size;
+}
+
+/*
+ * Devices of the same geometry get the same layout and so the same
+ * metadata image, but for the serial number.
+ */
+static bool exfat_same_geometry(struct mkfs_geometry *a,
+		struct mkfs_geometry *b)
+{
+	return a->size == b->size &&
+		a->sector_size == b->sector_size &&
+		a->phys_sector_size == b->phys_sector_size &&
+		a->io_min == b->io_min &&
+		a->io_opt == b->io_opt &&
+		a->align_off == b->align_off &&
+		a->erase_size == b->erase_size &&
+		a->cluster_size == b->cluster_size &&
+		a->reserve_clusters == b->reserve_clusters;
+}
+
+static inline void exfat_build_phase(struct mkfs_image *img,
+		struct exfat_stats *st, unsigned int phase)
+{
+	img->phase = phase;
+	exfat_stats_begin(st, mkfs_phase_names[phase]);
+}
+
+/*
+ * Lay out the volume of @dev and record its metadata writes in @img,
+ * each tagged with its phase. Only the CPU work is in @st, the writes
+ * are counted by the device they go to.
+ */
+static int exfat_build_image(struct mkfs_device *dev, struct mkfs_image *img,
+		struct exfat_buf_pool *pool, struct exfat_stats *st)
+{
+	struct exfat_blk_dev *bd = &dev->bd;
+	struct exfat_user_input *ui = &dev->ui;
+	struct exfat_io rec;
+	int ret;
+
+	if (exfat_build_mkfs_info(bd, ui))
+		return -1;
+
+	mkfs_image_init(img, pool, &rec);
+	img->discard_off = finfo.fat_byte_off;
+	img->geo = dev->geo;
+	bd->io = &rec;
+	bd->pool = pool;
+
+	exfat_build_phase(img, st, MKFS_PHASE_BOOT);
+	ret = exfat_create_volume_boot_record(bd, ui);
+	if (ret)
+		goto out;
+
+	exfat_build_phase(img, st, MKFS_PHASE_FAT);
+	ret = exfat_create_fat_table(bd, ui);
+	if (ret)
+		goto out;
+
+	exfat_build_phase(img, st, MKFS_PHASE_BITMAP);
+	ret = exfat_create_bitmap(bd);
+	if (ret)
+		goto out;
+
+	exfat_build_phase(img, st, MKFS_PHASE_UPCASE);
+	ret = exfat_create_upcase_table(bd);
+	if (ret)
+		goto out;
+
+	exfat_build_phase(img, st, MKFS_PHASE_ROOT);
+	ret = exfat_create_root_dir(bd, ui);
+out:
+	exfat_stats_end(st);
+	/* the image keeps copies, the buffers they came from go back */
+	if (exfat_io_flush(&rec))
+		ret = -1;
+	exfat_io_exit(&rec);
+	bd->io = NULL;
+
+	exfat_msg(EXFAT_DEBUG, "Metadata image : %zu extents, %llu bytes\n",
+		img->nr_exts, img->bytes);
+	return ret;
+}
+
+struct mkfs_ctx {
+	struct mkfs_device *devs;
+	unsigned int nr_devs;
+	unsigned int next;		/* next device to format */
+	unsigned int nr_done;
+	struct exfat_buf_pool *pool;
+	void *zero_buf;
+	size_t zero_len;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+};
+
+/*
+ * Both boot regions of the image, with the serial number of @dev patched
+ * in, are put in @region. Returns -1 if the image has no boot region.
+ */
+static int exfat_patch_boot_region(struct mkfs_device *dev, char *region,
+		size_t region_len)
+{
+	struct mkfs_image *img = dev->img;
+	size_t i;
+
+	for (i = 0; i < img->nr_exts; i++) {
+		struct mkfs_image_ext *ext = &img->exts[i];
+
+		if (ext->off == 0 && ext->len == region_len && ext->buf) {
+			memcpy(region, ext->buf, region_len);
+			exfat_patch_serial(region, dev->bd.sector_size,
+				dev->serial);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Write only the blocks of @buf that are not zero, what is skipped is
+ * left a hole of the image file.
+ */
+static int exfat_write_sparse(struct exfat_io *io, const char *buf,
+		size_t len, unsigned long long off)
+{
+	size_t pos = 0, run;
+
+	while ((pos = mkfs_image_next_run(buf, len, pos, &run)) < len) {
+		if (exfat_io_write(io, buf + pos, run, off + pos))
+			return -1;
+		pos += run;
+	}
+	return 0;
+}
+
+/* An image file starts over as one hole of the requested size */
+static int exfat_create_image_file(struct exfat_blk_dev *bd)
+{
+	if (ftruncate(bd->dev_fd, 0) < 0 ||
+	    ftruncate(bd->dev_fd, bd->size) < 0) {
+		exfat_msg(EXFAT_ERROR, "truncate failed : %s\n",
+			strerror(errno));
+		return -1;
+	}
+	return 1;
+}
+
+static inline void mkfs_step_add(struct mkfs_step *step,
+		unsigned long long off, size_t len)
+{
+	if (!step->bytes || off < step->start)
+		step->start = off;
+	if (off + len > step->end)
+		step->end = off + len;
+	step->bytes += len;
+}
+
+/*
+ * End a progress step: wait for its writes and start writing them back,
+ * then wait for the writeback of the step before and count that one
+ * done. Writeback of one step overlaps the writes of the next.
+ */
+static int exfat_end_step(struct mkfs_device *dev, struct exfat_io *io,
+		struct mkfs_step *cur, struct mkfs_step *prev)
+{
+	if (exfat_io_flush(io) ||
+	    exfat_io_writeback(io, cur->start, cur->end - cur->start, false))
+		return -1;
+
+	if (prev->bytes) {
+		if (exfat_io_writeback(io, prev->start,
+				prev->end - prev->start, true))
+			return -1;
+		__atomic_add_fetch(&dev->done, prev->bytes, __ATOMIC_RELAXED);
+	}
+	*prev = *cur;
+	memset(cur, 0, sizeof(*cur));
+	return 0;
+}
+
+/*
+ * Write the image of @dev as one batch, in device order. The batch is
+ * flushed every PROGRESS_STEP_SIZE bytes, and with statistics also where
+ * a phase ends, so each phase waits for its own writes. Each step is
+ * written back while the next one is written, and progress only counts
+ * steps that have been. A single fdatasync() of the device at the end
+ * flushes its cache, so formats of other devices never wait on it.
+ */
+static int exfat_write_image(struct mkfs_ctx *ctx, struct mkfs_device *dev)
+{
+	struct exfat_blk_dev *bd = &dev->bd;
+	struct mkfs_image *img = dev->img;
+	struct exfat_stats *st = &dev->stats;
+	size_t region_len = BACKUP_BOOT_SEC_NUM * bd->sector_size;
+	struct mkfs_step cur = { 0 }, prev = { 0 };
+	unsigned int phase = MKFS_NR_PHASES;
+	struct exfat_io io;
+	int zeroed = 0, ret = 0;
+	char *region;
+	size_t i;
+
+	region = exfat_pool_get(ctx->pool, region_len);
+	if (!region)
+		return -1;
+	if (exfat_patch_boot_region(dev, region, region_len)) {
+		exfat_msg(EXFAT_ERROR, "%s : metadata image has no boot region\n",
+			dev->ui.dev_name);
+		exfat_pool_put(ctx->pool, region, region_len);
+		return -1;
+	}
+
+	if (dev->ui.image_size || dev->ui.discard)
+		exfat_stats_begin(st, "discard");
+	if (dev->ui.image_size)
+		zeroed = exfat_create_image_file(bd);
+	else if (dev->ui.discard)
+		zeroed = exfat_discard_volume(bd, img->discard_off);
+	if (zeroed < 0) {
+		exfat_pool_put(ctx->pool, region, region_len);
+		return -1;
+	}
+
+	exfat_io_init(&io, bd->dev_fd, dev->ui.io_backend,
+		dev->ui.direct ? EXFAT_IO_DIRECT : 0);
+	exfat_io_register_buffer(&io, region, region_len);
+
+	/* the image is shared by all devices, each pins it for itself */
+	for (i = 0; i < img->nr_exts; i++)
+		if (img->exts[i].buf)
+			exfat_io_register_buffer(&io, img->exts[i].buf,
+				img->exts[i].len);
+	if (ctx->zero_buf)
+		exfat_io_register_buffer(&io, ctx->zero_buf, ctx->zero_len);
+
+	for (i = 0; i < img->nr_exts; i++) {
+		struct mkfs_image_ext *ext = &img->exts[i];
+		const void *buf = ext->buf ? ext->buf : ctx->zero_buf;
+
+		/* the main and backup boot regions carry the serial */
+		if (ext->buf && ext->len == region_len &&
+		    (ext->off == 0 || ext->off == region_len))
+			buf = region;
+
+		if (st->enabled && ext->phase != phase) {
+			ret = exfat_io_flush(&io);
+			if (ret)
+				break;
+			phase = ext->phase;
+			exfat_stats_begin(st, mkfs_phase_names[phase]);
+		}
+
+		mkfs_step_add(&cur, ext->off, ext->len);
+		if (ext->buf && dev->ui.image_size)
+			ret = exfat_write_sparse(&io, buf, ext->len, ext->off);
+		else if (ext->buf || !zeroed)
+			ret = exfat_io_write(&io, buf, ext->len, ext->off);
+		if (ret)
+			break;
+
+		if (cur.bytes >= PROGRESS_STEP_SIZE) {
+			ret = exfat_end_step(dev, &io, &cur, &prev);
+			if (ret)
+				break;
+		}
+	}
+
+	if (!ret) {
+		exfat_stats_begin(st, "sync");
+		ret = exfat_io_sync(&io);
+	}
+	exfat_stats_end(st);
+	if (!ret) {
+		__atomic_add_fetch(&dev->done, prev.bytes + cur.bytes,
+			__ATOMIC_RELAXED);
+		exfat_msg(EXFAT_DEBUG, "%s : %llu writes, %llu bytes\n",
+			dev->ui.dev_name, io.nr_writes, io.bytes_written);
+	} else {
+		exfat_msg(EXFAT_ERROR, "%s : metadata write failed\n",
+			dev->ui.dev_name);
+	}
+	exfat_io_exit(&io);
+	exfat_pool_put(ctx->pool, region, region_len);
+	return ret;
+}
+
+static void *exfat_mkfs_worker(void *arg)
+{
+	struct mkfs_ctx *ctx = arg;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) <
+	       ctx->nr_devs) {
+		struct mkfs_device *dev = &ctx->devs[i];
+
+		dev->ret = exfat_write_image(ctx, dev);
+
+		pthread_mutex_lock(&ctx->lock);
+		dev->finished = true;
+		ctx->nr_done++;
+		pthread_cond_signal(&ctx->done_cond);
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	return NULL;
+}
+
+/*
+ * Print the devices whose progress moved since the last call, and those
+ * that finished, each as soon as it is synced. A device can be taken
+ * out once it is reported done. Called with ctx->lock held.
+ */
+static void exfat_show_progress(struct mkfs_ctx *ctx, unsigned int *shown)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->nr_devs; i++) {
+		struct mkfs_device *dev = &ctx->devs[i];
+		unsigned long long done = __atomic_load_n(&dev->done,
+			__ATOMIC_RELAXED);
+		unsigned int perc = dev->img->bytes ?
+			done * 100 / dev->img->bytes : 100;
+
+		if (shown[i] == MKFS_SHOWN_FINISHED)
+			continue;
+		if (dev->finished) {
+			shown[i] = MKFS_SHOWN_FINISHED;
+			printf("%s: %s\n", dev->ui.dev_name,
+				dev->ret ? "failed" : "done");
+			continue;
+		}
+		if (perc == shown[i])
+			continue;
+		shown[i] = perc;
+		printf("%s: %u%%\n", dev->ui.dev_name, perc);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Format every device from a pool of @nr_jobs threads, each device with
+ * its own I/O backend, and wait for all of them.
+ */
+static void exfat_format_devices(struct mkfs_ctx *ctx, unsigned int nr_jobs)
+{
+	pthread_t *threads;
+	unsigned int *shown;
+	unsigned int i, started = 0;
+	struct timespec ts;
+
+	if (nr_jobs > ctx->nr_devs)
+		nr_jobs = ctx->nr_devs;
+
+	/* one device is formatted right here, with nothing to report */
+	threads = ctx->nr_devs > 1 ? calloc(nr_jobs, sizeof(*threads)) : NULL;
+	shown = ctx->nr_devs > 1 ? calloc(ctx->nr_devs, sizeof(*shown)) : NULL;
+	if (threads && shown) {
+		for (i = 0; i < nr_jobs; i++) {
+			if (pthread_create(&threads[i], NULL,
+					   exfat_mkfs_worker, ctx))
+				break;
+			started++;
+		}
+	}
+	if (!started)
+		exfat_mkfs_worker(ctx);
+
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx->nr_done < ctx->nr_devs) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&ctx->done_cond, &ctx->lock, &ts);
+		if (shown)
+			exfat_show_progress(ctx, shown);
+	}
+	if (shown)
+		exfat_show_progress(ctx, shown);
+	pthread_mutex_unlock(&ctx->lock);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	free(shown);
 }
 
 int main(int argc, char *argv[])
 {
 	int c;
-        int ret = EXIT_FAILURE;
-	char *blk_dev_name;
-	struct exfat_blk_dev bd;
+	int ret = EXIT_FAILURE;
+	struct mkfs_device *devs = NULL;
+	struct mkfs_image *imgs = NULL;
+	struct mkfs_ctx ctx;
+	struct exfat_buf_pool pool;
 	struct exfat_user_input ui;
+	struct exfat_stats stats, **sts;
+	int stats_format = EXFAT_STATS_OFF;
+	const char *save_path = NULL, *load_path = NULL, *map_path = NULL;
+	unsigned int nr_devs, nr_imgs = 0, nr_jobs = 0, nr_opened = 0;
+	unsigned int sector_size = 0, io_opt = 0, i, j;
 
 	init_user_input(&ui);
 
-        opterr = 0;
-        while ((c = getopt_long(argc, argv, "c:Vvh", opts, NULL)) != EOF)
-                switch (c) {
-                case 'c':
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "c:dj:Vvh", opts, NULL)) != EOF)
+		switch (c) {
+		case 'c':
 			ui.cluster_size = atoi(optarg);
 			if (ui.cluster_size > MAX_CLUSTER_SIZE) {
 				exfat_msg(EXFAT_ERROR,
@@ -478,52 +1283,205 @@ int main(int argc, char *argv[])
 				goto out;
 			}
 			break;
+		case 'd':
+			ui.discard = true;
+			break;
+		case 'D':
+			ui.direct = true;
+			break;
+		case 'I':
+			if (!strcmp(optarg, "psync"))
+				ui.io_backend = EXFAT_IO_PSYNC;
+			else if (!strcmp(optarg, "io_uring"))
+				ui.io_backend = EXFAT_IO_URING;
+			else
+				usage();
+			break;
+		case 'i':
+			if (exfat_parse_size(optarg, &ui.image_size) ||
+			    !ui.image_size) {
+				exfat_msg(EXFAT_ERROR, "invalid image size : %s\n",
+					optarg);
+				goto out;
+			}
+			break;
+		case 'R':
+			if (exfat_parse_size(optarg, &ui.reserve_size) ||
+			    !ui.reserve_size) {
+				exfat_msg(EXFAT_ERROR,
+					"invalid growth reserve size : %s\n",
+					optarg);
+				goto out;
+			}
+			break;
+		case 'B':
+			map_path = optarg;
+			break;
+		case 'S':
+			save_path = optarg;
+			break;
+		case 'L':
+			load_path = optarg;
+			break;
+		case 'T':
+			stats_format = exfat_stats_parse_format(optarg);
+			if (stats_format < 0)
+				usage();
+			break;
+		case 'j':
+			if (exfat_parse_count(optarg, EXFAT_MAX_THREADS,
+					&nr_jobs))
+				usage();
+			break;
 		case 'V':
 			show_version();
 			break;
-                case 'v':
+		case 'v':
 			print_level = EXFAT_DEBUG;
-                        break;
-                case '?':
-                case 'h':
-                default:
-                        usage();
-        }
-
-	if (argc - optind != 1)
+			break;
+		case '?':
+		case 'h':
+		default:
+			usage();
+		}
+
+	if (argc - optind < 1)
 		usage();
 
-	memset(ui.dev_name, 0, 255);
-	strncpy(ui.dev_name, argv[optind], 255);
+	nr_devs = argc - optind;
+	if (!nr_jobs)
+		nr_jobs = nr_devs;
 
-	ret = exfat_get_blk_dev_info(&ui, &bd);
-	if (ret < 0)
+	devs = calloc(nr_devs, sizeof(*devs));
+	/* one more for a loaded image no device may match */
+	imgs = calloc(nr_devs + 1, sizeof(*imgs));
+	if (!devs || !imgs)
 		goto out;
 
-	ret = verify_user_input(&bd, &ui);
-	if (ret < 0)
-		goto out;
+	exfat_stats_init(&stats, "mkfs", stats_format != EXFAT_STATS_OFF,
+		false);
+	exfat_stats_begin(&stats, "open");
 
-	exfat_build_mkfs_info(&bd, &ui);
+	/* nothing is written unless every device can be formatted */
+	for (i = 0; i < nr_devs; i++, nr_opened++) {
+		struct mkfs_device *dev = &devs[i];
 
-	ret = exfat_create_volume_boot_record(&bd, &ui);
-	if (ret)
-		goto out;
+		dev->ui = ui;
+		memset(dev->ui.dev_name, 0, sizeof(dev->ui.dev_name));
+		strncpy(dev->ui.dev_name, argv[optind + i],
+			sizeof(dev->ui.dev_name) - 1);
 
-	ret = exfat_create_fat_table(&bd, &ui);
-	if (ret)
-		goto out;
+		if (exfat_get_blk_dev_info(&dev->ui, &dev->bd) < 0) {
+			exfat_msg(EXFAT_ERROR, "cannot open %s\n",
+				dev->ui.dev_name);
+			goto close;
+		}
+		if (verify_user_input(&dev->bd, &dev->ui) < 0)
+			goto close_dev;
+		exfat_get_geometry(dev);
+		dev->serial = exfat_new_serial(i);
+		exfat_stats_init(&dev->stats, dev->ui.dev_name,
+			stats_format != EXFAT_STATS_OFF, true);
+
+		if (dev->bd.sector_size > sector_size)
+			sector_size = dev->bd.sector_size;
+		if (dev->bd.io_opt > io_opt)
+			io_opt = dev->bd.io_opt;
+	}
 
-	ret = exfat_create_bitmap(&bd, &ui);
-	if (ret)
-		goto out;
+	/* each device pins the buffers with its own backend */
+	exfat_pool_init(&pool, sector_size, io_opt, NULL);
 
-	ret = exfat_create_upcase_table(&bd, &ui);
-	if (ret)
-		goto out;
+	/* a cached image replaces the build for devices of its geometry */
+	if (load_path) {
+		exfat_stats_begin(&stats, "load image");
+		if (mkfs_image_load(&imgs[0], &pool, load_path))
+			goto free_imgs;
+		nr_imgs++;
+	}
+
+	/* the layout and metadata are built once per distinct geometry */
+	for (i = 0; i < nr_devs; i++) {
+		for (j = 0; j < nr_imgs; j++) {
+			if (exfat_same_geometry(&devs[i].geo, &imgs[j].geo)) {
+				devs[i].img = &imgs[j];
+				break;
+			}
+		}
+		if (devs[i].img)
+			continue;
+
+		if (load_path)
+			printf("%s: geometry differs from %s, building its "
+				"metadata\n", devs[i].ui.dev_name, load_path);
+		devs[i].img = &imgs[nr_imgs++];
+		if (exfat_build_image(&devs[i], devs[i].img, &pool, &stats))
+			goto free_imgs;
+	}
+
+	if (save_path) {
+		exfat_stats_begin(&stats, "save image");
+		if (mkfs_image_save(devs[0].img, save_path))
+			goto free_imgs;
+	}
+	if (map_path) {
+		exfat_stats_begin(&stats, "block map");
+		if (mkfs_image_save_block_map(devs[0].img, map_path))
+			goto free_imgs;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.devs = devs;
+	ctx.nr_devs = nr_devs;
+	ctx.pool = &pool;
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.done_cond, NULL);
+	for (i = 0; i < nr_imgs; i++)
+		if (imgs[i].zero_len > ctx.zero_len)
+			ctx.zero_len = imgs[i].zero_len;
+	if (ctx.zero_len) {
+		ctx.zero_buf = exfat_pool_zalloc(&pool, ctx.zero_len);
+		if (!ctx.zero_buf)
+			goto destroy_ctx;
+	}
 
-	ret = exfat_create_root_dir(&bd, &ui);
+	/* every device has its own phases, this is all of them at once */
+	exfat_stats_begin(&stats, "format");
+	exfat_format_devices(&ctx, nr_jobs);
+	exfat_stats_end(&stats);
 
+	ret = 0;
+	for (i = 0; i < nr_devs; i++)
+		if (devs[i].ret)
+			ret = -1;
+
+	exfat_pool_put(&pool, ctx.zero_buf, ctx.zero_len);
+destroy_ctx:
+	pthread_cond_destroy(&ctx.done_cond);
+	pthread_mutex_destroy(&ctx.lock);
+free_imgs:
+	for (i = 0; i < nr_imgs; i++)
+		mkfs_image_free(&imgs[i]);
+
+	sts = stats_format ? calloc(nr_devs + 1, sizeof(*sts)) : NULL;
+	if (sts) {
+		sts[0] = &stats;
+		for (i = 0; i < nr_devs; i++)
+			sts[i + 1] = &devs[i].stats;
+		exfat_stats_report(sts, nr_devs + 1, stats_format, stderr);
+		free(sts);
+	}
+	exfat_msg(EXFAT_DEBUG, "Buffer pool : %llu allocated, %llu recycled\n",
+		pool.nr_allocated, pool.nr_recycled);
+	exfat_pool_destroy(&pool);
+	goto close;
+close_dev:
+	nr_opened++;
+close:
+	for (i = 0; i < nr_opened; i++)
+		close(devs[i].bd.dev_fd);
 out:
+	free(devs);
+	free(imgs);
 	return ret;
 }
@@ -0,0 +1,34 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-or-later
+#
+# A directory looping back into the tree is reported as an error and not
+# walked again, fsck has to finish with errors left and dump has to report
+# the cycle.
+
+: "${top_builddir:=..}"
+img=dir_loop.img
+
+rm -f "$img"
+dd if=/dev/zero of="$img" bs=1M count=0 seek=64 2>/dev/null || exit 99
+"$top_builddir/mkfs/mkfs.exfat" "$img" >/dev/null || exit 99
+./mkdirloop "$img" || exit 99
+
+# a walk that loops never returns, give it far more time than it needs
+for threads in 1 4; do
+	timeout 60 "$top_builddir/fsck/fsck.exfat" -j "$threads" "$img"
+	ret=$?
+	if [ $ret -ne 4 ]; then
+		echo "fsck.exfat -j $threads exited with $ret, expected 4" >&2
+		exit 1
+	fi
+done
+
+timeout 60 "$top_builddir/dump/dump.exfat" "$img" 2>dir_loop.err >/dev/null
+ret=$?
+if [ $ret -ne 0 ] || ! grep -q "directory cycle" dir_loop.err; then
+	echo "dump.exfat exited with $ret, cycle not reported" >&2
+	exit 1
+fi
+
+rm -f "$img" dir_loop.err
+exit 0
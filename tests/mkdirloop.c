@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2019 Namjae Jeon <linkinjeon@gmail.com>
+ */
+
+/*
+ * Add a directory looping back into the tree to a freshly made volume: a
+ * "loop" directory in the root with a "self" entry pointing at itself and
+ * an "up" entry pointing at the root.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "exfat_ondisk.h"
+#include "exfat_tools.h"
+
+/* Fill the entry set of a subdirectory @name starting at @clu */
+static void mkdirloop_set_entries(struct exfat_dentry *ed, const char *name,
+		unsigned int clu, unsigned int size)
+{
+	struct exfat_dentry_set set = {
+		.file = &ed[0], .stream = &ed[1], .name = &ed[2], .nr_names = 1,
+	};
+	unsigned short upcased[EXFAT_NAME_ENTRY_CHARS];
+	unsigned int len = strlen(name), i;
+	int hash;
+
+	memset(ed, 0, 3 * sizeof(*ed));
+	ed[0].type = EXFAT_FILE;
+	ed[0].file_num_ext = 2;
+	ed[0].file_attr = cpu_to_le16(ATTR_SUBDIR);
+
+	ed[1].type = EXFAT_STREAM;
+	ed[1].stream_flags = EXFAT_SF_ALLOC_POSSIBLE | EXFAT_SF_CONTIGUOUS;
+	ed[1].stream_name_len = len;
+	ed[1].stream_start_clu = cpu_to_le32(clu);
+	ed[1].stream_valid_size = cpu_to_le64(size);
+	ed[1].stream_size = cpu_to_le64(size);
+
+	ed[2].type = EXFAT_NAME;
+	for (i = 0; i < len; i++)
+		ed[2].name_unicode[i] = cpu_to_le16(name[i]);
+
+	hash = exfat_upcase_name(exfat_upcase_default(), &set, upcased, &len);
+	ed[1].stream_name_hash = cpu_to_le16(hash);
+	ed[0].file_checksum = cpu_to_le16(exfat_calc_dentry_set_checksum(ed,
+		3));
+}
+
+int main(int argc, char *argv[])
+{
+	struct exfat_volume vol;
+	struct exfat_dentry *ed;
+	unsigned int clu, nr_dentries, i;
+	unsigned long long bitmap_off;
+	unsigned char bits;
+	char *buf = NULL;
+	int fd = -1, ret = EXIT_FAILURE;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <image>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (exfat_volume_open(&vol, argv[1], EXFAT_VOL_NO_MMAP))
+		return EXIT_FAILURE;
+
+	fd = open(argv[1], O_RDWR);
+	buf = calloc(1, vol.cluster_size);
+	if (fd < 0 || !buf)
+		goto out;
+
+	/* the first free cluster becomes the looping directory */
+	for (clu = 0; clu < vol.clu_count; clu++)
+		if (!(vol.bitmap[clu >> 3] & (1 << (clu & 7))))
+			break;
+	if (clu == vol.clu_count)
+		goto out;
+	bitmap_off = exfat_cluster_offset(&vol, vol.bitmap_clu) + (clu >> 3);
+	bits = vol.bitmap[clu >> 3] | 1 << (clu & 7);
+	clu += EXFAT_FIRST_CLUSTER;
+
+	ed = (struct exfat_dentry *)buf;
+	mkdirloop_set_entries(&ed[0], "self", clu, vol.cluster_size);
+	mkdirloop_set_entries(&ed[3], "up", vol.root_clu, vol.cluster_size);
+	if (pwrite(fd, buf, vol.cluster_size, exfat_cluster_offset(&vol, clu)) !=
+	    (ssize_t)vol.cluster_size ||
+	    pwrite(fd, &bits, 1, bitmap_off) != 1)
+		goto out;
+
+	/* and is added at the end of the root directory */
+	if (pread(fd, buf, vol.cluster_size,
+		  exfat_cluster_offset(&vol, vol.root_clu)) !=
+	    (ssize_t)vol.cluster_size)
+		goto out;
+	nr_dentries = vol.cluster_size / DENTRY_SIZE;
+	for (i = 0; i + 3 <= nr_dentries; i++)
+		if (ed[i].type == EXFAT_UNUSED)
+			break;
+	if (i + 3 > nr_dentries)
+		goto out;
+	mkdirloop_set_entries(&ed[i], "loop", clu, vol.cluster_size);
+	if (pwrite(fd, buf, vol.cluster_size,
+		   exfat_cluster_offset(&vol, vol.root_clu)) !=
+	    (ssize_t)vol.cluster_size)
+		goto out;
+	ret = EXIT_SUCCESS;
+out:
+	if (ret != EXIT_SUCCESS)
+		fprintf(stderr, "%s: cannot add the directory loop\n", argv[1]);
+	free(buf);
+	if (fd >= 0)
+		close(fd);
+	exfat_volume_close(&vol);
+	return ret;
+}